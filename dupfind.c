@@ -39,11 +39,18 @@
  * specified on the command line (list, link or delete) is applied.
  */
 
+/* For splice(2) and F_SETPIPE_SZ */
+
+#define _GNU_SOURCE
+
 /* ANSI C Headers */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <setjmp.h>
 
 /* GNU Headers */
 
@@ -51,14 +58,33 @@
 #include <glib.h>
 #include <gcrypt.h>
 #include <getopt.h>
+#include <zlib.h>
+
+/* Local Headers */
+
+#include "dupfind.h"
+#include "md5.h"
 
 /* Linux/Unix Headers */
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <linux/magic.h>
+#include <linux/fsverity.h>
+#include <linux/if_alg.h>
 
 /* Flag values for command line options */
 
@@ -75,19 +101,155 @@ enum
     OPT_DELETE	  = 0x100,
     OPT_LINK	  = 0x200,
     OPT_STDIN	  = 0x400,
-    OPT_VERBOSE	  = 0x800
+    OPT_VERBOSE	  = 0x800,
+    OPT_ANY	  = 0x1000,
+    OPT_FULLSCAN  = 0x2000,
+    OPT_MISSING	  = 0x4000,
+    OPT_CROSS	  = 0x8000,
+    OPT_TWOPASS	  = 0x10000
+};
+
+/* Values for command line options that have no single letter form */
+
+enum
+{
+    LOPT_SAVE_REF = 0x100,
+    LOPT_LOAD_REF,
+    LOPT_MEMLIMIT,
+    LOPT_SCRATCH,
+    LOPT_SHARDS,
+    LOPT_EXPORT,
+    LOPT_NODE,
+    LOPT_MERGE,
+    LOPT_AGENT,
+    LOPT_AGGREGATE,
+    LOPT_NAGENTS,
+    LOPT_CHECKPOINT,
+    LOPT_CKPT_EVERY,
+    LOPT_DAEMON,
+    LOPT_BUILD_INDEX,
+    LOPT_LOOKUP,
+    LOPT_INDEX,
+    LOPT_VERIFY,
+    LOPT_SAVE_RESULTS,
+    LOPT_EXCLUDE_KNOWN,
+    LOPT_TRUST_DPKG,
+    LOPT_DIGEST,
+    LOPT_HASH_BACKEND,
+    LOPT_HASH_BENCH,
+    LOPT_NO_OVERLAP,
+    LOPT_CACHE_NEUTRAL,
+    LOPT_HOT_FIRST,
+    LOPT_THROTTLE,
+    LOPT_PREFETCH,
+    LOPT_MMAP
+};
+
+/* Flag values for the files in the list */
+
+enum
+{
+    FILE_REFERENCE = 0x01,	/* from a reference root */
+    FILE_SAVED	   = 0x02,	/* loaded from a saved reference set */
+    FILE_HOT	   = 0x04,	/* wholly in the page cache, with --hot-first */
+    FILE_PKG	   = 0x08,	/* digest taken from the package checksums */
+    FILE_MASTER	   = 0x10	/* kept first in its set, out-of-core */
 };
 
+/* Amount of data spliced at a time into an AF_ALG socket, which is also
+ * the pipe size asked for. */
+
+#define AFALG_CHUNK (1024 * 1024)
+
 /* Amount of data read at a time from files when calculating the message
  * digest or when comparing one file wit another.
  */
 
 #define CHUNK_SIZE  8192
 
+/* The read ring used to overlap reading a large file with hashing it -
+ * the number of buffers, the size of each and the smallest file read
+ * that way, smaller ones being read in CHUNK_SIZE pieces as they are
+ * hashed. */
+
+#define RING_BUFS   4
+#define RING_SIZE   (1024 * 1024)
+#define RING_MIN    (4 * RING_SIZE)
+
+/* Default number of files ahead of the one being hashed for which
+ * --prefetch starts reading, and the most it will have read ahead. */
+
+#define PREFETCH_FILES 16
+#define PREFETCH_MAX   (256 * 1024 * 1024)
+
+/* With --mmap, the smallest file hashed or compared from a mapping
+ * rather than by reading it, and the most of a file mapped at once. */
+
+#define MMAP_MIN    (256 * 1024)
+#define MMAP_WINDOW (64 * 1024 * 1024)
+
+/* Largest file the multi backend reads whole to hash in a lane. */
+
+#define MULTI_MAX   (64 * 1024)
+
 /* Which message digest algorith to use (from libgcrypt) */
 
 #define DIGEST_ALGO GCRY_MD_MD5
 
+/* Exit status used by the --any mode when a duplicate has been found.
+ * Errors are reported as 1 in that mode so the two cannot be confused. */
+
+#define ANY_FOUND_STATUS 2
+
+/* First line of a scan cache file, followed by the options which
+ * affect which files are seen and the time the scan started. */
+
+#define CACHE_MAGIC "dupfind-cache 1"
+
+/* Options which must match for a scan cache to be trusted */
+
+#define CACHE_OPTIONS (OPT_RECURSE|OPT_SYMLINKS|OPT_NOEMPTY)
+
+/* Number of counters in the size filter used by --two-pass, as a power
+ * of two, and the number of counters each size is hashed to.  Each
+ * counter is two bits so the filter takes 16MiB. */
+
+#define SIZE_FILTER_BITS   26
+#define SIZE_FILTER_HASHES 3
+
+/* Amount of data at the start of a file covered by the partial digest
+ * in a signature file, and the start of the first line of one. */
+
+#define PARTIAL_SIZE  4096
+#define SIGFILE_MAGIC "dupfind-signatures 1"
+
+/* Largest frame exchanged between agent and aggregator and the frame
+ * types. */
+
+#define FRAME_MAX	  65536
+#define FRAME_HELLO	  'H'	/* agent's node name */
+#define FRAME_SIZES	  'S'	/* "size count" lines from agent */
+#define FRAME_PARTIAL_REQ 'p'	/* "size" lines from aggregator */
+#define FRAME_PARTIALS	  'P'	/* "size\tpartial" lines from agent */
+#define FRAME_FULL_REQ	  'f'	/* "size\tpartial" lines from aggregator */
+#define FRAME_DIGESTS	  'D'	/* "size\tpartial\tdigest\tname" from agent */
+#define FRAME_END	  'E'	/* end of a stage */
+#define FRAME_QUIT	  'Q'	/* aggregator has finished */
+
+/* First line of a checkpoint file and the default amount of data hashed
+ * between checkpoints. */
+
+#define CKPT_MAGIC "dupfind-checkpoint 1"
+#define CKPT_EVERY (1024L * 1024 * 1024)
+
+/* Start of an index file written by --build-index, padded to 16. */
+
+#define INDEX_MAGIC "dupfind-index 3\n"
+
+/* First line of a saved reference set */
+
+#define REFSET_MAGIC "dupfind-reference 1"
+
 /* Progname name/version - filled in by CVS */
 
 static const char version[] = "$Id$";
@@ -102,8 +264,167 @@ typedef struct
     mode_t  st_mode;
     dev_t   st_dev;
     ino_t   st_ino;
+    struct timespec st_mtim;
+    struct timespec st_ctim;
+    char    *digest;
+    int	    flags;
+    int	    root;
 } file_t;
 
+/* The read ring.  A reader thread fills the buffers in turn while the
+ * thread hashing the file consumes them, each buffer's len being the
+ * number of bytes read into it, 0 at the end of the file or -1 after an
+ * error, with the error in err.  filled and used count the buffers
+ * filled and consumed since the file was opened. */
+
+typedef struct
+{
+    int		  fd;
+    unsigned char *buf[RING_BUFS];
+    ssize_t	  len[RING_BUFS];
+    int		  err;
+    guint	  filled;
+    guint	  used;
+    GMutex	  lock;
+    GCond	  cond;
+} ring_t;
+
+/* What open_data found of a file in the page cache with
+ * --cache-neutral - the number of pages cached, whether any were not,
+ * which were as a mincore vector of npage entries, NULL if none were,
+ * and how far the pages not cached have been dropped as it is read. */
+
+typedef struct
+{
+    int		  fd;
+    guint64	  cached;
+    int		  cold;
+    gsize	  npage;
+    unsigned char *vec;
+    off_t	  dropped;
+} resident_t;
+
+/* A directory as recorded in the scan cache.  For directories loaded
+ * from the cache, children lists the full names of the files and
+ * sub-directories it contained, also from the cache. */
+
+typedef struct
+{
+    char	    *name;
+    struct timespec st_mtim;
+    struct timespec st_ctim;
+    GList	    *children;
+} cache_dir_t;
+
+/* The record written to the scratch files for each file in out-of-core
+ * mode, the name being kept in a separate file. */
+
+typedef struct
+{
+    off_t   size;
+    dev_t   dev;
+    ino_t   ino;
+    guint64 path_off;
+    guint32 nlink;
+    guint32 root;
+} spill_t;
+
+/* State of the out-of-core mode during phase one. */
+
+typedef struct
+{
+    char    *dir;
+    FILE    *paths;
+    guint64 path_off;
+    spill_t *buf;
+    gsize   nbuf;
+    gsize   maxbuf;
+    GList   *runs;
+    guint   nrun;
+} ooc_t;
+
+/* The record written to the runs of a size group too large for memory
+ * in out-of-core mode, sorted by digest. */
+
+typedef struct
+{
+    spill_t rec;
+    char    digest[MD5_DIGEST * 2 + 1];
+} spill_digest_t;
+
+/* The last record merged by size in out-of-core mode and the names of
+ * the records so far with the same size, device and inode, which are
+ * only read back once a second such record turns up. */
+
+typedef struct
+{
+    spill_t   last;
+    int	      have;
+    GPtrArray *names;
+} ooc_seen_t;
+
+/* A merge of runs of records of recsize bytes, ordered by cmp, with the
+ * next record of each run and whether it has one. */
+
+typedef struct
+{
+    guint	 n;
+    FILE	 **fps;
+    char	 *heads;
+    int		 *live;
+    size_t	 recsize;
+    GCompareFunc cmp;
+} ooc_merge_t;
+
+/* The record sent by the coordinator to a worker in sharded mode for
+ * each file, followed by the name and digest, if any. */
+
+typedef struct
+{
+    off_t   size;
+    dev_t   dev;
+    ino_t   ino;
+    nlink_t nlink;
+    mode_t  mode;
+    gint32  root;
+    gint32  flags;
+    guint32 name_len;
+    guint32 digest_len;
+} shard_rec_t;
+
+/* The workers for sharded mode, as seen from the coordinator. */
+
+typedef struct
+{
+    int	  n;
+    FILE  **in;
+    int	  *out;
+    pid_t *pid;
+} shards_t;
+
+/* A file part way through being hashed, as recorded in the checkpoint
+ * file, with the metadata used to check it has not changed since. */
+
+typedef struct
+{
+    char	    *name;
+    off_t	    st_size;
+    struct timespec st_mtim;
+    dev_t	    st_dev;
+    ino_t	    st_ino;
+    off_t	    offset;
+    md5_ctx_t	    ctx;
+} ckpt_t;
+
+/* The scan cache loaded from a previous run. */
+
+typedef struct
+{
+    struct timespec built;
+    GHashTable	    *dirs;
+    GHashTable	    *files;
+} cache_t;
+
 /* The value type for the second hash table, keyed by message digest */
 
 typedef struct
@@ -128,6 +449,55 @@ typedef struct
     GChecksum  *digest;
 } tree_foreach_t;
 
+/* Passed through g_tree_foreach with --hot-first - the digest table
+ * being built and the files left to be read from the disk. */
+
+typedef struct
+{
+    tree_foreach_t *fdata;
+    GPtrArray	   *cold;
+} hot_t;
+
+/* The state of --prefetch while hashing a list of files - the next one
+ * to prefetch, the bytes prefetched for files not yet reached, the most
+ * that may be and how many files ahead, when those limits were last
+ * worked out and how many files have been prefetched and reached and
+ * found in the page cache when reached. */
+
+typedef struct
+{
+    GPtrArray *files;
+    guint     next;
+    guint64   ahead;
+    guint64   budget;
+    guint     k;
+    gint64    checked;
+    gulong    issued;
+    gulong    reached;
+    gulong    hits;
+} prefetch_t;
+
+/* A scan made through the library interface, see dupfind.h.  The
+ * options are the command line options the flags correspond to.  The
+ * command sets single_run as digests need not be kept for a later run. */
+
+struct dupfind
+{
+    unsigned long	  options;
+    const char		  *cache_file;
+    const char		  *results_file;
+    dupfind_group_func	  group;
+    dupfind_progress_func progress;
+    void		  *udata;
+    GPtrArray		  *names;
+    GTree		  *file_tree;
+    int			  nrun;
+    int			  single_run;
+    unsigned long	  done;
+    unsigned long	  total;
+    volatile sig_atomic_t cancel;
+};
+
 /* Bit-map of command line options */
 
 static unsigned long options;
@@ -142,413 +512,6804 @@ static const char *progname;
 
 static int (*stat_func)(const char *name, struct stat *buf) = lstat;
 
-/* Function called during phase one for each file system object being
- * worked on - it works out whether it is a file/directory etc. and
- * either adds it to the list or recusrses into it. */
+/* The scan cache file named on the command line, the cache loaded from
+ * it (NULL if there was none or it cannot be trusted), the list of
+ * directories seen during this run and the time it started, to be
+ * written to the new cache. */
 
-static int do_fsobj(GTree *file_tree, const char *name)
+static const char *cache_file;
+static cache_t	  *scan_cache;
+static GList	  *cache_dirs;
+static struct timespec scan_start;
+
+/* File flags and index of the root currently being scanned, the saved reference
+ * set to be written if any, and whether digests need to be kept in the
+ * file list once calculated, for the scan cache or reference set. */
+
+static int	  root_flags;
+static int	  cur_root;
+static const char *ref_save_file;
+static int	  keep_digests;
+
+/* The number of files phase two has failed to open or read. */
+
+static gulong	  hash_errors;
+
+/* The memory limit given on the command line, which selects out-of-core
+ * mode, and the state of that mode. */
+
+static gsize	  memory_limit;
+static ooc_t	  ooc;
+
+/* The counting filter over file sizes used by --two-pass mode, holding
+ * saturating two bit counters packed four to a byte. */
+
+static guint8	  *size_filter;
+
+/* The workers in sharded mode - shards.n is zero if not in that mode. */
+
+static shards_t	  shards;
+
+/* The checkpoint file for resumable hashing, the checkpoints in it keyed
+ * by file name and the amount of data hashed between checkpoints, which
+ * is also the smallest file checkpointed. */
+
+static const char *ckpt_file;
+static GHashTable *ckpt_table;
+static off_t	  ckpt_every = CKPT_EVERY;
+
+/* Whether large files are read by a helper thread while being hashed,
+ * and the read ring it uses. */
+
+static int	  overlap = 1;
+static ring_t	  ring;
+
+/* How reads for hashing and comparison treat the page cache - as any
+ * other reads or, with --cache-neutral, dropping the pages of files
+ * which were not cached beforehand as they are consumed and leaving
+ * those which were, or bypassing the cache with O_DIRECT where the
+ * filesystem allows it.  cold_file is
+ * the file most recently opened by open_data if any of its pages are
+ * to be dropped as they are read, for the hash backends which only see
+ * the file descriptor. */
+
+enum
 {
-    int		  status;
-    struct stat	  stbuf;
-    file_t	  *fp;
-    DIR		  *dp;
-    struct dirent *dent;
-    const char	  *dname;
-    char	  *path;
+    CACHE_NORMAL,
+    CACHE_DONTNEED,
+    CACHE_DIRECT
+};
 
-    if (stat_func(name, &stbuf) == 0)
-    {
-	status = 0;
-	if (S_ISREG(stbuf.st_mode))
-	{
-	    if (stbuf.st_size > 0 || !(options & OPT_NOEMPTY))
-	    {
-		if (g_tree_lookup(file_tree, name))
-		{
-		    if (!(options & OPT_QUIET))
-			g_warning("filename '%s' alreday seen", name);
-		}
-		else
-		{
-		    fp = g_malloc(sizeof(file_t));
-		    fp->name = g_strdup(name);
-		    fp->st_size = stbuf.st_size;
-		    fp->st_nlink = stbuf.st_nlink;
-		    fp->st_mode = stbuf.st_mode;
-		    fp->st_dev = stbuf.st_dev;
-		    fp->st_ino = stbuf.st_ino;
-		    g_tree_insert(file_tree, fp->name, fp);
-		}
-	    }
-	}
-	else if (S_ISDIR(stbuf.st_mode))
-	{
-	    if (options & OPT_RECURSE)
-	    {
-		if ((dp = opendir(name)))
-		{
-		    while ((dent = readdir(dp)))
-		    {
-			dname = dent->d_name;
-			if (dname[0] != '.' ||
-			    (dname[1] != '.' && dname[1] != '\0'))
-			{
-			    path = g_strconcat(name, "/", dent->d_name, NULL);
-			    status += do_fsobj(file_tree, path);
-			    g_free(path);
-			}
-		    }
-		    closedir(dp);
-		}
-		else
-		{
-		    g_warning("unable to read directory '%s' - %m", name);
-		    status = 1;
-		}
-	    }
-	    else
-		g_warning("%s is a directory - ignored", name);
-	}
-    }
-    else
-    {
-	g_warning("unable to stat '%s' - %m", name);
-	status = 1;
-    }
-    return status;
-}
+static int	  cache_mode = CACHE_NORMAL;
+static resident_t *cold_file;
+
+/* Whether phases two and three deal with files in the page cache
+ * before the others, and the rate in bytes a second to which reading
+ * the others is then held, zero for no limit. */
+
+static int	  hot_first;
+static guint64	  throttle_rate;
 
-/* Function called during phase one to read filenames from stdin
- * and add them to the list. */
+/* The most files ahead to prefetch, zero without --prefetch. */
 
-static int do_stdin(GTree *file_tree)
+static int	  prefetch_files;
+
+/* Whether --mmap was given, the devices found to suit it or not keyed
+ * by device number, and the state used to recover from a SIGBUS while
+ * a mapping is being read - the jump back and whether one is set. */
+
+static int	  use_mmap;
+static GHashTable *mmap_devs;
+static sigjmp_buf mmap_env;
+static volatile sig_atomic_t mmap_active;
+
+/* Page cache totals for --cache-neutral, in pages - the size of the
+ * files read and how much of them was in the cache before and after. */
+
+static struct
 {
-    int	 status = 0;
-    char name[1024];
-    char *ptr;
+    gulong  files;
+    guint64 pages;
+    guint64 before;
+    guint64 after;
+} cache_stats;
 
-    while (fgets(name, sizeof(name), stdin) != NULL)
-    {
-	if ((ptr = strchr(name, '\n')))
-	    *ptr = '\0';
-	status += do_fsobj(file_tree, name);
-    }
-    return status;
+/* The name of this machine written to a signature file by --export. */
+
+static const char *node_name;
+
+/* Which digests phase two uses - MD5, fs-verity measurements where
+ * available or, per size group, fs-verity if all the files have it. */
+
+enum
+{
+    DIGEST_MD5,
+    DIGEST_VERITY,
+    DIGEST_AUTO
+};
+
+static int	  digest_mode = DIGEST_MD5;
+
+/* The library scan being run, if any. */
+
+static dupfind_t  *lib_scan;
+
+/* Returns true if two timestamps are identical. */
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
 }
 
-/* Function called during phase two by g_hash_table_foreach for each
- * file in the first hashtable, keyed by filename */
+/* Returns true if the cache entry for a file shows it to be unchanged
+ * since the cache was written, in which case its digest can be used. */
 
-static gboolean file_foreach(gpointer key, gpointer value, gpointer udata)
+static int same_file(const file_t *fp, const struct stat *stbuf)
 {
-    char	   *file = key;
-    const char	   *digest_txt;
-    char           *digest_cpy;
-    tree_foreach_t *fdata = udata;
-    file_list_t    *file_list;
-    int            fd;
-    ssize_t        nbytes;
-    unsigned char  buf[8192];
-
-    if ((fd = open(file, O_RDONLY, 0)) >= 0) {
-        while ((nbytes = read(fd, buf, sizeof(buf))) > 0)
-            g_checksum_update(fdata->digest, buf, nbytes);
-        close(fd);
-        if ((digest_txt = g_checksum_get_string(fdata->digest))) {
-            if ((file_list = g_hash_table_lookup(fdata->hash, digest_txt))) {
-                file_list->nfile++;
-                file_list->files = g_list_append(file_list->files, value);
-            }
-            else {
-                digest_cpy = g_strdup(digest_txt);
-                file_list = g_malloc(sizeof(file_list_t));
-                file_list->nfile = 1;
-                file_list->files = g_list_append(NULL, value);
-                g_hash_table_insert(fdata->hash, digest_cpy, file_list);
-            }
-        }
-        else
-            g_warning("digest calculation failed on file '%s'", file);
-        g_checksum_reset(fdata->digest);
-    }
-    else
-	g_warning("unable to open file '%s' for reading - %m", file);
-    return FALSE;
+    return fp->st_size == stbuf->st_size &&
+	fp->st_dev == stbuf->st_dev &&
+	fp->st_ino == stbuf->st_ino &&
+	same_time(&fp->st_mtim, &stbuf->st_mtim) &&
+	same_time(&fp->st_ctim, &stbuf->st_ctim);
 }
 
-/* Comparison function used during phase three, called by g_list_sort
- * and used to sort a list of files by the number of hard links - this
- * is need for the correct handling of groups of files having the same
- * digest where some are hard-linked together and others are not. */
+/* Function used during phase one to record a directory in the list to
+ * be written to the new scan cache. */
 
-static gint sort_compare(gconstpointer a, gconstpointer b)
+static void cache_add_dir(const char *name, const struct stat *stbuf)
 {
-    const file_t *fa = a;
-    const file_t *fb = b;
-    gint res;
+    cache_dir_t *dir;
 
-    if ((res = fb->st_nlink - fa->st_nlink) == 0)
-	res = strcmp(fa->name, fb->name);
-    return res;
+    if (cache_file)
+    {
+	dir = g_malloc(sizeof(cache_dir_t));
+	dir->name = g_strdup(name);
+	dir->st_mtim = stbuf->st_mtim;
+	dir->st_ctim = stbuf->st_ctim;
+	dir->children = NULL;
+	cache_dirs = g_list_prepend(cache_dirs, dir);
+    }
 }
 
-/* Function used during phase three, it takes a list of files and
- * returns another list which contains only one file from any set
- * that are hard-linked together */
+/* Package checksums.  With --trust-dpkg the MD5 digests dpkg recorded in
+ * its *.md5sums files when each package was installed are used for the
+ * files they list instead of reading them.  A recorded digest is only
+ * trusted if neither the mtime nor the ctime of the file is later than
+ * the mtime of the md5sums file, which is written as the package is
+ * unpacked, allowing PKG_SLACK seconds for a large package.  The names
+ * recorded are absolute, so only files found under absolute names can
+ * match.  Such a digest is only used to group the files, which phase
+ * three still compares, so it is marked with FILE_PKG and not trusted
+ * for anything else: it never excludes a file as known, is not written
+ * to the scan cache, a saved reference set or --save-results, and the
+ * daemon, which answers without comparing files, does not take it. */
 
-static GList *filter_links(GList *list)
+#define PKG_SLACK 300
+
+/* Where dpkg keeps the md5sums files. */
+
+#define DPKG_INFO_DIR "/var/lib/dpkg/info"
+
+/* The digest recorded for a file and when its package was installed. */
+
+typedef struct
 {
-    GList  *ptr;
-    file_t *fp1, *fp2;
-    int	   found;
+    char   digest[MD5_DIGEST * 2 + 1];
+    time_t installed;
+} pkg_sum_t;
 
-    if (list == NULL)
-	return NULL;
+/* Recorded digests keyed by file name, and the number of files and bytes
+ * for which they were used. */
 
-    GList *new_list = g_list_append(NULL, list->data);
-    while ((list = list->next))
+static GHashTable *pkg_sums;
+static gulong	  pkg_files;
+static guint64	  pkg_bytes;
+
+/* Loads one md5sums file.  Returns the number of errors. */
+
+static int load_md5sums(const char *fn)
+{
+    FILE	*fp;
+    struct stat stbuf;
+    char	*line = NULL;
+    size_t	size = 0;
+    ssize_t	len;
+    pkg_sum_t	*sum;
+    int		i;
+
+    if ((fp = fopen(fn, "r")) == NULL || fstat(fileno(fp), &stbuf) != 0)
     {
-	fp1 = list->data;
-	found = 0;
-	for (ptr = new_list; ptr; ptr = ptr->next)
-	{
-	    fp2 = ptr->data;
-	    if (fp2->st_dev == fp1->st_dev &&
-		fp2->st_ino == fp1->st_ino)
-	    {
-		found = 1;
-		break;
-	    }
-	}
-	if (found == 0)
-	    new_list = g_list_append(new_list, fp1);
+	g_warning("unable to read '%s' - %m", fn);
+	if (fp)
+	    fclose(fp);
+	return 1;
     }
-    return new_list;
+    while ((len = getline(&line, &size, fp)) > 0)
+    {
+	if (line[len-1] == '\n')
+	    line[--len] = '\0';
+	for (i = 0; i < MD5_DIGEST * 2 && g_ascii_isxdigit(line[i]); i++)
+	    ;
+	if (i < MD5_DIGEST * 2 || len < MD5_DIGEST * 2 + 3 ||
+	    line[i] != ' ' || line[i+1] != ' ')
+	    continue;
+	sum = g_malloc(sizeof(pkg_sum_t));
+	for (i = 0; i < MD5_DIGEST * 2; i++)
+	    sum->digest[i] = g_ascii_tolower(line[i]);
+	sum->digest[i] = '\0';
+	sum->installed = stbuf.st_mtim.tv_sec;
+	g_hash_table_replace(pkg_sums,
+			     g_strconcat("/", line + MD5_DIGEST * 2 + 2, NULL),
+			     sum);
+    }
+    g_free(line);
+    fclose(fp);
+    return 0;
 }
 
-/* Function used during phase three, to do a byte-by-byte comparison of
- * two files - returns 1 is they are the same, 0 otherwise. */
+/* Loads all the md5sums files in the dpkg info directory.  Returns the
+ * number of errors. */
 
-static int compare_files(file_t *file1, file_t *file2)
+static int load_dpkg(const char *dir)
 {
-    const char *name1, *name2;
-    int	       fd1, fd2;
-    char       buf1[CHUNK_SIZE],buf2[CHUNK_SIZE];
-    ssize_t    nb1, nb2;
-    int	       status;
+    DIR		  *dp;
+    struct dirent *dent;
+    char	  *path;
+    int		  status = 0;
+
+    if ((dp = opendir(dir)) == NULL)
+    {
+	g_critical("unable to read dpkg info directory '%s' - %m", dir);
+	return 1;
+    }
+    pkg_sums = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    while ((dent = readdir(dp)))
+    {
+	if (g_str_has_suffix(dent->d_name, ".md5sums"))
+	{
+	    path = g_strconcat(dir, "/", dent->d_name, NULL);
+	    status += load_md5sums(path);
+	    g_free(path);
+	}
+    }
+    closedir(dp);
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "%u package checksums loaded",
+	      g_hash_table_size(pkg_sums));
+    return status;
+}
+
+/* Returns the digest recorded by the package manager for a file if it
+ * can be trusted, counting the file, or NULL. */
+
+static const char *pkg_digest(const file_t *fp)
+{
+    pkg_sum_t *sum;
+
+    if ((sum = g_hash_table_lookup(pkg_sums, fp->name)) == NULL ||
+	fp->st_mtim.tv_sec > sum->installed + PKG_SLACK ||
+	fp->st_ctim.tv_sec > sum->installed + PKG_SLACK)
+	return NULL;
+    pkg_files++;
+    pkg_bytes += fp->st_size;
+    return sum->digest;
+}
+
+/* Reports how much was taken from the package checksums. */
+
+static void report_pkg(void)
+{
+    if (pkg_sums && !(options & OPT_QUIET))
+	g_message("%lu files, %" G_GUINT64_FORMAT " bytes, not read as"
+		  " package checksums were trusted", pkg_files, pkg_bytes);
+}
+
+/* Function called during phase one to add a regular file to the list,
+ * taking its digest from the scan cache if the file is unchanged. */
+
+static void add_file(GTree *file_tree, const char *name, struct stat *stbuf)
+{
+    file_t     *fp, *cached;
+    const char *digest;
+
+    if (g_tree_lookup(file_tree, name))
+    {
+	if (!(options & OPT_QUIET))
+	    g_warning("filename '%s' alreday seen", name);
+    }
+    else
+    {
+	fp = g_malloc(sizeof(file_t));
+	fp->name = g_strdup(name);
+	fp->st_size = stbuf->st_size;
+	fp->st_nlink = stbuf->st_nlink;
+	fp->st_mode = stbuf->st_mode;
+	fp->st_dev = stbuf->st_dev;
+	fp->st_ino = stbuf->st_ino;
+	fp->st_mtim = stbuf->st_mtim;
+	fp->st_ctim = stbuf->st_ctim;
+	fp->digest = NULL;
+	fp->flags = root_flags;
+	fp->root = cur_root;
+	if (scan_cache &&
+	    (cached = g_hash_table_lookup(scan_cache->files, name)) &&
+	    cached->digest && same_file(cached, stbuf))
+	    fp->digest = g_strdup(cached->digest);
+	else if (pkg_sums && (digest = pkg_digest(fp)))
+	{
+	    fp->digest = g_strdup(digest);
+	    fp->flags |= FILE_PKG;
+	}
+	g_tree_insert(file_tree, fp->name, fp);
+    }
+}
+
+/* Which function phase one uses to add a regular file - add_file or, in
+ * out-of-core mode, spill_file. */
+
+static void (*add_func)(GTree *file_tree, const char *name,
+			struct stat *stbuf) = add_file;
+
+/* Works out the position in the size filter of one of the counters for
+ * a size using double hashing. */
+
+static guint64 filter_slot(off_t size, int n)
+{
+    guint64 h = (guint64)size * 0x9e3779b97f4a7c15ULL;
+
+    h ^= h >> 31;
+    return (h + n * ((h >> 32) | 1)) & ((1ULL << SIZE_FILTER_BITS) - 1);
+}
+
+/* Returns the estimated number of files seen with a size, up to three.
+ * The estimate can be too high, never too low. */
+
+static int filter_count(off_t size)
+{
+    int	    i, count, min = 3;
+    guint64 slot;
+
+    for (i = 0; i < SIZE_FILTER_HASHES; i++)
+    {
+	slot = filter_slot(size, i);
+	count = (size_filter[slot >> 2] >> ((slot & 3) * 2)) & 3;
+	if (count < min)
+	    min = count;
+    }
+    return min;
+}
+
+/* Adds a size to the size filter. */
+
+static void filter_add(off_t size)
+{
+    int	    i, count;
+    guint64 slot;
+
+    for (i = 0; i < SIZE_FILTER_HASHES; i++)
+    {
+	slot = filter_slot(size, i);
+	count = (size_filter[slot >> 2] >> ((slot & 3) * 2)) & 3;
+	if (count < 3)
+	    size_filter[slot >> 2] += 1 << ((slot & 3) * 2);
+    }
+}
+
+/* Function called during the first walk of --two-pass mode in place of
+ * add_file, which only counts the file's size. */
+
+static void count_size(GTree *file_tree, const char *name, struct stat *stbuf)
+{
+    filter_add(stbuf->st_size);
+}
+
+/* Function called during the second walk of --two-pass mode in place of
+ * add_file, which only keeps files whose size was seen more than once. */
+
+static void add_shared(GTree *file_tree, const char *name, struct stat *stbuf)
+{
+    if (filter_count(stbuf->st_size) > 1)
+	add_file(file_tree, name, stbuf);
+}
+
+/* Function called by g_tree_foreach in --two-pass mode to count the
+ * sizes of files already in the list, ie. from saved reference sets. */
+
+static gboolean count_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    filter_add(((file_t *)value)->st_size);
+    return FALSE;
+}
+
+/* Called by the phases as each file or group is dealt with to report
+ * progress to a library caller.  Returns true if the run has been
+ * cancelled. */
+
+static int lib_step(int phase)
+{
+    if (lib_scan == NULL)
+	return FALSE;
+    if (lib_scan->progress && !lib_scan->cancel &&
+	lib_scan->progress(phase, ++lib_scan->done, lib_scan->total,
+			   lib_scan->udata))
+	lib_scan->cancel = 1;
+    return lib_scan->cancel;
+}
+
+static int do_fsobj(GTree *file_tree, const char *name);
+
+/* Function called during phase one for a directory found unchanged in
+ * the scan cache.  The files it contained are taken from the cache
+ * without being read or stat'ed; sub-directories are still stat'ed
+ * to find out if they have changed.  With --delete or --link, which
+ * act on what they find, each file is stat'ed too - one which has gone
+ * is left out and one which has changed since the cache was written is
+ * dealt with as if the directory had been read. */
+
+static int reuse_dir(GTree *file_tree, cache_dir_t *dir)
+{
+    int		status = 0;
+    GList	*ptr;
+    file_t	*fp;
+    const char	*digest;
+    struct stat stbuf;
+
+    for (ptr = dir->children; ptr; ptr = ptr->next)
+    {
+	fp = g_hash_table_lookup(scan_cache->files, ptr->data);
+	if (fp && (options & (OPT_DELETE|OPT_LINK)))
+	{
+	    if (stat_func(ptr->data, &stbuf) != 0)
+	    {
+		if (errno == ENOENT)
+		    continue;
+		fp = NULL;
+	    }
+	    else if (!S_ISREG(stbuf.st_mode) || !same_file(fp, &stbuf))
+		fp = NULL;
+	}
+	if (fp)
+	{
+	    if (!g_tree_lookup(file_tree, fp->name))
+	    {
+		fp->flags = root_flags;
+		fp->root = cur_root;
+		if (!fp->digest && pkg_sums && (digest = pkg_digest(fp)))
+		{
+		    fp->digest = g_strdup(digest);
+		    fp->flags |= FILE_PKG;
+		}
+		g_tree_insert(file_tree, fp->name, fp);
+	    }
+	}
+	else
+	    status += do_fsobj(file_tree, ptr->data);
+    }
+    return status;
+}
+
+/* Function called during phase one to read a directory and recurse into
+ * each entry. */
+
+static int read_dir(GTree *file_tree, const char *name)
+{
+    int		  status = 0;
+    DIR		  *dp;
+    struct dirent *dent;
+    const char	  *dname;
+    char	  *path;
+
+    if ((dp = opendir(name)))
+    {
+	while (!(lib_scan && lib_scan->cancel) && (dent = readdir(dp)))
+	{
+	    dname = dent->d_name;
+	    if (dname[0] != '.' ||
+		(dname[1] != '.' && dname[1] != '\0'))
+	    {
+		path = g_strconcat(name, "/", dent->d_name, NULL);
+		status += do_fsobj(file_tree, path);
+		g_free(path);
+	    }
+	}
+	closedir(dp);
+    }
+    else
+    {
+	g_warning("unable to read directory '%s' - %m", name);
+	status = 1;
+    }
+    return status;
+}
+
+/* Function called during phase one for each file system object being
+ * worked on - it works out whether it is a file/directory etc. and
+ * either adds it to the list or recusrses into it.
+ *
+ * When a scan cache is in use a directory whose mtime and ctime match
+ * the cache, and whose mtime is earlier than the time the cache was
+ * built, has its child list taken from the cache instead of being
+ * read.  The second condition avoids trusting a directory which could
+ * have been changed in the same clock tick as it was scanned. */
+
+static int do_fsobj(GTree *file_tree, const char *name)
+{
+    int		  status;
+    struct stat	  stbuf;
+    cache_dir_t	  *dir;
+
+    if (stat_func(name, &stbuf) == 0)
+    {
+	status = 0;
+	if (S_ISREG(stbuf.st_mode))
+	{
+	    if (stbuf.st_size > 0 || !(options & OPT_NOEMPTY))
+	    {
+		add_func(file_tree, name, &stbuf);
+		lib_step(DUPFIND_PHASE_LIST);
+	    }
+	}
+	else if (S_ISDIR(stbuf.st_mode))
+	{
+	    if (options & OPT_RECURSE)
+	    {
+		cache_add_dir(name, &stbuf);
+		if (scan_cache &&
+		    (dir = g_hash_table_lookup(scan_cache->dirs, name)) &&
+		    same_time(&dir->st_mtim, &stbuf.st_mtim) &&
+		    same_time(&dir->st_ctim, &stbuf.st_ctim) &&
+		    (dir->st_mtim.tv_sec < scan_cache->built.tv_sec ||
+		     (dir->st_mtim.tv_sec == scan_cache->built.tv_sec &&
+		      dir->st_mtim.tv_nsec < scan_cache->built.tv_nsec)))
+		    status = reuse_dir(file_tree, dir);
+		else
+		    status = read_dir(file_tree, name);
+	    }
+	    else
+		g_warning("%s is a directory - ignored", name);
+	}
+    }
+    else
+    {
+	g_warning("unable to stat '%s' - %m", name);
+	status = 1;
+    }
+    return status;
+}
+
+/* Function called during phase one to read filenames from stdin, or a
+ * copy of it, and add them to the list. */
+
+static int do_stdin(GTree *file_tree, FILE *fp)
+{
+    int	 status = 0;
+    char name[1024];
+    char *ptr;
+
+    while (fgets(name, sizeof(name), fp) != NULL)
+    {
+	if ((ptr = strchr(name, '\n')))
+	    *ptr = '\0';
+	status += do_fsobj(file_tree, name);
+    }
+    return status;
+}
+
+/* Counts the pages of an open file which are in the page cache, by
+ * mapping it and asking mincore, and if pvec is given passes back the
+ * vector mincore filled in, to be freed by the caller. */
+
+static guint64 resident_pages(int fd, off_t size, unsigned char **pvec)
+{
+    long	  page = sysconf(_SC_PAGESIZE);
+    gsize	  npage = (size + page - 1) / page;
+    unsigned char *vec;
+    void	  *map;
+    guint64	  n = 0;
+    gsize	  i;
+
+    if (pvec)
+	*pvec = NULL;
+    if (size == 0 ||
+	(map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	return 0;
+    vec = g_malloc0(npage);
+    if (mincore(map, size, vec) == 0)
+	for (i = 0; i < npage; i++)
+	    n += vec[i] & 1;
+    munmap(map, size);
+    if (pvec)
+	*pvec = vec;
+    else
+	g_free(vec);
+    return n;
+}
+
+/* Opens a file to be read for hashing or comparison.  With
+ * --cache-neutral the kernel is told it will be read sequentially and
+ * which of its pages are already cached is noted in *res, and with
+ * --cache-neutral=direct it is opened with O_DIRECT if direct is set,
+ * the caller reading it into page-aligned buffers, and the filesystem
+ * allows it. */
+
+static int open_data(const char *name, int direct, resident_t *res)
+{
+    struct stat st;
+    long	page = sysconf(_SC_PAGESIZE);
+    int		fd;
+
+    memset(res, 0, sizeof(*res));
+    cold_file = NULL;
+    if (cache_mode != CACHE_DIRECT || !direct ||
+	(fd = open(name, O_RDONLY|O_DIRECT)) < 0)
+	if ((fd = open(name, O_RDONLY)) < 0)
+	    return -1;
+    res->fd = fd;
+    if (cache_mode != CACHE_NORMAL && fstat(fd, &st) == 0)
+    {
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	res->npage = (st.st_size + page - 1) / page;
+	res->cached = resident_pages(fd, st.st_size, &res->vec);
+	res->cold = res->cached < res->npage;
+	if (res->cached == 0)
+	{
+	    g_free(res->vec);
+	    res->vec = NULL;
+	}
+	if (res->cold)
+	    cold_file = res;
+    }
+    return fd;
+}
+
+/* Returns what open_data found of the file open on fd if any of its
+ * pages are to be dropped as it is read, else NULL. */
+
+static resident_t *cold_data(int fd)
+{
+    return cold_file && cold_file->fd == fd ? cold_file : NULL;
+}
+
+/* Drops from the page cache the pages of a file read since the last
+ * call, up to pos, which were not cached when it was opened, once
+ * RING_SIZE bytes have built up or if all is set.  Pages which were
+ * cached are left, and so is a page only partly read unless all is
+ * set, when pos is the end of the file.  Runs of pages to drop are
+ * each given to the kernel in one call. */
+
+static void drop_pages(resident_t *res, off_t pos, int all)
+{
+    long  page = sysconf(_SC_PAGESIZE);
+    gsize first, last, i, j;
+
+    if (res == NULL || !res->cold || pos <= res->dropped ||
+	(pos - res->dropped < RING_SIZE && !all))
+	return;
+    first = res->dropped / page;
+    last = all ? (pos + page - 1) / page : pos / page;
+    for (i = first; i < last; i = j)
+    {
+	for (j = i; j < last && !(res->vec && j < res->npage &&
+				  (res->vec[j] & 1)); j++)
+	    ;
+	if (j > i)
+	    posix_fadvise(res->fd, (off_t)i * page, (off_t)(j - i) * page,
+			  POSIX_FADV_DONTNEED);
+	else
+	    j++;
+    }
+    res->dropped = (off_t)last * page;
+}
+
+/* Closes a file opened with open_data.  With --cache-neutral the pages
+ * of the file which were not cached beforehand are dropped from the
+ * page cache, all of them in case any were left from reading it, and
+ * what it adds to the cache is totalled. */
+
+static void close_data(resident_t *res)
+{
+    struct stat st;
+
+    if (cache_mode != CACHE_NORMAL && fstat(res->fd, &st) == 0)
+    {
+	res->dropped = 0;
+	drop_pages(res, st.st_size, 1);
+	cache_stats.files++;
+	cache_stats.pages += (st.st_size + sysconf(_SC_PAGESIZE) - 1) /
+	    sysconf(_SC_PAGESIZE);
+	cache_stats.before += res->cached;
+	cache_stats.after += resident_pages(res->fd, st.st_size, NULL);
+    }
+    if (cold_file == res)
+	cold_file = NULL;
+    g_free(res->vec);
+    res->vec = NULL;
+    close(res->fd);
+}
+
+/* Reports, with --cache-neutral, how much of the files read was in the
+ * page cache before and after, and starts the totals again. */
+
+static void report_cache(void)
+{
+    if (cache_mode != CACHE_NORMAL && !(options & OPT_QUIET))
+	g_message("page cache: %lu files of %" G_GUINT64_FORMAT " pages read,"
+		  " %" G_GUINT64_FORMAT " pages cached before and %"
+		  G_GUINT64_FORMAT " after", cache_stats.files,
+		  cache_stats.pages, cache_stats.before, cache_stats.after);
+    memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
+/* Parses a timestamp as written to the scan cache. */
+
+static int parse_time(const char *str, struct timespec *ts)
+{
+    return sscanf(str, "%ld.%ld", &ts->tv_sec, &ts->tv_nsec) == 2;
+}
+
+/* Loads the checkpoint file, if it exists, into ckpt_table.  Returns 0
+ * on success. */
+
+static int load_checkpoints(void)
+{
+    FILE    *fp;
+    char    *line = NULL;
+    size_t  size = 0;
+    ssize_t len;
+    char    **fields;
+    ckpt_t  *ck;
+    int	    status = 0;
+
+    ckpt_table = g_hash_table_new(g_str_hash, g_str_equal);
+    if ((fp = fopen(ckpt_file, "r")) == NULL)
+    {
+	if (errno == ENOENT)
+	    return 0;
+	g_warning("unable to open checkpoint file '%s' - %m", ckpt_file);
+	return 1;
+    }
+    if (getline(&line, &size, fp) <= 0 || strcmp(line, CKPT_MAGIC "\n"))
+    {
+	g_warning("'%s' is not a dupfind checkpoint file", ckpt_file);
+	status = 1;
+    }
+    while (status == 0 && (len = getline(&line, &size, fp)) > 0)
+    {
+	if (line[len-1] == '\n')
+	    line[len-1] = '\0';
+	fields = g_strsplit(line, "\t", 7);
+	ck = g_malloc0(sizeof(ckpt_t));
+	if (g_strv_length(fields) == 7 &&
+	    parse_time(fields[1], &ck->st_mtim) &&
+	    sscanf(fields[5], "%8x%8x%8x%8x", &ck->ctx.state[0],
+		   &ck->ctx.state[1], &ck->ctx.state[2],
+		   &ck->ctx.state[3]) == 4)
+	{
+	    ck->st_size = g_ascii_strtoll(fields[0], NULL, 10);
+	    ck->st_dev = g_ascii_strtoull(fields[2], NULL, 10);
+	    ck->st_ino = g_ascii_strtoull(fields[3], NULL, 10);
+	    ck->offset = g_ascii_strtoll(fields[4], NULL, 10);
+	    ck->ctx.count = ck->offset;
+	    ck->name = g_strcompress(fields[6]);
+	    g_hash_table_replace(ckpt_table, ck->name, ck);
+	}
+	else
+	{
+	    g_warning("checkpoint file '%s' is damaged", ckpt_file);
+	    g_free(ck);
+	    status = 1;
+	}
+	g_strfreev(fields);
+    }
+    g_free(line);
+    fclose(fp);
+    return status;
+}
+
+/* Writes out all the checkpoints, via a temporary file so the previous
+ * checkpoints survive if the program is interrupted while writing.  The
+ * temporary file is synced before it is renamed so a crash cannot leave
+ * the checkpoint file renamed into place but empty. */
+
+static void save_checkpoints(void)
+{
+    char	   *tmp;
+    FILE	   *fp;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    ckpt_t	   *ck;
+    char	   *esc;
+
+    tmp = g_strconcat(ckpt_file, ".tmp", NULL);
+    if ((fp = fopen(tmp, "w")))
+    {
+	fputs(CKPT_MAGIC "\n", fp);
+	g_hash_table_iter_init(&iter, ckpt_table);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+	    ck = value;
+	    esc = g_strescape(ck->name, NULL);
+	    fprintf(fp, "%ld\t%ld.%09ld\t%lu\t%lu\t%ld\t%08x%08x%08x%08x\t%s\n",
+		    (long)ck->st_size, ck->st_mtim.tv_sec, ck->st_mtim.tv_nsec,
+		    (unsigned long)ck->st_dev, (unsigned long)ck->st_ino,
+		    (long)ck->offset, ck->ctx.state[0], ck->ctx.state[1],
+		    ck->ctx.state[2], ck->ctx.state[3], esc);
+	    g_free(esc);
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+	{
+	    g_warning("unable to write checkpoint file '%s' - %m", ckpt_file);
+	    fclose(fp);
+	    unlink(tmp);
+	}
+	else if (fclose(fp) != 0 || rename(tmp, ckpt_file) != 0)
+	{
+	    g_warning("unable to write checkpoint file '%s' - %m", ckpt_file);
+	    unlink(tmp);
+	}
+    }
+    else
+	g_warning("unable to create checkpoint file '%s' - %m", tmp);
+    g_free(tmp);
+}
+
+/* Function used during phase two in place of g_checksum for files of at
+ * least ckpt_every bytes when a checkpoint file is in use.  The digest
+ * state is checkpointed each time another ckpt_every bytes have been
+ * hashed and, if the file is found unchanged in the checkpoint file,
+ * hashing continues from the last checkpoint.  A checkpoint is only
+ * taken on a block boundary so the state is just the four words.  The
+ * file's checkpoint is removed once it has been hashed or a read has
+ * failed.  Returns the digest as a new string or NULL on error. */
+
+static char *resume_digest(const char *name)
+{
+    int		  fd;
+    struct stat	  stbuf;
+    ckpt_t	  *ck;
+    md5_ctx_t	  ctx;
+    off_t	  pos, next;
+    ssize_t	  nbytes;
+    unsigned char buf[CHUNK_SIZE];
+    unsigned char digest[MD5_DIGEST];
+    char	  *hex = NULL;
+    resident_t	  res;
+
+    if ((fd = open_data(name, 0, &res)) < 0)
+    {
+	g_warning("unable to open file '%s' for reading - %m", name);
+	return NULL;
+    }
+    fstat(fd, &stbuf);
+    ck = g_hash_table_lookup(ckpt_table, name);
+    if (ck && ck->st_size == stbuf.st_size &&
+	same_time(&ck->st_mtim, &stbuf.st_mtim) &&
+	ck->st_dev == stbuf.st_dev && ck->st_ino == stbuf.st_ino &&
+	lseek(fd, ck->offset, SEEK_SET) == ck->offset)
+    {
+	ctx = ck->ctx;
+	pos = ck->offset;
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO, "resuming '%s' at byte %ld",
+		  name, (long)pos);
+    }
+    else
+    {
+	if (ck == NULL)
+	{
+	    ck = g_malloc0(sizeof(ckpt_t));
+	    ck->name = g_strdup(name);
+	    g_hash_table_insert(ckpt_table, ck->name, ck);
+	}
+	ck->st_size = stbuf.st_size;
+	ck->st_mtim = stbuf.st_mtim;
+	ck->st_dev = stbuf.st_dev;
+	ck->st_ino = stbuf.st_ino;
+	md5_init(&ctx);
+	ck->ctx = ctx;
+	ck->offset = pos = 0;
+    }
+    next = pos - pos % ckpt_every + ckpt_every;
+    res.dropped = pos - pos % sysconf(_SC_PAGESIZE);
+    while ((nbytes = read(fd, buf, sizeof(buf))) > 0)
+    {
+	md5_update(&ctx, buf, nbytes);
+	pos += nbytes;
+	drop_pages(&res, pos, 0);
+	if (pos >= next && pos % MD5_BLOCK == 0)
+	{
+	    ck->ctx = ctx;
+	    ck->offset = pos;
+	    save_checkpoints();
+	    next = pos - pos % ckpt_every + ckpt_every;
+	}
+    }
+    close_data(&res);
+    if (nbytes == 0)
+    {
+	md5_final(&ctx, digest);
+	hex = g_malloc(MD5_DIGEST * 2 + 1);
+	md5_hex(digest, hex);
+    }
+    else
+	g_warning("read error on file '%s' - %m", name);
+    g_hash_table_remove(ckpt_table, name);
+    g_free(ck->name);
+    g_free(ck);
+    save_checkpoints();
+    return hex;
+}
+
+/* Known file exclusion.  With --exclude-known the digests in one or more
+ * lists, eg. of the files in vendor and OS packages, are loaded into a
+ * sorted array with a Bloom filter in front of it.  Phase two drops any
+ * file whose digest is in the array before it is added to a group, so
+ * known files are neither compared nor listed.  Nearly all unknown
+ * digests are turned away by the filter without touching the array. */
+
+/* Bits in the Bloom filter per digest, as a shift, and the number of
+ * bits set for each, which gives about a 1% false positive rate. */
+
+#define KNOWN_BITS_SHIFT 4
+#define KNOWN_HASHES	 7
+
+/* The known digests, the Bloom filter over them and the number of files
+ * dropped. */
+
+typedef struct
+{
+    guint8  *digests;
+    gsize   n;
+    gsize   alloc;
+    guint64 *bloom;
+    guint64 mask;
+    gulong  excluded;
+} known_t;
+
+static known_t known;
+
+/* Converts a digest from hex to binary. */
+
+static void hex_to_bin(const char *hex, guint8 *bin)
+{
+    int i;
+
+    for (i = 0; i < MD5_DIGEST; i++)
+	bin[i] = (g_ascii_xdigit_value(hex[2*i]) << 4) |
+	    g_ascii_xdigit_value(hex[2*i+1]);
+}
+
+/* Comparison function used by qsort and bsearch on the known digests. */
+
+static int known_compare(const void *a, const void *b)
+{
+    return memcmp(a, b, MD5_DIGEST);
+}
+
+/* Loads a list of known digests.  Each line starts with an MD5 digest in
+ * hex, as written by md5sum, and any other lines are counted and
+ * ignored.  Returns 0 on success. */
+
+static int load_known(const char *fn)
+{
+    FILE   *fp;
+    char   *line = NULL, *ptr;
+    size_t size = 0;
+    gulong bad = 0;
+    int	   i;
+
+    if ((fp = fopen(fn, "r")) == NULL)
+    {
+	g_critical("unable to open known file list '%s' - %m", fn);
+	return 1;
+    }
+    while (getline(&line, &size, fp) > 0)
+    {
+	for (ptr = line; *ptr == ' ' || *ptr == '\t'; ptr++)
+	    ;
+	for (i = 0; i < MD5_DIGEST * 2 && g_ascii_isxdigit(ptr[i]); i++)
+	    ;
+	if (i < MD5_DIGEST * 2 || g_ascii_isxdigit(ptr[i]))
+	{
+	    bad++;
+	    continue;
+	}
+	if (known.n == known.alloc)
+	{
+	    known.alloc = known.alloc ? known.alloc * 2 : 4096;
+	    known.digests = g_realloc(known.digests, known.alloc * MD5_DIGEST);
+	}
+	hex_to_bin(ptr, known.digests + known.n++ * MD5_DIGEST);
+    }
+    g_free(line);
+    fclose(fp);
+    if (bad && !(options & OPT_QUIET))
+	g_warning("%lu lines in known file list '%s' ignored", bad, fn);
+    return 0;
+}
+
+/* Works out the Bloom filter bits for a digest, which is already well
+ * mixed, by double hashing with its two halves. */
+
+static void known_bits(const guint8 *digest, guint64 *bits)
+{
+    guint64 h1, h2;
+    int	    i;
+
+    memcpy(&h1, digest, sizeof(h1));
+    memcpy(&h2, digest + sizeof(h1), sizeof(h2));
+    h2 |= 1;
+    for (i = 0; i < KNOWN_HASHES; i++)
+	bits[i] = (h1 + i * h2) & known.mask;
+}
+
+/* Sorts the known digests, drops repeats and builds the Bloom filter,
+ * once all the lists are loaded. */
+
+static void known_finish(void)
+{
+    gsize   i, j;
+    guint64 nbits, bits[KNOWN_HASHES];
+    int	    k;
+
+    qsort(known.digests, known.n, MD5_DIGEST, known_compare);
+    for (i = j = 0; i < known.n; i++)
+	if (j == 0 || memcmp(known.digests + i * MD5_DIGEST,
+			     known.digests + (j - 1) * MD5_DIGEST,
+			     MD5_DIGEST) != 0)
+	    memmove(known.digests + j++ * MD5_DIGEST,
+		    known.digests + i * MD5_DIGEST, MD5_DIGEST);
+    known.n = j;
+    for (nbits = 64; nbits < (guint64)known.n << KNOWN_BITS_SHIFT; nbits <<= 1)
+	;
+    known.mask = nbits - 1;
+    known.bloom = g_malloc0(nbits / 8);
+    for (i = 0; i < known.n; i++)
+    {
+	known_bits(known.digests + i * MD5_DIGEST, bits);
+	for (k = 0; k < KNOWN_HASHES; k++)
+	    known.bloom[bits[k] / 64] |= 1ULL << (bits[k] % 64);
+    }
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "%lu known digests loaded",
+	      (unsigned long)known.n);
+}
+
+/* Returns true if a digest, in hex, is in the known lists. */
+
+static int is_known(const char *digest_txt)
+{
+    guint8  digest[MD5_DIGEST];
+    guint64 bits[KNOWN_HASHES];
+    int	    k;
+
+    hex_to_bin(digest_txt, digest);
+    known_bits(digest, bits);
+    for (k = 0; k < KNOWN_HASHES; k++)
+	if (!(known.bloom[bits[k] / 64] & (1ULL << (bits[k] % 64))))
+	    return FALSE;
+    return bsearch(digest, known.digests, known.n, MD5_DIGEST,
+		   known_compare) != NULL;
+}
+
+/* fs-verity.  With --digest=verity a file with fs-verity enabled is
+ * grouped by the digest the kernel keeps for it, read with
+ * FS_IOC_MEASURE_VERITY, instead of by reading the file.  With
+ * --digest=auto this is done for a size group only if every file in it
+ * has fs-verity enabled, so copies without it are still found.  The
+ * verity digests are kept apart from MD5 ones by a "verity:" prefix and
+ * as the kernel guarantees the contents match the digest the files in
+ * a group keyed by one are not compared byte by byte. */
+
+#define VERITY_PREFIX "verity:"
+
+/* Returns true if a digest is an fs-verity measurement. */
+
+static int is_verity(const char *digest)
+{
+    return digest && !strncmp(digest, VERITY_PREFIX,
+			      sizeof(VERITY_PREFIX) - 1);
+}
+
+/* Reads the fs-verity measurement of a file.  Returns it as a new string,
+ * including the hash algorithm, or NULL if the file does not have
+ * fs-verity enabled or could not be opened. */
+
+static char *verity_digest(const char *name)
+{
+    struct
+    {
+	struct fsverity_digest hdr;
+	guint8		       buf[64];
+    } m;
+    int			       fd, res;
+    GString		       *str;
+    int			       i;
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+	return NULL;
+    m.hdr.digest_size = sizeof(m.buf);
+    res = ioctl(fd, FS_IOC_MEASURE_VERITY, &m.hdr);
+    close(fd);
+    if (res != 0)
+	return NULL;
+    str = g_string_new(VERITY_PREFIX);
+    g_string_append_printf(str, "%u:", m.hdr.digest_algorithm);
+    for (i = 0; i < m.hdr.digest_size; i++)
+	g_string_append_printf(str, "%02x", m.hdr.digest[i]);
+    return g_string_free(str, FALSE);
+}
+
+/* Reports the number of files dropped as known, in verbose mode. */
+
+static void report_known(void)
+{
+    if (known.n && (options & OPT_VERBOSE))
+	g_log(NULL, G_LOG_LEVEL_INFO, "%lu known files excluded",
+	      known.excluded);
+}
+
+/* Function used during phase two to add a file to the list of files
+ * having the given digest, unless the digest is a known one.  A digest
+ * taken from the package checksums is not trusted to exclude a file. */
+
+static void add_digest(tree_foreach_t *fdata, const char *digest_txt,
+		       gpointer value)
+{
+    char	*digest_cpy;
+    file_list_t *file_list;
+
+    if (known.n && !is_verity(digest_txt) &&
+	!(((file_t *)value)->flags & FILE_PKG) && is_known(digest_txt))
+    {
+	known.excluded++;
+	return;
+    }
+    if ((file_list = g_hash_table_lookup(fdata->hash, digest_txt))) {
+	file_list->nfile++;
+	file_list->files = g_list_append(file_list->files, value);
+    }
+    else {
+	digest_cpy = g_strdup(digest_txt);
+	file_list = g_malloc(sizeof(file_list_t));
+	file_list->nfile = 1;
+	file_list->files = g_list_append(NULL, value);
+	g_hash_table_insert(fdata->hash, digest_cpy, file_list);
+    }
+}
+
+/* Function called by g_tree_foreach to group the files by size.  The
+ * size hash table reuses file_list_t as its value and is keyed by a
+ * pointer to the st_size of the first file seen. */
+
+static gboolean size_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    file_t	*fp = value;
+    GHashTable	*size_hash = udata;
+    file_list_t *file_list;
+
+    if ((file_list = g_hash_table_lookup(size_hash, &fp->st_size)))
+    {
+	file_list->nfile++;
+	file_list->files = g_list_prepend(file_list->files, fp);
+    }
+    else
+    {
+	file_list = g_malloc(sizeof(file_list_t));
+	file_list->nfile = 1;
+	file_list->files = g_list_prepend(NULL, fp);
+	g_hash_table_insert(size_hash, &fp->st_size, file_list);
+    }
+    return FALSE;
+}
+
+/* Groups the files in the list by size, for the modes which avoid
+ * hashing files whose size is not shared with another file and for
+ * the multi backend, which hashes files of the same size together. */
+
+static GHashTable *build_size_hash(GTree *file_tree)
+{
+    GHashTable *size_hash;
+
+    size_hash = g_hash_table_new(g_int64_hash, g_int64_equal);
+    g_tree_foreach(file_tree, size_foreach, size_hash);
+    return size_hash;
+}
+
+/* Frees a hash table with file_list_t values and, if free_keys is set,
+ * keys which are strings belonging to the table. */
+
+static void free_lists(GHashTable *hash, int free_keys)
+{
+    GHashTableIter iter;
+    gpointer	   key, value;
+
+    g_hash_table_iter_init(&iter, hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	g_list_free(((file_list_t *)value)->files);
+	g_free(value);
+	if (free_keys)
+	    g_free(key);
+    }
+    g_hash_table_destroy(hash);
+}
+
+/* Allocates the read ring's buffers, page aligned for O_DIRECT. */
+
+static void ring_init(void)
+{
+    int i;
+
+    if (ring.buf[0])
+	return;
+    g_mutex_init(&ring.lock);
+    g_cond_init(&ring.cond);
+    for (i = 0; i < RING_BUFS; i++)
+	if (posix_memalign((void **)&ring.buf[i], sysconf(_SC_PAGESIZE),
+			   RING_SIZE) != 0)
+	    g_error("out of memory for the read ring");
+}
+
+/* Function called by the reader thread to fill the read ring from the
+ * file, one buffer at a time, waiting while all the buffers are full. */
+
+static gpointer ring_reader(gpointer data)
+{
+    ring_t  *rp = data;
+    ssize_t nbytes;
+    int	    slot;
+
+    do
+    {
+	g_mutex_lock(&rp->lock);
+	while (rp->filled - rp->used == RING_BUFS)
+	    g_cond_wait(&rp->cond, &rp->lock);
+	slot = rp->filled % RING_BUFS;
+	g_mutex_unlock(&rp->lock);
+	nbytes = read(rp->fd, rp->buf[slot], RING_SIZE);
+	g_mutex_lock(&rp->lock);
+	rp->len[slot] = nbytes;
+	rp->err = errno;
+	rp->filled++;
+	g_cond_signal(&rp->cond);
+	g_mutex_unlock(&rp->lock);
+    }
+    while (nbytes > 0);
+    return NULL;
+}
+
+/* Reads a file from fd to the end, passing each piece to consume.
+ * Files of RING_MIN bytes or more are read ahead into the read ring by
+ * a helper thread so the disk and the hashing keep busy at the same
+ * time, the time taken being nearer that of the slower of the two than
+ * their sum.  A file opened with O_DIRECT is read into the ring's
+ * aligned buffers whatever its size, and one which was not cached is
+ * dropped from the page cache as it is consumed.  Returns 0 on success
+ * or -1 on a read error with errno set. */
+
+static int read_file(int fd, void (*consume)(const unsigned char *buf,
+					     size_t len, void *ctx),
+		     void *ctx)
+{
+    unsigned char buf[CHUNK_SIZE];
+    unsigned char *p = buf;
+    struct stat	  st;
+    GThread	  *reader = NULL;
+    size_t	  len = sizeof(buf);
+    ssize_t	  nbytes;
+    resident_t	  *res = cold_data(fd);
+    off_t	  pos = 0;
+    int		  slot;
+
+    if (cache_mode == CACHE_DIRECT && (fcntl(fd, F_GETFL) & O_DIRECT))
+    {
+	ring_init();
+	p = ring.buf[0];
+	len = RING_SIZE;
+    }
+    if (overlap && fstat(fd, &st) == 0 && st.st_size >= RING_MIN)
+    {
+	ring_init();
+	ring.fd = fd;
+	ring.filled = ring.used = 0;
+	reader = g_thread_try_new("reader", ring_reader, &ring, NULL);
+    }
+    if (reader == NULL)
+    {
+	while ((nbytes = read(fd, p, len)) > 0)
+	{
+	    consume(p, nbytes, ctx);
+	    drop_pages(res, pos += nbytes, 0);
+	}
+	return nbytes == 0 ? 0 : -1;
+    }
+    do
+    {
+	g_mutex_lock(&ring.lock);
+	while (ring.filled == ring.used)
+	    g_cond_wait(&ring.cond, &ring.lock);
+	slot = ring.used % RING_BUFS;
+	nbytes = ring.len[slot];
+	g_mutex_unlock(&ring.lock);
+	if (nbytes > 0)
+	{
+	    consume(ring.buf[slot], nbytes, ctx);
+	    drop_pages(res, pos += nbytes, 0);
+	}
+	g_mutex_lock(&ring.lock);
+	ring.used++;
+	g_cond_signal(&ring.cond);
+	g_mutex_unlock(&ring.lock);
+    }
+    while (nbytes > 0);
+    g_thread_join(reader);
+    errno = ring.err;
+    return nbytes == 0 ? 0 : -1;
+}
+
+/* The mmap engine.  With --mmap, files of MMAP_MIN bytes or more on
+ * local, non-rotating storage are hashed and compared straight from
+ * the page cache through mappings of MMAP_WINDOW bytes at a time,
+ * saving the copy into a buffer made by read(2), which dominates when
+ * the files are already cached.  A file truncated while mapped raises
+ * SIGBUS when the missing pages are touched, which is caught and
+ * treated as a read error. */
+
+/* Handles SIGBUS, jumping back out of the mapping being read if there
+ * is one and otherwise dying as usual. */
+
+static void mmap_bus(int sig)
+{
+    if (mmap_active)
+    {
+	mmap_active = 0;
+	siglongjmp(mmap_env, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Returns whether files on the device st_dev, which name is on, suit
+ * the mmap engine.  Network and FUSE filesystems do not, as pages there
+ * may be slow to fault in and a file may shrink at any time, nor do
+ * block devices which the kernel says rotate, where read(2) with its
+ * larger requests does better.  The answer is kept for each device. */
+
+static int mmap_device(dev_t dev, const char *name)
+{
+    struct statfs sfs;
+    gint64	  *key;
+    gpointer	  ok;
+    char	  *path;
+    FILE	  *fp;
+    int		  rot = 0;
+
+    if (mmap_devs == NULL)
+	mmap_devs = g_hash_table_new(g_int64_hash, g_int64_equal);
+    if (g_hash_table_lookup_extended(mmap_devs, &(gint64){ dev }, NULL, &ok))
+	return GPOINTER_TO_INT(ok);
+    if (statfs(name, &sfs) == 0 &&
+	(sfs.f_type == NFS_SUPER_MAGIC || sfs.f_type == SMB_SUPER_MAGIC ||
+	 sfs.f_type == (typeof(sfs.f_type))0xff534d42 ||   /* cifs */
+	 sfs.f_type == (typeof(sfs.f_type))0xfe534d42 ||   /* smb2 */
+	 sfs.f_type == 0x65735546 ||			   /* fuse */
+	 sfs.f_type == CODA_SUPER_MAGIC))
+	rot = 1;
+    else if (major(dev) != 0)
+    {
+	/* A partition has no queue of its own so look at its disk's. */
+
+	path = g_strdup_printf("/sys/dev/block/%u:%u/queue/rotational",
+			       major(dev), minor(dev));
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+	    g_free(path);
+	    path = g_strdup_printf("/sys/dev/block/%u:%u/../queue/rotational",
+				   major(dev), minor(dev));
+	    fp = fopen(path, "r");
+	}
+	if (fp)
+	{
+	    rot = fgetc(fp) == '1';
+	    fclose(fp);
+	}
+	g_free(path);
+    }
+    key = g_new(gint64, 1);
+    *key = dev;
+    g_hash_table_insert(mmap_devs, key, GINT_TO_POINTER(!rot));
+    return !rot;
+}
+
+/* Returns whether the open file fd, called name, is to be hashed or
+ * compared through the mmap engine, leaving its size in *size.  Not
+ * with --cache-neutral, which has its own way of reading, or the
+ * afalg backend, which has the kernel read the file. */
+
+static int mmap_file(int fd, const char *name, off_t *size)
+{
+    struct stat st;
+
+    if (!use_mmap || cache_mode != CACHE_NORMAL || fstat(fd, &st) != 0 ||
+	st.st_size < MMAP_MIN || !S_ISREG(st.st_mode))
+	return 0;
+    *size = st.st_size;
+    return mmap_device(st.st_dev, name);
+}
+
+/* Hashes the first size bytes of the file fd with the MD5 in md5.c,
+ * from mappings of one window at a time advised for sequential access.
+ * Returns 0 on success, or -1 with errno set if a window cannot be
+ * mapped or the file shrinks, raising SIGBUS, while it is read. */
+
+static int hash_mmap(int fd, off_t size, char *hex)
+{
+    md5_ctx_t	   ctx;
+    unsigned char  digest[MD5_DIGEST];
+    void	   (*old)(int);
+    void *volatile map = NULL;
+    volatile off_t pos = 0;
+    volatile size_t len = 0;
+    int		   status = 0;
+
+    md5_init(&ctx);
+    old = signal(SIGBUS, mmap_bus);
+    if (sigsetjmp(mmap_env, 1))
+    {
+	munmap(map, len);
+	errno = EIO;
+	status = -1;
+    }
+    else
+	for (; pos < size; pos += len)
+	{
+	    len = MIN(size - pos, MMAP_WINDOW);
+	    if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, pos)) ==
+		MAP_FAILED)
+	    {
+		status = -1;
+		break;
+	    }
+	    madvise(map, len, MADV_SEQUENTIAL);
+	    mmap_active = 1;
+	    md5_update(&ctx, map, len);
+	    mmap_active = 0;
+	    munmap(map, len);
+	}
+    signal(SIGBUS, old);
+    if (status == 0)
+    {
+	md5_final(&ctx, digest);
+	md5_hex(digest, hex);
+    }
+    return status;
+}
+
+/* Compares the first size bytes of two files through mappings of one
+ * window of each at a time, with memcmp, which the C library
+ * vectorises.  Returns 1 if they are the same, 0 if they differ or -1
+ * with errno set if either cannot be mapped or shrinks while it is
+ * read. */
+
+static int compare_mmap(int fd1, int fd2, off_t size)
+{
+    void	   (*old)(int);
+    void *volatile map1 = MAP_FAILED;
+    void *volatile map2 = MAP_FAILED;
+    volatile off_t pos = 0;
+    volatile size_t len = 0;
+    int		   status = 1;
+
+    old = signal(SIGBUS, mmap_bus);
+    if (sigsetjmp(mmap_env, 1))
+    {
+	errno = EIO;
+	status = -1;
+    }
+    else
+	for (; pos < size && status == 1; pos += len)
+	{
+	    len = MIN(size - pos, MMAP_WINDOW);
+	    map1 = mmap(NULL, len, PROT_READ, MAP_SHARED, fd1, pos);
+	    map2 = mmap(NULL, len, PROT_READ, MAP_SHARED, fd2, pos);
+	    if (map1 == MAP_FAILED || map2 == MAP_FAILED)
+	    {
+		status = -1;
+		break;
+	    }
+	    madvise(map1, len, MADV_SEQUENTIAL);
+	    madvise(map2, len, MADV_SEQUENTIAL);
+	    mmap_active = 1;
+	    if (memcmp(map1, map2, len) != 0)
+		status = 0;
+	    mmap_active = 0;
+	    munmap(map1, len);
+	    munmap(map2, len);
+	    map1 = map2 = MAP_FAILED;
+	}
+    if (map1 != MAP_FAILED)
+	munmap(map1, len);
+    if (map2 != MAP_FAILED)
+	munmap(map2, len);
+    signal(SIGBUS, old);
+    return status;
+}
+
+/* Digest backends.  Phase two hashes a file with whichever of these
+ * hash_func points to, each of which reads the whole file from fd and
+ * puts the MD5 digest in hex.  They return 0 on success or -1 on a read
+ * error, leaving errno set.  hash_glib and hash_md5 are user space
+ * implementations, from glib and md5.c, while hash_afalg has the
+ * kernel's crypto drivers do the hashing, the data being moved from the
+ * file to an AF_ALG socket with splice(2) rather than being copied in
+ * and out of user space.  hash_multi stands for the multi backend,
+ * which hashes small files of the same size MD5_LANES at a time with
+ * md5_multi, in phase two going through the files by size so it can
+ * fill the lanes; files it cannot batch are hashed with md5.c as
+ * usual.  --hash-benchmark times each of them on the same files so the
+ * fastest can be chosen with --hash-backend. */
+
+/* Function called by read_file to add data to a glib checksum. */
+
+static void glib_update(const unsigned char *buf, size_t len, void *ctx)
+{
+    g_checksum_update(ctx, buf, len);
+}
+
+/* Hashes a file with glib's MD5. */
+
+static int hash_glib(int fd, char *hex)
+{
+    static GChecksum *ck;
+    int		     status;
+
+    if (ck == NULL)
+	ck = g_checksum_new(G_CHECKSUM_MD5);
+    if ((status = read_file(fd, glib_update, ck)) == 0)
+	strcpy(hex, g_checksum_get_string(ck));
+    g_checksum_reset(ck);
+    return status;
+}
+
+/* Function called by read_file to add data to an md5.c digest. */
+
+static void md5_consume(const unsigned char *buf, size_t len, void *ctx)
+{
+    md5_update(ctx, buf, len);
+}
+
+/* Hashes a file with the MD5 in md5.c. */
+
+static int hash_md5(int fd, char *hex)
+{
+    md5_ctx_t	  ctx;
+    unsigned char digest[MD5_DIGEST];
+
+    md5_init(&ctx);
+    if (read_file(fd, md5_consume, &ctx) != 0)
+	return -1;
+    md5_final(&ctx, digest);
+    md5_hex(digest, hex);
+    return 0;
+}
+
+/* The AF_ALG operation socket and the pipe used to splice into it. */
+
+static int afalg_op = -1;
+static int afalg_pipe[2] = { -1, -1 };
+
+/* Closes the AF_ALG socket and pipe. */
+
+static void afalg_close(void)
+{
+    if (afalg_op >= 0)
+	close(afalg_op);
+    if (afalg_pipe[0] >= 0)
+    {
+	close(afalg_pipe[0]);
+	close(afalg_pipe[1]);
+    }
+    afalg_op = afalg_pipe[0] = afalg_pipe[1] = -1;
+}
+
+/* Opens an AF_ALG socket for MD5 and the pipe to feed it.  Returns 0 on
+ * success. */
+
+static int afalg_open(void)
+{
+    struct sockaddr_alg sa;
+    int			tfm;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.salg_family = AF_ALG;
+    strcpy((char *)sa.salg_type, "hash");
+    strcpy((char *)sa.salg_name, "md5");
+    if ((tfm = socket(AF_ALG, SOCK_SEQPACKET, 0)) < 0)
+	return -1;
+    if (bind(tfm, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+	(afalg_op = accept(tfm, NULL, 0)) < 0 || pipe(afalg_pipe) != 0)
+    {
+	close(tfm);
+	afalg_close();
+	return -1;
+    }
+    close(tfm);
+    fcntl(afalg_pipe[1], F_SETPIPE_SZ, AFALG_CHUNK);
+    return 0;
+}
+
+/* Hashes a file in the kernel.  Each piece of the file is spliced into
+ * the pipe and from there to the socket with SPLICE_F_MORE, so the
+ * kernel keeps the hash open, and reading from the socket finishes the
+ * hash and readies it for the next file.  After an error the socket
+ * and pipe may hold part of a file so they are opened afresh. */
+
+static int hash_afalg(int fd, char *hex)
+{
+    unsigned char digest[MD5_DIGEST];
+    ssize_t	  nin, nout;
+    int		  err;
+
+    if (afalg_op < 0 && afalg_open() != 0)
+	return -1;
+    while ((nin = splice(fd, NULL, afalg_pipe[1], NULL, AFALG_CHUNK,
+			 SPLICE_F_MOVE)) > 0)
+    {
+	for (; nin > 0; nin -= nout)
+	    if ((nout = splice(afalg_pipe[0], NULL, afalg_op, NULL, nin,
+			       SPLICE_F_MOVE|SPLICE_F_MORE)) <= 0)
+		break;
+	if (nin > 0)
+	    break;
+    }
+    if (nin != 0 || read(afalg_op, digest, sizeof(digest)) != sizeof(digest))
+    {
+	err = errno;
+	afalg_close();
+	errno = err;
+	return -1;
+    }
+    md5_hex(digest, hex);
+    return 0;
+}
+
+/* Hashes a file on its own with the multi backend. */
+
+static int hash_multi(int fd, char *hex)
+{
+    return hash_md5(fd, hex);
+}
+
+/* Hashes up to MD5_LANES files of the same size, no more than
+ * MULTI_MAX bytes, together.  Each file is read whole into its part of
+ * a buffer kept from one call to the next.  A file which cannot be read
+ * is warned about and gets an empty digest while one whose size has
+ * changed since it was listed is hashed on its own. */
+
+static void hash_lanes(file_t **files, int n, char hex[][MD5_DIGEST * 2 + 1])
+{
+    static unsigned char *buf;
+    const unsigned char	 *data[MD5_LANES];
+    unsigned char	 digest[MD5_LANES][MD5_DIGEST];
+    int			 lane[MD5_LANES];
+    off_t		 size = files[0]->st_size;
+    off_t		 got;
+    ssize_t		 nbytes;
+    char		 extra;
+    resident_t		 res;
+    int			 fd, i, m = 0;
+
+    if (buf == NULL)
+	buf = g_malloc(MD5_LANES * MULTI_MAX);
+    for (i = 0; i < n; i++)
+    {
+	hex[i][0] = '\0';
+	if ((fd = open_data(files[i]->name, 0, &res)) < 0)
+	{
+	    g_warning("unable to open file '%s' for reading - %m",
+		      files[i]->name);
+	    continue;
+	}
+	nbytes = 0;
+	for (got = 0; got < size; got += nbytes)
+	    if ((nbytes = read(fd, buf + m * size + got, size - got)) <= 0)
+		break;
+	if (got == size && (nbytes = read(fd, &extra, 1)) == 0)
+	{
+	    data[m] = buf + m * size;
+	    lane[m++] = i;
+	}
+	else if (nbytes >= 0 && lseek(fd, 0, SEEK_SET) == 0)
+	{
+	    if (hash_md5(fd, hex[i]) != 0)
+		g_warning("read error on file '%s' - %m", files[i]->name);
+	}
+	else
+	    g_warning("read error on file '%s' - %m", files[i]->name);
+	close_data(&res);
+    }
+    if (m == 0)
+	return;
+    md5_multi(data, m, size, digest);
+    for (i = 0; i < m; i++)
+	md5_hex(digest[i], hex[lane[i]]);
+}
+
+/* Which backend phase two uses. */
+
+static int (*hash_func)(int fd, char *hex) = hash_glib;
+
+/* The backends by name, for --hash-backend and --hash-benchmark. */
+
+static const struct
+{
+    const char *name;
+    int	       (*func)(int fd, char *hex);
+} hash_backends[] =
+{
+    { "glib",  hash_glib  },
+    { "md5",   hash_md5   },
+    { "afalg", hash_afalg },
+    { "multi", hash_multi }
+};
+
+/* Totals for one backend during --hash-benchmark. */
+
+typedef struct
+{
+    int	    (*func)(int fd, char *hex);
+    guint64 bytes;
+    gulong  files;
+    int	    errors;
+} bench_t;
+
+/* Function called by g_tree_foreach to hash each file with the backend
+ * being benchmarked. */
+
+static gboolean bench_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    bench_t *bp = udata;
+    char    hex[MD5_DIGEST * 2 + 1];
+    int	    fd;
+
+    if ((fd = open(key, O_RDONLY)) < 0)
+	bp->errors++;
+    else
+    {
+	if (bp->func(fd, hex) == 0)
+	{
+	    bp->files++;
+	    bp->bytes += ((file_t *)value)->st_size;
+	}
+	else
+	    bp->errors++;
+	close(fd);
+    }
+    return FALSE;
+}
+
+/* Hashes the files for --hash-benchmark as the multi backend does in
+ * phase two, small files of the same size in lanes and the rest one at
+ * a time. */
+
+static void bench_multi(GTree *file_tree, bench_t *bp)
+{
+    GHashTable	   *size_hash;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    file_list_t	   *file_list;
+    GList	   *ptr;
+    file_t	   *batch[MD5_LANES];
+    char	   hex[MD5_LANES][MD5_DIGEST * 2 + 1];
+    int		   i, n;
+
+    size_hash = build_size_hash(file_tree);
+    g_hash_table_iter_init(&iter, size_hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	file_list = value;
+	if (file_list->nfile == 1 || *(off_t *)key > MULTI_MAX)
+	{
+	    for (ptr = file_list->files; ptr; ptr = ptr->next)
+		bench_foreach(((file_t *)ptr->data)->name, ptr->data, bp);
+	    continue;
+	}
+	for (ptr = file_list->files, n = 0; ptr; ptr = ptr->next)
+	{
+	    batch[n++] = ptr->data;
+	    if (n < MD5_LANES && ptr->next)
+		continue;
+	    hash_lanes(batch, n, hex);
+	    for (i = 0; i < n; i++)
+		if (hex[i][0])
+		{
+		    bp->files++;
+		    bp->bytes += batch[i]->st_size;
+		}
+		else
+		    bp->errors++;
+	    n = 0;
+	}
+    }
+    free_lists(size_hash, 0);
+}
+
+/* Implements --hash-benchmark, hashing all the files in the list with
+ * each backend in turn.  A first untimed pass brings the files into the
+ * page cache so the backends are compared on hashing rather than I/O.
+ * Returns the number of errors. */
+
+static int hash_benchmark(GTree *file_tree)
+{
+    bench_t	    bench;
+    struct timespec start, end;
+    double	    secs;
+    int		    i, status = 0;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.func = hash_glib;
+    g_tree_foreach(file_tree, bench_foreach, &bench);
+    printf("%-8s %10s %14s %9s %10s\n", "backend", "files", "bytes",
+	   "seconds", "MB/s");
+    for (i = 0; i < G_N_ELEMENTS(hash_backends); i++)
+    {
+	memset(&bench, 0, sizeof(bench));
+	bench.func = hash_backends[i].func;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (bench.func == hash_multi)
+	    bench_multi(file_tree, &bench);
+	else
+	    g_tree_foreach(file_tree, bench_foreach, &bench);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (bench.files == 0 && bench.errors)
+	{
+	    printf("%-8s unavailable - %s\n", hash_backends[i].name,
+		   g_strerror(errno));
+	    continue;
+	}
+	printf("%-8s %10lu %14" G_GUINT64_FORMAT " %9.3f %10.1f\n",
+	       hash_backends[i].name, bench.files, bench.bytes, secs,
+	       secs > 0 ? bench.bytes / secs / 1e6 : 0.0);
+	status += bench.errors;
+    }
+    return status;
+}
+
+/* Function called during phase two by g_hash_table_foreach for each
+ * file in the first hashtable, keyed by filename.  A digest already
+ * known from the scan cache is used without reading the file, as is an
+ * fs-verity measurement with --digest=verity, large files are hashed
+ * with checkpoints if a checkpoint file is in use and with --mmap
+ * files which suit it are hashed by the mmap engine. */
+
+static gboolean file_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    char	   *file = key;
+    file_t	   *fp = value;
+    char	   *digest;
+    char	   hex[MD5_DIGEST * 2 + 1];
+    tree_foreach_t *fdata = udata;
+    resident_t	   res;
+    off_t	   size;
+    int            fd;
+
+    if (lib_step(DUPFIND_PHASE_DIGEST))
+	return TRUE;
+    if (fp->digest && digest_mode == DIGEST_MD5 && is_verity(fp->digest)) {
+	g_free(fp->digest);
+	fp->digest = NULL;
+    }
+    if (fp->digest) {
+	add_digest(fdata, fp->digest, value);
+	return FALSE;
+    }
+    if (digest_mode == DIGEST_VERITY && (digest = verity_digest(file))) {
+	add_digest(fdata, digest, value);
+	if (keep_digests)
+	    fp->digest = digest;
+	else
+	    g_free(digest);
+	return FALSE;
+    }
+    if (ckpt_file && fp->st_size >= ckpt_every) {
+	if ((digest = resume_digest(file))) {
+	    add_digest(fdata, digest, value);
+	    if (keep_digests)
+		fp->digest = digest;
+	    else
+		g_free(digest);
+	}
+	else
+	    hash_errors++;
+	return FALSE;
+    }
+    if ((fd = open_data(file, hash_func != hash_afalg, &res)) >= 0) {
+	if ((hash_func != hash_afalg && mmap_file(fd, file, &size) ?
+	     hash_mmap(fd, size, hex) : hash_func(fd, hex)) == 0) {
+	    add_digest(fdata, hex, value);
+	    if (keep_digests)
+		fp->digest = g_strdup(hex);
+        }
+        else
+	{
+	    g_warning("read error on file '%s' - %m", file);
+	    hash_errors++;
+	}
+	close_data(&res);
+    }
+    else
+    {
+	g_warning("unable to open file '%s' for reading - %m", file);
+	hash_errors++;
+    }
+    return FALSE;
+}
+
+/* Comparison function used during phase three, called by g_list_sort
+ * and used to sort a list of files by the number of hard links - this
+ * is need for the correct handling of groups of files having the same
+ * digest where some are hard-linked together and others are not. */
+
+static gint sort_compare(gconstpointer a, gconstpointer b)
+{
+    const file_t *fa = a;
+    const file_t *fb = b;
+    gint res;
+
+    if ((res = (fb->flags & FILE_MASTER) - (fa->flags & FILE_MASTER)) == 0 &&
+	(res = fb->st_nlink - fa->st_nlink) == 0)
+	res = strcmp(fa->name, fb->name);
+    return res;
+}
+
+/* Function used during phase three, it takes a list of files and
+ * returns another list which contains only one file from any set
+ * that are hard-linked together */
+
+static GList *filter_links(GList *list)
+{
+    GList  *ptr;
+    file_t *fp1, *fp2;
+    int	   found;
+
+    if (list == NULL)
+	return NULL;
+
+    GList *new_list = g_list_append(NULL, list->data);
+    while ((list = list->next))
+    {
+	fp1 = list->data;
+	found = 0;
+	for (ptr = new_list; ptr; ptr = ptr->next)
+	{
+	    fp2 = ptr->data;
+	    if (fp2->st_dev == fp1->st_dev &&
+		fp2->st_ino == fp1->st_ino)
+	    {
+		found = 1;
+		break;
+	    }
+	}
+	if (found == 0)
+	    new_list = g_list_append(new_list, fp1);
+    }
+    return new_list;
+}
+
+/* Function used during phase three, to do a byte-by-byte comparison of
+ * two files - returns 1 is they are the same, 0 otherwise.  With
+ * --cache-neutral=direct the files are read with O_DIRECT into the
+ * aligned buffers of the read ring, which is otherwise unused by then,
+ * and with --mmap files which suit it are compared by the mmap engine. */
+
+static int compare_files(file_t *file1, file_t *file2)
+{
+    const char	  *name1, *name2;
+    int		  fd1, fd2;
+    char	  sbuf1[CHUNK_SIZE], sbuf2[CHUNK_SIZE];
+    unsigned char *buf1 = (unsigned char *)sbuf1, *buf2 = (unsigned char *)sbuf2;
+    size_t	  len = CHUNK_SIZE;
+    ssize_t	  nb1, nb2;
+    off_t	  pos = 0;
+    resident_t	  res1, res2;
+    off_t	  size1, size2;
+    int		  status;
+
+    if (cache_mode == CACHE_DIRECT)
+    {
+	ring_init();
+	buf1 = ring.buf[0];
+	buf2 = ring.buf[1];
+	len = RING_SIZE;
+    }
+    status = 0;
+    name1 = file1->name;
+    if ((fd1 = open_data(name1, 1, &res1)) != -1)
+    {
+	name2 = file2->name;
+	if ((fd2 = open_data(name2, 1, &res2)) != -1)
+	{
+	    if (mmap_file(fd1, name1, &size1) && mmap_file(fd2, name2, &size2))
+	    {
+		if (size1 == size2 &&
+		    (status = compare_mmap(fd1, fd2, size1)) < 0)
+		{
+		    g_critical("read error comparing '%s' and '%s' - %m",
+			       name1, name2);
+		    status = 0;
+		}
+	    }
+	    else
+		do
+		{
+		    if ((nb1 = read(fd1, buf1, len)) == -1)
+		    {
+			g_critical("read error on file '%s' - %m", name1);
+			break;
+		    }
+		    if ((nb2 = read(fd2, buf2, len)) == -1)
+		    {
+			g_critical("read error on file '%s' - %m", name2);
+			break;
+		    }
+		    if (nb1 == 0 && nb2 == 0)
+		    {
+			status = 1;
+			break;
+		    }
+		    pos += nb1;
+		    drop_pages(&res1, pos, 0);
+		    drop_pages(&res2, pos, 0);
+		}
+		while (nb1 == nb2 && memcmp(buf1, buf2, nb1) == 0);
+	    close_data(&res2);
+	}
+	else
+	    g_critical("unable to open file '%s' for reading - %m", name2);
+	close_data(&res1);
+    }
+    else
+	g_critical("unable to open file '%s' for reading - %m", name1);
+    return status;
+}
+
+/* Function used during phase three.  This function makes the second file,
+ * called the slave, a hard link to the first, called the master. */
+
+static void link_pair(file_t *master, file_t *slave)
+{
+    if (unlink(slave->name) == 0)
+    {
+	if (link(master->name, slave->name) == -1)
+	    g_warning("unable to link '%s' to '%s' - %m",
+		      master->name, slave->name);
+    }
+    else
+	g_warning("unable to unlink '%s' - %m", slave->name);
+}
+
+/* Function used during phase three to implement the interactive deletion
+ * of some files from a group known to have the same contents. */
+
+static void delete_files(const char *digest, file_t *master, GList *list)
+{
+    GList      *delete_list;
+    GList      *ptr;
+    delete_t   *elem;
+    int	       print_list;
+    int	       i;
+    char       buf[20];
+    const char *name;
+
+    elem = g_malloc(sizeof(delete_t));
+    elem->file = master;
+    elem->keep = 1;
+    delete_list = g_list_append(NULL, elem);
+
+    for (ptr = list; ptr; ptr = ptr->next)
+    {
+	elem = g_malloc(sizeof(delete_t));
+	elem->file = ptr->data;
+	elem->keep = 0;
+	delete_list = g_list_append(delete_list, elem);
+    }
+
+    for (print_list = 1; ;)
+    {
+	if (print_list)
+	{
+	    printf("\nDisposition of files with digest %s\n\n", digest);
+	    i = 1;
+	    for (ptr = delete_list; ptr; ptr = ptr->next)
+	    {
+		elem = ptr->data;
+		printf("%5d %c %s (%ld links)\n",
+		       i++, elem->keep ? '*' : ' ',
+                       elem->file->name, elem->file->st_nlink);
+	    }
+	    fputs("\nFiles marked (*) will be kept - these reset deleted\n"
+		  "To toggle a file's status type its number\n"
+		  "Type 'go' to go ahead with the delete\n", stdout);
+	    print_list = 0;
+	}
+	fputs("\n> ", stdout);
+	if (fgets(buf, sizeof(buf), stdin) == NULL)
+	{
+	    fputs("*** EOF *** no action taken\n", stdout);
+	    break;
+	}
+	if (strncmp(buf, "go", 2) == 0)
+	{
+	    for (ptr = delete_list; ptr; ptr = ptr->next)
+	    {
+		elem = ptr->data;
+		if (elem->keep == 0)
+		{
+		    name = elem->file->name;
+		    if (unlink(name) == 0)
+			printf("%s deleted\n", name);
+		    else
+			g_warning("unable to delete '%s' - %m", name);
+		}
+	    }
+	    break;
+	}
+	if ((i = atoi(buf)) > 0)
+	{
+	    if ((elem = g_list_nth_data(delete_list, i - 1)))
+	    {
+		elem->keep = 1 - elem->keep;
+		print_list = 1;
+	    }
+	    else
+		printf("no file number %d\n", i);
+	}
+	else
+	    fputs("invalid input - please type a number or 'go'\n", stdout);
+    }
+    for (ptr = delete_list; ptr; ptr = ptr->next)
+	g_free(ptr->data);
+    g_list_free(delete_list);
+}
+
+/* Function used during phase three to list a single group of files
+ * known to have the same contents. */
+
+static void list_files(file_t *master, GList *list)
+{
+    int fs = (options & OPT_SAMELINE) ? ' ' : '\n';
+    file_t *fp;
+
+    if (!(options & OPT_OMITFIRST))
+    {
+	if (options & OPT_SHOWSIZE)
+	    printf("%s (%ld)%c", master->name, master->st_size, fs);
+	else
+	    printf("%s%c", master->name, fs);
+    }
+    while (list)
+    {
+	fp = list->data;
+	if (options & OPT_SHOWSIZE)
+	    printf("%s (%ld)%c", fp->name, fp->st_size, fs);
+	else
+	    printf("%s%c", fp->name, fs);
+	list = list->next;
+    }
+    fputc('\n', stdout);
+}
+
+/* Passes a set of duplicates to the group callback of a library caller,
+ * cancelling the run if it asks. */
+
+static void lib_group(file_t *master, GList *list)
+{
+    const char **names;
+    int	       n = 0;
+
+    names = g_malloc((g_list_length(list) + 1) * sizeof(char *));
+    names[n++] = master->name;
+    for (; list; list = list->next)
+	names[n++] = ((file_t *)list->data)->name;
+    if (lib_scan->group(names, n, master->st_size, lib_scan->udata))
+	lib_scan->cancel = 1;
+    g_free(names);
+}
+
+/* Returns true if all the files in a list came from the same root, in
+ * which case --cross-roots mode is not interested in them. */
+
+static int single_root(GList *list)
+{
+    int root;
+
+    if (list == NULL)
+	return TRUE;
+    root = ((file_t *)list->data)->root;
+    while ((list = list->next))
+	if (((file_t *)list->data)->root != root)
+	    return FALSE;
+    return TRUE;
+}
+
+/* Function used during phase three.  This function checks if the files
+ * in a group sharing the same message digest are really the same and
+ * calls the appropriate action function depending on what was specified
+ * on the command line.  Files grouped by fs-verity measurement are not
+ * compared as the kernel vouches for their contents.  It returns the
+ * number of sets of duplicates found; in --any mode it stops after the
+ * first. */
+
+static int check_group(const char *digest, file_list_t *file_list)
+{
+    GList	*search_list, *good_list, *bad_list, *ptr;
+    int		good_count;
+    int		found = 0;
+    int		trusted = is_verity(digest);
+    file_t	*master;
+
+    if (file_list->nfile > 1)
+    {
+	search_list = g_list_sort(file_list->files, sort_compare);
+	if (!(options & OPT_HARDLINKS))
+	{
+	    ptr = search_list;
+	    search_list = filter_links(ptr);
+	    g_list_free(ptr);
+	}
+	file_list->files = NULL;
+	while (search_list)
+	{
+	    if ((options & OPT_CROSS) && single_root(search_list))
+	    {
+		g_list_free(search_list);
+		break;
+	    }
+	    good_list = bad_list = NULL;
+	    good_count = 0;
+	    master = search_list->data;
+	    for (ptr = search_list->next; ptr; ptr = ptr->next)
+	    {
+		if (trusted || compare_files(master, ptr->data))
+		{
+		    good_list = g_list_append(good_list, ptr->data);
+		    good_count++;
+		}
+		else
+		    bad_list = g_list_append(bad_list, ptr->data);
+	    }
+	    if (good_count > 0 && (options & OPT_CROSS) &&
+		single_root(good_list) &&
+		((file_t *)good_list->data)->root == master->root)
+		good_count = 0;
+	    if (good_count > 0)
+	    {
+		if (options & OPT_LINK)
+		{
+		    for (ptr = good_list; ptr; ptr = ptr->next)
+			link_pair(master, ptr->data);
+		}
+		else if (options & OPT_DELETE)
+		    delete_files(digest, master, good_list);
+		else if (lib_scan && lib_scan->group)
+		    lib_group(master, good_list);
+		else
+		    list_files(master, good_list);
+		found++;
+	    }
+	    g_list_free(good_list);
+	    g_list_free(search_list);
+	    search_list = bad_list;
+	    if ((found && (options & OPT_ANY)) ||
+		(lib_scan && lib_scan->cancel))
+	    {
+		g_list_free(search_list);
+		break;
+	    }
+	}
+    }
+    return found;
+}
+
+/* Function called during phase three by g_hash_table_foreach for each
+ * group of files having the same message digest. */
+
+static void digest_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    if (!lib_step(DUPFIND_PHASE_CHECK))
+	check_group(key, value);
+}
+
+/* Function called during phase three with --hot-first by
+ * g_hash_table_foreach, checking the groups whose files are all in the
+ * page cache if udata points to 1 and the others if it points to 0. */
+
+static void hot_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    GList *ptr;
+    int	  hot = 1;
+
+    for (ptr = ((file_list_t *)value)->files; ptr; ptr = ptr->next)
+	if (!(((file_t *)ptr->data)->flags & FILE_HOT))
+	{
+	    hot = 0;
+	    break;
+	}
+    if (hot == *(int *)udata)
+	digest_foreach(key, value, NULL);
+}
+
+/* Phase three - checks each group of files having the same digest,
+ * with --hot-first those that can be compared without waiting for the
+ * disk first. */
+
+static void check_groups(GHashTable *hash)
+{
+    int pass;
+
+    if (!hot_first)
+	g_hash_table_foreach(hash, digest_foreach, NULL);
+    else
+	for (pass = 1; pass >= 0; pass--)
+	    g_hash_table_foreach(hash, hot_foreach, &pass);
+}
+
+/* Passes the files batched up by hash_bucket to hash_lanes and adds
+ * their digests. */
+
+static void add_lanes(file_t **batch, int n, tree_foreach_t *fdata)
+{
+    char hex[MD5_LANES][MD5_DIGEST * 2 + 1];
+    int	 i;
+
+    hash_lanes(batch, n, hex);
+    for (i = 0; i < n; i++)
+	if (hex[i][0])
+	{
+	    add_digest(fdata, hex[i], batch[i]);
+	    if (keep_digests)
+		batch[i]->digest = g_strdup(hex[i]);
+	}
+}
+
+/* Calculates the digests of a group of files of the same size.  With
+ * --digest=auto the fs-verity measurements are used if all the files
+ * have them, otherwise every file is hashed.  With the multi backend
+ * the files of a small size which need reading are hashed together,
+ * MD5_LANES at a time. */
+
+static void hash_bucket(file_list_t *file_list, tree_foreach_t *fdata)
+{
+    GList  *ptr;
+    file_t *fp;
+    file_t *batch[MD5_LANES];
+    char   **digests;
+    off_t  size = ((file_t *)file_list->files->data)->st_size;
+    int	   i, n = 0, lanes;
+
+    if (digest_mode == DIGEST_AUTO)
+    {
+	digests = g_new0(char *, file_list->nfile);
+	for (ptr = file_list->files; ptr; ptr = ptr->next, n++)
+	    if ((digests[n] = verity_digest(((file_t *)ptr->data)->name)) == NULL)
+		break;
+	if (ptr == NULL)
+	{
+	    for (ptr = file_list->files, i = 0; ptr; ptr = ptr->next, i++)
+	    {
+		fp = ptr->data;
+		add_digest(fdata, digests[i], fp);
+		g_free(fp->digest);
+		fp->digest = keep_digests ? digests[i] : NULL;
+		if (!keep_digests)
+		    g_free(digests[i]);
+	    }
+	    g_free(digests);
+	    lib_step(DUPFIND_PHASE_DIGEST);
+	    return;
+	}
+	for (i = 0; i < n; i++)
+	    g_free(digests[i]);
+	g_free(digests);
+    }
+    lanes = hash_func == hash_multi && file_list->nfile > 1 &&
+	size <= MULTI_MAX && digest_mode != DIGEST_VERITY &&
+	!(ckpt_file && size >= ckpt_every);
+    for (ptr = file_list->files, n = 0; ptr; ptr = ptr->next)
+    {
+	fp = ptr->data;
+	if (digest_mode == DIGEST_AUTO && is_verity(fp->digest))
+	{
+	    g_free(fp->digest);
+	    fp->digest = NULL;
+	}
+	if (lanes && fp->digest == NULL)
+	{
+	    if (lib_step(DUPFIND_PHASE_DIGEST))
+		break;
+	    batch[n++] = fp;
+	    if (n == MD5_LANES)
+	    {
+		add_lanes(batch, n, fdata);
+		n = 0;
+	    }
+	}
+	else if (file_foreach(fp->name, fp, fdata))
+	    break;
+    }
+    if (n && ptr == NULL)
+	add_lanes(batch, n, fdata);
+}
+
+/* Function used during phase two of --cross-roots mode in place of
+ * hashing every file.  Size groups whose files all come from the same
+ * root are dropped before any file is read. */
+
+static void hash_cross_roots(GTree *file_tree, tree_foreach_t *fdata)
+{
+    GHashTable	   *size_hash;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    file_list_t	   *file_list;
+
+    size_hash = build_size_hash(file_tree);
+    g_hash_table_iter_init(&iter, size_hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	file_list = value;
+	if (!single_root(file_list->files))
+	    hash_bucket(file_list, fdata);
+    }
+    free_lists(size_hash, 0);
+}
+
+/* Function used during phase two with --digest=auto or the multi
+ * backend in place of hashing every file in name order, so the digest
+ * to use can be chosen, or files batched, by size group. */
+
+static void hash_by_size(GTree *file_tree, tree_foreach_t *fdata)
+{
+    GHashTable	   *size_hash;
+    GHashTableIter iter;
+    gpointer	   key, value;
+
+    size_hash = build_size_hash(file_tree);
+    g_hash_table_iter_init(&iter, size_hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+	hash_bucket(value, fdata);
+    free_lists(size_hash, 0);
+}
+
+/* Returns whether the first len bytes of a file are all in the page
+ * cache. */
+
+static int is_cached(const char *name, off_t len)
+{
+    long    page = sysconf(_SC_PAGESIZE);
+    guint64 n = 0;
+    int	    fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+	return 0;
+    n = resident_pages(fd, len, NULL);
+    close(fd);
+    return n == (guint64)(len + page - 1) / page;
+}
+
+/* Works out how much --prefetch may read ahead, a sixteenth of the
+ * memory the kernel reports as available up to PREFETCH_MAX, and how
+ * many files ahead in proportion, so that prefetching backs off as
+ * memory runs short rather than pushing out pages it has just read. */
+
+static void prefetch_budget(prefetch_t *pf)
+{
+    FILE    *fp;
+    char    line[256];
+    guint64 avail = 0;
+
+    if ((fp = fopen("/proc/meminfo", "r")))
+    {
+	while (fgets(line, sizeof(line), fp))
+	    if (sscanf(line, "MemAvailable: %" G_GUINT64_FORMAT, &avail) == 1)
+		break;
+	fclose(fp);
+    }
+    pf->budget = avail ? MIN(avail * 1024 / 16, PREFETCH_MAX) : PREFETCH_MAX;
+    if (pf->budget < RING_SIZE)
+	pf->k = 0;
+    else
+	pf->k = MAX(1, prefetch_files * pf->budget / PREFETCH_MAX);
+    pf->checked = g_get_monotonic_time();
+}
+
+/* Asks the kernel to start reading the files after the one at cur into
+ * the page cache, up to pf->k files ahead and pf->budget bytes, the
+ * limits being worked out again each second.  Files whose digest is
+ * known are passed over as they will not be read. */
+
+static void prefetch_ahead(prefetch_t *pf, guint cur)
+{
+    file_t *fp;
+    off_t  len;
+    int	   fd;
+
+    if (g_get_monotonic_time() - pf->checked > G_USEC_PER_SEC)
+	prefetch_budget(pf);
+    if (pf->next <= cur)
+	pf->next = cur + 1;
+    for (; pf->next < pf->files->len && pf->next - cur <= pf->k; pf->next++)
+    {
+	fp = g_ptr_array_index(pf->files, pf->next);
+	if (fp->digest || (len = MIN(fp->st_size, PREFETCH_MAX)) == 0)
+	    continue;
+	if (pf->ahead && pf->ahead + len > pf->budget)
+	    break;
+	if ((fd = open(fp->name, O_RDONLY)) >= 0)
+	{
+	    posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+	    close(fd);
+	    pf->ahead += len;
+	    pf->issued++;
+	}
+    }
+}
+
+/* Hashes a list of files in order.  With --prefetch the files ahead of
+ * the one being hashed are read into the page cache in the background,
+ * and for each file reached which was prefetched whether it was found
+ * in the cache is counted, to show how well that is working.  With
+ * --throttle a pause after each file read keeps the average rate of
+ * reading down. */
+
+static void hash_files(GPtrArray *files, tree_foreach_t *fdata)
+{
+    prefetch_t pf;
+    file_t     *fp;
+    off_t      len;
+    guint64    bytes = 0;
+    gint64     start, due, now;
+    int	       prefetch = prefetch_files && cache_mode == CACHE_NORMAL;
+    guint      i;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.files = files;
+    if (prefetch)
+	prefetch_budget(&pf);
+    start = g_get_monotonic_time();
+    for (i = 0; i < files->len; i++)
+    {
+	fp = g_ptr_array_index(files, i);
+	if (prefetch)
+	{
+	    prefetch_ahead(&pf, i);
+	    if (i < pf.next && i > 0 && fp->digest == NULL &&
+		(len = MIN(fp->st_size, PREFETCH_MAX)) > 0)
+	    {
+		pf.reached++;
+		if (is_cached(fp->name, len))
+		    pf.hits++;
+		pf.ahead -= MIN(pf.ahead, (guint64)len);
+	    }
+	}
+	if (fp->digest == NULL)
+	    bytes += fp->st_size;
+	if (file_foreach(fp->name, fp, fdata))
+	    break;
+	if (throttle_rate)
+	{
+	    due = start +
+		(gint64)((double)bytes / throttle_rate * G_USEC_PER_SEC);
+	    if ((now = g_get_monotonic_time()) < due)
+		g_usleep(due - now);
+	}
+    }
+    if (pf.reached && !(options & OPT_QUIET))
+	g_message("prefetch: %lu files read ahead, %lu of %lu in the page"
+		  " cache when reached (%.0f%%)", pf.issued, pf.hits,
+		  pf.reached, 100.0 * pf.hits / pf.reached);
+}
+
+/* Function called by g_tree_foreach to put each file in an array. */
+
+static gboolean array_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    g_ptr_array_add(udata, value);
+    return FALSE;
+}
+
+/* Function used during phase two with --prefetch or --throttle in place
+ * of hashing every file straight from the file tree, so the files to
+ * come are known. */
+
+static void hash_in_order(GTree *file_tree, tree_foreach_t *fdata)
+{
+    GPtrArray *files = g_ptr_array_sized_new(g_tree_nnodes(file_tree));
+
+    g_tree_foreach(file_tree, array_foreach, files);
+    hash_files(files, fdata);
+    g_ptr_array_free(files, TRUE);
+}
+
+/* Function called by g_tree_foreach with --hot-first to mark the files
+ * wholly in the page cache with FILE_HOT, hashing them or any whose
+ * digest is already known straight away and putting the rest aside. */
+
+static gboolean hot_foreach_file(gpointer key, gpointer value, gpointer udata)
+{
+    hot_t  *hp = udata;
+    file_t *fp = value;
+
+    fp->flags &= ~FILE_HOT;
+    if (is_cached(fp->name, fp->st_size))
+	fp->flags |= FILE_HOT;
+    if (fp->digest || (fp->flags & FILE_HOT))
+	return file_foreach(key, value, hp->fdata);
+    g_ptr_array_add(hp->cold, fp);
+    return FALSE;
+}
+
+/* Comparison function used by --hot-first to sort the files not in the
+ * page cache by device and inode number, which on most filesystems
+ * keeps the reads roughly in disk order. */
+
+static gint cold_compare(gconstpointer a, gconstpointer b)
+{
+    const file_t *fa = *(file_t *const *)a;
+    const file_t *fb = *(file_t *const *)b;
+
+    if (fa->st_dev != fb->st_dev)
+	return fa->st_dev < fb->st_dev ? -1 : 1;
+    if (fa->st_ino != fb->st_ino)
+	return fa->st_ino < fb->st_ino ? -1 : 1;
+    return 0;
+}
+
+/* Function called by g_hash_table_foreach_remove with --hot-first once
+ * the files in the page cache have been hashed, checking straight away
+ * and removing from the table each group which no file still to be read
+ * could join, as none of those files has its size. */
+
+static gboolean hot_group_foreach(gpointer key, gpointer value,
+				  gpointer udata)
+{
+    file_list_t *file_list = value;
+
+    if (g_hash_table_lookup(udata,
+			    &((file_t *)file_list->files->data)->st_size))
+	return FALSE;
+    check_group(key, file_list);
+    g_list_free(file_list->files);
+    g_free(file_list);
+    g_free(key);
+    return TRUE;
+}
+
+/* Function used during phase two with --hot-first in place of hashing
+ * every file in name order.  The files wholly in the page cache are
+ * hashed first and the groups they complete checked and listed at once,
+ * giving early results at little cost, then the others are hashed in
+ * disk order, leaving their groups to phase three. */
+
+static void hash_hot_first(GTree *file_tree, tree_foreach_t *fdata)
+{
+    hot_t      hot;
+    GHashTable *cold_sizes;
+    guint      i;
+
+    hot.fdata = fdata;
+    hot.cold = g_ptr_array_new();
+    g_tree_foreach(file_tree, hot_foreach_file, &hot);
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "%u files not in the page cache",
+	      hot.cold->len);
+    cold_sizes = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < hot.cold->len; i++)
+	g_hash_table_insert(cold_sizes,
+			    &((file_t *)hot.cold->pdata[i])->st_size,
+			    hot.cold->pdata[i]);
+    g_hash_table_foreach_remove(fdata->hash, hot_group_foreach, cold_sizes);
+    g_hash_table_destroy(cold_sizes);
+    fflush(stdout);
+    g_ptr_array_sort(hot.cold, cold_compare);
+    hash_files(hot.cold, fdata);
+    g_ptr_array_free(hot.cold, TRUE);
+}
+
+/* Comparison function used by the --any mode to order size groups so
+ * the cheapest to confirm, small files with few candidates, come first. */
+
+static gint bucket_compare(gconstpointer a, gconstpointer b)
+{
+    const file_list_t *la = a;
+    const file_list_t *lb = b;
+    off_t sa = ((file_t *)la->files->data)->st_size;
+    off_t sb = ((file_t *)lb->files->data)->st_size;
+
+    if (sa != sb)
+	return sa < sb ? -1 : 1;
+    return la->nfile - lb->nfile;
+}
+
+/* Implements the --any mode, used instead of phases two and three.
+ * Size groups are worked through smallest first and the search stops
+ * as soon as one set of duplicates has been verified and listed.  A
+ * pair of same-sized files is compared directly as that is never more
+ * expensive than hashing both of them.  Returns 1 if a duplicate was
+ * found, 0 otherwise. */
+
+static int find_any(GTree *file_tree)
+{
+    GHashTable	   *size_hash;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    GList	   *buckets = NULL;
+    GList	   *ptr, *fptr;
+    file_list_t	   *file_list;
+    tree_foreach_t fdata;
+    int		   found = 0;
+
+    size_hash = build_size_hash(file_tree);
+    g_hash_table_iter_init(&iter, size_hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	file_list = value;
+	if (file_list->nfile > 1 &&
+	    !((options & OPT_CROSS) && single_root(file_list->files)))
+	    buckets = g_list_prepend(buckets, file_list);
+    }
+    buckets = g_list_sort(buckets, bucket_compare);
+
+    fdata.digest = g_checksum_new(G_CHECKSUM_MD5);
+    for (ptr = buckets; ptr && !found; ptr = ptr->next)
+    {
+	file_list = ptr->data;
+	if (file_list->nfile == 2)
+	{
+	    found = check_group(NULL, file_list);
+	    continue;
+	}
+	fdata.hash = g_hash_table_new(g_str_hash, g_str_equal);
+	for (fptr = file_list->files; fptr; fptr = fptr->next)
+	    file_foreach(((file_t *)fptr->data)->name, fptr->data, &fdata);
+	g_hash_table_iter_init(&iter, fdata.hash);
+	while (!found && g_hash_table_iter_next(&iter, &key, &value))
+	    found = check_group(key, value);
+	g_hash_table_destroy(fdata.hash);
+    }
+    g_checksum_free(fdata.digest);
+    g_list_free(buckets);
+    g_hash_table_destroy(size_hash);
+    return found;
+}
+
+/* Out-of-core mode.  Instead of building the file list in memory phase
+ * one writes a compact record for each file to a scratch directory.
+ * The records are collected in a buffer of half the memory limit which
+ * is sorted by size and written out as a run whenever it fills.  The
+ * file names are written to a separate file and the records refer to
+ * them by offset.  Phases two and three then merge the runs and work
+ * through them one size group at a time, so only the files of one size
+ * are in memory at once.  No more than OOC_FANIN runs, and as many as
+ * get OOC_RUN_BUF bytes of buffer out of a quarter of the memory limit,
+ * are merged at once, more being merged first in passes which each
+ * write one longer run.  Half of the memory limit is left for the files
+ * of a size group, allowing OOC_FILE_COST bytes for each.  A size group
+ * of more files than that is not held in memory but hashed a file at a
+ * time into a buffer of a quarter of the limit, written out as runs
+ * sorted by digest.  These are merged the same way in a quarter of the
+ * limit, and the files with each digest are checked in the last
+ * quarter.  Files with one digest which do not fit even so are checked
+ * in chunks, each along with the first of them, which is kept first in
+ * each set listed or acted on. */
+
+#define OOC_FANIN     128
+#define OOC_RUN_BUF   (64 * 1024)
+#define OOC_FILE_COST 256
+
+/* Removes the scratch directory and everything in it. */
+
+static void ooc_remove(void)
+{
+    DIR		  *dp;
+    struct dirent *dent;
+    char	  *fn;
+
+    if ((dp = opendir(ooc.dir)))
+    {
+	while ((dent = readdir(dp)))
+	{
+	    if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+		continue;
+	    fn = g_build_filename(ooc.dir, dent->d_name, NULL);
+	    unlink(fn);
+	    g_free(fn);
+	}
+	closedir(dp);
+    }
+    rmdir(ooc.dir);
+}
+
+/* Gives up after an error in out-of-core mode, removing the scratch
+ * directory first. */
+
+static void ooc_abort(void)
+{
+    ooc_remove();
+    exit(1);
+}
+
+/* Comparison function used by qsort to sort a run by size, then by
+ * device and inode so that the records of a file named more than once
+ * come together when the runs are merged. */
+
+static gint spill_compare(gconstpointer a, gconstpointer b)
+{
+    const spill_t *sa = a;
+    const spill_t *sb = b;
+
+    if (sa->size != sb->size)
+	return sa->size < sb->size ? -1 : 1;
+    if (sa->dev != sb->dev)
+	return sa->dev < sb->dev ? -1 : 1;
+    if (sa->ino != sb->ino)
+	return sa->ino < sb->ino ? -1 : 1;
+    return 0;
+}
+
+/* Comparison function used by qsort to sort a run of a large size
+ * group by digest, then with the most linked files first as check_group
+ * would take one of those as the master of a set. */
+
+static gint spill_digest_compare(gconstpointer a, gconstpointer b)
+{
+    const spill_digest_t *sa = a;
+    const spill_digest_t *sb = b;
+    gint		 res;
+
+    if ((res = strcmp(sa->digest, sb->digest)) == 0 &&
+	sa->rec.nlink != sb->rec.nlink)
+	res = sa->rec.nlink > sb->rec.nlink ? -1 : 1;
+    return res;
+}
+
+/* Sorts n records of recsize bytes and writes them out as a new run.
+ * Returns the name of the run. */
+
+static char *ooc_write(void *recs, gsize n, size_t recsize, GCompareFunc cmp)
+{
+    char *fn;
+    FILE *fp;
+
+    qsort(recs, n, recsize, cmp);
+    fn = g_strdup_printf("%s/run.%u", ooc.dir, ooc.nrun++);
+    if ((fp = fopen(fn, "w")) == NULL ||
+	fwrite(recs, recsize, n, fp) != n || fclose(fp) != 0)
+    {
+	g_critical("unable to write scratch file '%s' - %m", fn);
+	ooc_abort();
+    }
+    return fn;
+}
+
+/* Sorts the records buffered so far by size and writes them out as a
+ * new run. */
+
+static void ooc_write_run(void)
+{
+    if (ooc.nbuf == 0)
+	return;
+    ooc.runs = g_list_append(ooc.runs, ooc_write(ooc.buf, ooc.nbuf,
+						 sizeof(spill_t),
+						 spill_compare));
+    ooc.nbuf = 0;
+}
+
+/* Function called during phase one in out-of-core mode in place of
+ * add_file.  Files named more than once are only dropped when the runs
+ * are merged, by ooc_repeat. */
+
+static void spill_file(GTree *file_tree, const char *name, struct stat *stbuf)
+{
+    spill_t *rec;
+    size_t  len = strlen(name) + 1;
+
+    if (ooc.nbuf == ooc.maxbuf)
+	ooc_write_run();
+    rec = ooc.buf + ooc.nbuf++;
+    rec->size = stbuf->st_size;
+    rec->dev = stbuf->st_dev;
+    rec->ino = stbuf->st_ino;
+    rec->nlink = stbuf->st_nlink;
+    rec->root = cur_root;
+    rec->path_off = ooc.path_off;
+    if (fwrite(name, 1, len, ooc.paths) != len)
+    {
+	g_critical("unable to write scratch file '%s/paths' - %m", ooc.dir);
+	ooc_abort();
+    }
+    ooc.path_off += len;
+}
+
+/* Sets up the scratch directory and buffer for out-of-core mode. */
+
+static int ooc_start(const char *scratch)
+{
+    char *fn;
+
+    ooc.dir = g_build_filename(scratch, "dupfind.XXXXXX", NULL);
+    if (mkdtemp(ooc.dir) == NULL)
+    {
+	g_critical("unable to create scratch directory '%s' - %m", ooc.dir);
+	return 1;
+    }
+    fn = g_strconcat(ooc.dir, "/paths", NULL);
+    if ((ooc.paths = fopen(fn, "w+")) == NULL)
+    {
+	g_critical("unable to create scratch file '%s' - %m", fn);
+	ooc_remove();
+	return 1;
+    }
+    g_free(fn);
+    ooc.maxbuf = memory_limit / 2 / sizeof(spill_t);
+    ooc.buf = g_malloc(ooc.maxbuf * sizeof(spill_t));
+    ooc.nbuf = 0;
+    ooc.path_off = 0;
+    ooc.runs = NULL;
+    ooc.nrun = 0;
+    add_func = spill_file;
+    return 0;
+}
+
+/* Reads the name of a file back from the scratch directory. */
+
+static char *ooc_path(guint64 off)
+{
+    GString *str = g_string_new(NULL);
+    char    buf[256];
+    ssize_t nbytes;
+    char    *end;
+
+    while ((nbytes = pread(fileno(ooc.paths), buf, sizeof(buf), off)) > 0)
+    {
+	if ((end = memchr(buf, '\0', nbytes)))
+	{
+	    g_string_append_len(str, buf, end - buf);
+	    break;
+	}
+	g_string_append_len(str, buf, nbytes);
+	off += nbytes;
+    }
+    return g_string_free(str, FALSE);
+}
+
+/* Returns the number of runs merged at once with bufsize bytes of
+ * buffer. */
+
+static guint ooc_fanin(size_t bufsize)
+{
+    gsize n = bufsize / OOC_RUN_BUF;
+
+    return n < OOC_FANIN ? n : OOC_FANIN;
+}
+
+/* Opens the first n runs in a list to merge them, sharing bufsize bytes
+ * of buffer between them, and reads the first record of each. */
+
+static void ooc_merge_open(ooc_merge_t *m, GList *runs, guint n,
+			   size_t recsize, GCompareFunc cmp, size_t bufsize)
+{
+    guint i;
+
+    m->n = n;
+    m->recsize = recsize;
+    m->cmp = cmp;
+    m->fps = g_malloc0(n * sizeof(FILE *));
+    m->heads = g_malloc(n * recsize);
+    m->live = g_malloc(n * sizeof(int));
+    for (i = 0; i < n; i++, runs = runs->next)
+    {
+	if ((m->fps[i] = fopen(runs->data, "r")) == NULL)
+	{
+	    g_critical("unable to open scratch file '%s' - %m",
+		       (char *)runs->data);
+	    ooc_abort();
+	}
+	setvbuf(m->fps[i], NULL, _IOFBF, bufsize / n);
+	m->live[i] = fread(m->heads + i * recsize, recsize, 1, m->fps[i]) == 1;
+    }
+}
+
+/* Takes the smallest record from the runs being merged into rec.
+ * Returns FALSE when they are all used up.  The number of runs is at
+ * most OOC_FANIN so a linear scan for the smallest head is cheap
+ * compared with the I/O. */
+
+static int ooc_merge_next(ooc_merge_t *m, void *rec)
+{
+    guint i, j;
+
+    for (j = m->n, i = 0; i < m->n; i++)
+	if (m->live[i] &&
+	    (j == m->n || m->cmp(m->heads + i * m->recsize,
+				 m->heads + j * m->recsize) < 0))
+	    j = i;
+    if (j == m->n)
+	return FALSE;
+    memcpy(rec, m->heads + j * m->recsize, m->recsize);
+    m->live[j] = fread(m->heads + j * m->recsize, m->recsize, 1,
+		       m->fps[j]) == 1;
+    if (!m->live[j] && ferror(m->fps[j]))
+    {
+	g_critical("unable to read scratch file in '%s' - %m", ooc.dir);
+	ooc_abort();
+    }
+    return TRUE;
+}
+
+/* Closes the runs merged, which are the first in the list, and removes
+ * them from it and from the scratch directory.  Returns the rest of
+ * the list. */
+
+static GList *ooc_merge_close(ooc_merge_t *m, GList *runs)
+{
+    guint i;
+
+    for (i = 0; i < m->n; i++)
+    {
+	fclose(m->fps[i]);
+	unlink(runs->data);
+	g_free(runs->data);
+	runs = g_list_delete_link(runs, runs);
+    }
+    g_free(m->fps);
+    g_free(m->heads);
+    g_free(m->live);
+    return runs;
+}
+
+/* Merges runs of records OOC_FANIN at a time, or fewer with a small
+ * memory limit, into longer runs until there are few enough to merge
+ * in one go.  Returns the new list of runs. */
+
+static GList *ooc_reduce(GList *runs, size_t recsize, GCompareFunc cmp,
+			 size_t bufsize)
+{
+    guint	fanin = ooc_fanin(bufsize);
+    ooc_merge_t m;
+    void	*rec = g_malloc(recsize);
+    char	*fn;
+    FILE	*fp;
+
+    while (g_list_length(runs) > fanin)
+    {
+	ooc_merge_open(&m, runs, fanin, recsize, cmp, bufsize);
+	fn = g_strdup_printf("%s/run.%u", ooc.dir, ooc.nrun++);
+	if ((fp = fopen(fn, "w")) == NULL)
+	{
+	    g_critical("unable to write scratch file '%s' - %m", fn);
+	    ooc_abort();
+	}
+	while (ooc_merge_next(&m, rec))
+	    if (fwrite(rec, recsize, 1, fp) != 1)
+		break;
+	if (ferror(fp) || fclose(fp) != 0)
+	{
+	    g_critical("unable to write scratch file '%s' - %m", fn);
+	    ooc_abort();
+	}
+	runs = g_list_append(ooc_merge_close(&m, runs), fn);
+    }
+    g_free(rec);
+    return runs;
+}
+
+/* Fills in a file from its record, reading its name back. */
+
+static void ooc_file(file_t *fp, const spill_t *rec)
+{
+    fp->name = ooc_path(rec->path_off);
+    fp->st_size = rec->size;
+    fp->st_nlink = rec->nlink;
+    fp->st_dev = rec->dev;
+    fp->st_ino = rec->ino;
+    fp->root = rec->root;
+}
+
+/* Returns whether a record merged by size names a file already named
+ * by an earlier one, as when a root is given twice or inside another.
+ * Such records have the same inode and follow one another in the merge,
+ * and their names are compared as hard links also share an inode. */
+
+static int ooc_repeat(ooc_seen_t *sn, const spill_t *rec)
+{
+    char  *name;
+    guint i;
+
+    if (!sn->have || rec->size != sn->last.size ||
+	rec->dev != sn->last.dev || rec->ino != sn->last.ino)
+    {
+	g_ptr_array_foreach(sn->names, (GFunc)g_free, NULL);
+	g_ptr_array_set_size(sn->names, 0);
+	sn->last = *rec;
+	sn->have = TRUE;
+	return FALSE;
+    }
+    if (sn->names->len == 0)
+	g_ptr_array_add(sn->names, ooc_path(sn->last.path_off));
+    name = ooc_path(rec->path_off);
+    for (i = 0; i < sn->names->len; i++)
+	if (!strcmp(name, g_ptr_array_index(sn->names, i)))
+	{
+	    g_free(name);
+	    return TRUE;
+	}
+    g_ptr_array_add(sn->names, name);
+    return FALSE;
+}
+
+/* Checks a set of files whose records are in recs, by hashing them or,
+ * if digest is not NULL, as files which all have that digest, the first
+ * being kept as the master of the set.  Returns the number of sets of
+ * duplicates found. */
+
+static int ooc_check(spill_t *recs, guint nrec, const char *digest,
+		     tree_foreach_t *fdata)
+{
+    file_t	   *files;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    file_list_t	   *file_list, group;
+    guint	   i;
+    int		   found = 0;
+
+    files = g_malloc0(nrec * sizeof(file_t));
+    if (digest)
+    {
+	group.nfile = nrec;
+	group.files = NULL;
+	for (i = nrec; i-- > 0;)
+	{
+	    ooc_file(files + i, recs + i);
+	    group.files = g_list_prepend(group.files, files + i);
+	}
+	files[0].flags = FILE_MASTER;
+	found = check_group(digest, &group);
+	g_list_free(group.files);
+    }
+    else
+    {
+	fdata->hash = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < nrec; i++)
+	{
+	    ooc_file(files + i, recs + i);
+	    file_foreach(files[i].name, files + i, fdata);
+	}
+	g_hash_table_iter_init(&iter, fdata->hash);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+	    file_list = value;
+	    if (!(found && (options & OPT_ANY)))
+		found += check_group(key, file_list);
+	    g_list_free(file_list->files);
+	    g_free(file_list);
+	    g_free(key);
+	}
+	g_hash_table_destroy(fdata->hash);
+    }
+    for (i = 0; i < nrec; i++)
+    {
+	g_free(files[i].name);
+	g_free(files[i].digest);
+    }
+    g_free(files);
+    return found;
+}
+
+/* Hashes and checks one size group from the merged runs which fits in
+ * memory.  Returns the number of sets of duplicates found. */
+
+static int ooc_bucket(spill_t *recs, guint nrec, tree_foreach_t *fdata)
+{
+    guint i;
+
+    if (nrec < 2)
+	return 0;
+    if (options & OPT_CROSS)
+    {
+	for (i = 1; i < nrec && recs[i].root == recs[0].root; i++)
+	    ;
+	if (i == nrec)
+	    return 0;
+    }
+    return ooc_check(recs, nrec, NULL, fdata);
+}
+
+/* Hashes one file of a size group too large for memory into a record
+ * for the group's runs.  Returns FALSE if the file could not be read or
+ * is a known file. */
+
+static int ooc_hash(const spill_t *rec, spill_digest_t *out,
+		    tree_foreach_t *fdata)
+{
+    file_t	   file;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    int		   ok = FALSE;
+
+    memset(&file, 0, sizeof(file));
+    ooc_file(&file, rec);
+    fdata->hash = g_hash_table_new(g_str_hash, g_str_equal);
+    file_foreach(file.name, &file, fdata);
+    g_hash_table_iter_init(&iter, fdata->hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	out->rec = *rec;
+	g_strlcpy(out->digest, key, sizeof(out->digest));
+	ok = TRUE;
+	g_list_free(((file_list_t *)value)->files);
+	g_free(value);
+	g_free(key);
+    }
+    g_hash_table_destroy(fdata->hash);
+    g_free(file.name);
+    g_free(file.digest);
+    return ok;
+}
+
+/* State of a size group too large for memory: a buffer of hashed files
+ * and the runs written from it. */
+
+typedef struct
+{
+    spill_digest_t *buf;
+    gsize	   nbuf;
+    gsize	   maxbuf;
+    GList	   *runs;
+} ooc_large_t;
+
+/* Adds a file of a size group too large for memory, writing a run of
+ * the files hashed so far whenever the buffer fills. */
+
+static void ooc_large_add(ooc_large_t *lg, const spill_t *rec,
+			  tree_foreach_t *fdata)
+{
+    if (lg->nbuf == lg->maxbuf)
+    {
+	lg->runs = g_list_append(lg->runs,
+				 ooc_write(lg->buf, lg->nbuf,
+					   sizeof(spill_digest_t),
+					   spill_digest_compare));
+	lg->nbuf = 0;
+    }
+    if (ooc_hash(rec, lg->buf + lg->nbuf, fdata))
+	lg->nbuf++;
+}
+
+/* Checks a size group too large for memory once all its files have been
+ * hashed, merging its runs by digest and checking the files with each
+ * digest in turn, in chunks if there are too many of them.  Returns the
+ * number of sets of duplicates found. */
+
+static int ooc_large_finish(ooc_large_t *lg, tree_foreach_t *fdata)
+{
+    ooc_merge_t	   m;
+    spill_digest_t rec, master;
+    spill_t	   *recs;
+    gsize	   maxchunk = MAX(memory_limit / 4 / OOC_FILE_COST, 2);
+    gsize	   nrec = 0;
+    int		   more, found = 0;
+
+    if (lg->nbuf)
+	lg->runs = g_list_append(lg->runs,
+				 ooc_write(lg->buf, lg->nbuf,
+					   sizeof(spill_digest_t),
+					   spill_digest_compare));
+    lg->nbuf = 0;
+    g_free(lg->buf);
+    lg->buf = NULL;
+    lg->runs = ooc_reduce(lg->runs, sizeof(spill_digest_t),
+			  spill_digest_compare, memory_limit / 4);
+    ooc_merge_open(&m, lg->runs, g_list_length(lg->runs),
+		   sizeof(spill_digest_t), spill_digest_compare,
+		   memory_limit / 4);
+    recs = g_malloc(maxchunk * sizeof(spill_t));
+    do
+    {
+	more = ooc_merge_next(&m, &rec);
+	if (nrec && (!more || strcmp(rec.digest, master.digest)))
+	{
+	    if (nrec > 1 && !(found && (options & OPT_ANY)))
+		found += ooc_check(recs, nrec, master.digest, fdata);
+	    nrec = 0;
+	}
+	if (!more)
+	    break;
+	if (nrec == 0)
+	    master = rec;
+	else if (nrec == maxchunk)
+	{
+	    if (!(found && (options & OPT_ANY)))
+		found += ooc_check(recs, nrec, master.digest, fdata);
+	    nrec = 1;
+	}
+	recs[nrec++] = rec.rec;
+    }
+    while (more);
+    lg->runs = ooc_merge_close(&m, lg->runs);
+    g_free(recs);
+    return found;
+}
+
+/* Phases two and three of out-of-core mode.  The runs are merged by
+ * size, each group of files of the same size being passed to
+ * ooc_bucket or, if there are too many files in it to hold, to
+ * ooc_large_add one by one.  Returns the number of sets of duplicates
+ * found, after which the scratch directory is removed. */
+
+static int ooc_finish(void)
+{
+    ooc_merge_t	   m;
+    ooc_large_t	   large;
+    ooc_seen_t	   seen;
+    spill_t	   rec, first;
+    GArray	   *bucket;
+    gsize	   maxgroup, nfile = 0;
+    guint	   i;
+    int		   more, found = 0;
+    tree_foreach_t fdata;
+
+    ooc_write_run();
+    g_free(ooc.buf);
+    fflush(ooc.paths);
+    ooc.runs = ooc_reduce(ooc.runs, sizeof(spill_t), spill_compare,
+			  memory_limit / 4);
+    ooc_merge_open(&m, ooc.runs, g_list_length(ooc.runs), sizeof(spill_t),
+		   spill_compare, memory_limit / 4);
+
+    memset(&large, 0, sizeof(large));
+    memset(&seen, 0, sizeof(seen));
+    seen.names = g_ptr_array_new();
+    maxgroup = memory_limit / 2 / OOC_FILE_COST;
+    fdata.digest = g_checksum_new(G_CHECKSUM_MD5);
+    bucket = g_array_new(FALSE, FALSE, sizeof(spill_t));
+    for (;;)
+    {
+	more = ooc_merge_next(&m, &rec);
+	if (nfile && (!more || rec.size != g_array_index(bucket, spill_t,
+							  0).size))
+	{
+	    if (large.buf)
+		found += ooc_large_finish(&large, &fdata);
+	    else
+		found += ooc_bucket((spill_t *)bucket->data, bucket->len,
+				    &fdata);
+	    g_array_set_size(bucket, 0);
+	    nfile = 0;
+	    if (!more || (found && (options & OPT_ANY)))
+		break;
+	}
+	if (!more)
+	    break;
+	if (ooc_repeat(&seen, &rec))
+	    continue;
+
+	/* The first record of a group is always kept as the size of the
+	 * group is taken from it. */
+
+	if (large.buf)
+	    ooc_large_add(&large, &rec, &fdata);
+	else
+	{
+	    g_array_append_val(bucket, rec);
+	    if (bucket->len > maxgroup)
+	    {
+		if (options & OPT_VERBOSE)
+		    g_log(NULL, G_LOG_LEVEL_INFO, "checking files of size %ld"
+			  " by digest runs", (long)rec.size);
+		large.maxbuf = memory_limit / 4 / sizeof(spill_digest_t);
+		large.buf = g_malloc(large.maxbuf * sizeof(spill_digest_t));
+		for (i = 0; i < bucket->len; i++)
+		    ooc_large_add(&large, &g_array_index(bucket, spill_t, i),
+				  &fdata);
+		first = g_array_index(bucket, spill_t, 0);
+		g_array_free(bucket, TRUE);
+		bucket = g_array_new(FALSE, FALSE, sizeof(spill_t));
+		g_array_append_val(bucket, first);
+	    }
+	}
+	nfile++;
+    }
+    g_array_free(bucket, TRUE);
+    g_free(large.buf);
+    g_checksum_free(fdata.digest);
+    g_ptr_array_foreach(seen.names, (GFunc)g_free, NULL);
+    g_ptr_array_free(seen.names, TRUE);
+
+    ooc.runs = ooc_merge_close(&m, ooc.runs);
+    fclose(ooc.paths);
+    ooc_remove();
+    return found;
+}
+
+/* Copies the names on stdin to a temporary file so --two-pass mode can
+ * read them twice. */
+
+static FILE *copy_stdin(void)
+{
+    FILE   *fp;
+    char   buf[CHUNK_SIZE];
+    size_t nbytes;
+
+    if ((fp = tmpfile()) == NULL)
+    {
+	g_critical("unable to create temporary file - %m");
+	return NULL;
+    }
+    while ((nbytes = fread(buf, 1, sizeof(buf), stdin)) > 0)
+	fwrite(buf, 1, nbytes, fp);
+    if (fflush(fp) != 0)
+    {
+	g_critical("unable to write temporary file - %m");
+	fclose(fp);
+	return NULL;
+    }
+    rewind(fp);
+    return fp;
+}
+
+/* Parses a size given on the command line with an optional K, M or G
+ * suffix.  Returns 0 if the size is not valid. */
+
+static gsize parse_size(const char *str)
+{
+    char    *end;
+    guint64 size = g_ascii_strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+    case 'G': case 'g':
+	size <<= 10;
+	/* fall through */
+    case 'M': case 'm':
+	size <<= 10;
+	/* fall through */
+    case 'K': case 'k':
+	size <<= 10;
+	end++;
+    }
+    return *end ? 0 : size;
+}
+
+/* Function used in reference mode to find a reference file with the
+ * same contents as the given file.  A file from a saved reference set
+ * cannot be compared so its digest is trusted, which is why a saved set
+ * cannot be used with --delete.  A reference file which is a hard link
+ * to the given file only counts with --hardlinks. */
+
+static file_t *match_reference(GList *refs, file_t *fp)
+{
+    file_t *ref;
+
+    for (; refs; refs = refs->next)
+    {
+	ref = refs->data;
+	if (ref->flags & FILE_SAVED)
+	    return ref;
+	if (ref->st_dev == fp->st_dev && ref->st_ino == fp->st_ino)
+	{
+	    if (options & OPT_HARDLINKS)
+		return ref;
+        }
+	else if (compare_files(ref, fp))
+	    return ref;
+    }
+    return NULL;
+}
+
+/* Function called during phase three of reference mode by
+ * g_hash_table_foreach for each group of files having the same message
+ * digest.  Only files outside the reference roots are listed or acted
+ * upon, each set being listed after the reference file it duplicates. */
+
+static void reference_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    file_list_t *file_list = value;
+    GList	*refs = NULL;
+    GList	*others = NULL;
+    GList	*ptr, *good_list;
+    GHashTable	*matches;
+    file_t	*fp, *ref;
+
+    if (file_list->nfile < 2)
+	return;
+    for (ptr = file_list->files; ptr; ptr = ptr->next)
+    {
+	fp = ptr->data;
+	if (fp->flags & FILE_REFERENCE)
+	    refs = g_list_append(refs, fp);
+        else
+	    others = g_list_append(others, fp);
+    }
+    if (refs && others)
+    {
+	refs = g_list_sort(refs, sort_compare);
+	others = g_list_sort(others, sort_compare);
+	if (!(options & OPT_HARDLINKS))
+	    others = filter_links(others);
+	matches = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (ptr = others; ptr; ptr = ptr->next)
+	{
+	    if ((ref = match_reference(refs, ptr->data)) == NULL)
+		continue;
+	    if (options & OPT_LINK)
+	    {
+		if (!(ref->flags & FILE_SAVED))
+		    link_pair(ref, ptr->data);
+	    }
+	    else
+	    {
+		good_list = g_hash_table_lookup(matches, ref);
+		good_list = g_list_append(good_list, ptr->data);
+		g_hash_table_insert(matches, ref, good_list);
+	    }
+        }
+	for (ptr = refs; ptr; ptr = ptr->next)
+	{
+	    if ((good_list = g_hash_table_lookup(matches, ptr->data)))
+	    {
+		if (options & OPT_DELETE)
+		    delete_files(key, ptr->data, good_list);
+		else
+		    list_files(ptr->data, good_list);
+		g_list_free(good_list);
+	    }
+        }
+	g_hash_table_destroy(matches);
+    }
+    g_list_free(others);
+    g_list_free(refs);
+}
+
+/* Implements phases two and three when reference roots are in use.
+ * Only files whose size occurs both inside and outside the reference
+ * roots are hashed, unless a reference set is to be saved in which case
+ * all the reference files are hashed. */
+
+static void find_in_reference(GTree *file_tree)
+{
+    GHashTable	   *size_hash;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    file_list_t	   *file_list;
+    GList	   *ptr;
+    file_t	   *fp;
+    int		   nref, nother;
+    tree_foreach_t fdata;
+
+    size_hash = build_size_hash(file_tree);
+    fdata.hash = g_hash_table_new(g_str_hash, g_str_equal);
+    fdata.digest = g_checksum_new(G_CHECKSUM_MD5);
+    g_hash_table_iter_init(&iter, size_hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	file_list = value;
+	nref = nother = 0;
+	for (ptr = file_list->files; ptr; ptr = ptr->next)
+	{
+	    fp = ptr->data;
+	    if (fp->flags & FILE_REFERENCE)
+		nref++;
+	    else
+		nother++;
+        }
+	for (ptr = file_list->files; ptr; ptr = ptr->next)
+	{
+	    fp = ptr->data;
+	    if ((nref && nother) ||
+		(ref_save_file && (fp->flags & FILE_REFERENCE)))
+		file_foreach(fp->name, fp, &fdata);
+        }
+    }
+    g_checksum_free(fdata.digest);
+    g_hash_table_foreach(fdata.hash, reference_foreach, NULL);
+}
+
+/* Function used in --missing-from mode to list a file which has no copy
+ * in the roots it was checked against. */
+
+static void list_missing(file_t *fp)
+{
+    if (options & OPT_SHOWSIZE)
+	printf("%s (%ld)\n", fp->name, (long)fp->st_size);
+    else
+	printf("%s\n", fp->name);
+}
+
+/* Function called during phase three of --missing-from mode by
+ * g_hash_table_foreach for each group of files having the same message
+ * digest.  Each file outside the reference roots is listed unless it
+ * matches one of the reference files. */
+
+static void missing_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    file_list_t *file_list = value;
+    GList	*refs = NULL;
+    GList	*ptr;
+    file_t	*fp;
+
+    for (ptr = file_list->files; ptr; ptr = ptr->next)
+    {
+	fp = ptr->data;
+	if (fp->flags & FILE_REFERENCE)
+	    refs = g_list_append(refs, fp);
+    }
+    for (ptr = file_list->files; ptr; ptr = ptr->next)
+    {
+	fp = ptr->data;
+	if (!(fp->flags & FILE_REFERENCE) && !match_reference(refs, fp))
+	    list_missing(fp);
+    }
+    g_list_free(refs);
+}
+
+/* Returns true if a file is a hard link to one of the reference files
+ * in a list. */
+
+static int linked_to_ref(GList *files, const file_t *fp)
+{
+    const file_t *ref;
+
+    for (; files; files = files->next)
+    {
+	ref = files->data;
+	if ((ref->flags & FILE_REFERENCE) && ref->st_dev == fp->st_dev &&
+	    ref->st_ino == fp->st_ino)
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+/* Implements phases two and three for the --missing-from mode, listing
+ * the files which have no copy in the reference roots.  A file whose
+ * size does not occur among the reference files is listed straight
+ * away; only sizes occurring on both sides are hashed and verified,
+ * plus the reference files if a reference set is to be saved.  A file
+ * which is a hard link to a reference file is present, with or without
+ * --hardlinks.  Returns the number of files outside the reference roots
+ * which could not be read, and so were neither listed nor verified. */
+
+static int find_missing(GTree *file_tree)
+{
+    GHashTable	   *size_hash;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    file_list_t	   *file_list;
+    GList	   *ptr;
+    file_t	   *fp;
+    int		   nref, status = 0;
+    gulong	   errors;
+    tree_foreach_t fdata;
+
+    size_hash = build_size_hash(file_tree);
+    fdata.hash = g_hash_table_new(g_str_hash, g_str_equal);
+    fdata.digest = g_checksum_new(G_CHECKSUM_MD5);
+    g_hash_table_iter_init(&iter, size_hash);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	file_list = value;
+	nref = 0;
+	for (ptr = file_list->files; ptr; ptr = ptr->next)
+	    if (((file_t *)ptr->data)->flags & FILE_REFERENCE)
+		nref++;
+	for (ptr = file_list->files; ptr; ptr = ptr->next)
+	{
+	    fp = ptr->data;
+	    if (nref == 0)
+		list_missing(fp);
+	    else if (!(fp->flags & FILE_REFERENCE) &&
+		     linked_to_ref(file_list->files, fp))
+		continue;
+	    else if (nref < file_list->nfile ||
+		     (ref_save_file && (fp->flags & FILE_REFERENCE)))
+	    {
+		errors = hash_errors;
+		file_foreach(fp->name, fp, &fdata);
+		if (hash_errors != errors && !(fp->flags & FILE_REFERENCE))
+		    status++;
+	    }
+	}
+    }
+    g_checksum_free(fdata.digest);
+    g_hash_table_foreach(fdata.hash, missing_foreach, NULL);
+    return status;
+}
+
+/* Loads a reference set saved by a previous run with --save-reference.
+ * The files are added to the list as reference files with their saved
+ * size and digest.  Returns 0 on success. */
+
+static int load_reference(GTree *file_tree, const char *fn)
+{
+    FILE   *fp;
+    char   *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    char   **fields;
+    file_t *file;
+    int	   status = 0;
+
+    if ((fp = fopen(fn, "r")) == NULL)
+    {
+	g_warning("unable to open reference set '%s' - %m", fn);
+	return 1;
+    }
+    if (getline(&line, &size, fp) <= 0 ||
+	strcmp(line, REFSET_MAGIC "\n") != 0)
+    {
+	g_warning("'%s' is not a dupfind reference set", fn);
+	status = 1;
+    }
+    while (status == 0 && (len = getline(&line, &size, fp)) > 0)
+    {
+	if (line[len-1] == '\n')
+	    line[len-1] = '\0';
+	fields = g_strsplit(line, "\t", 3);
+	if (g_strv_length(fields) == 3)
+	{
+	    file = g_malloc0(sizeof(file_t));
+	    file->name = g_strcompress(fields[2]);
+	    file->st_size = g_ascii_strtoll(fields[0], NULL, 10);
+	    file->digest = g_strdup(fields[1]);
+	    file->flags = FILE_REFERENCE|FILE_SAVED;
+	    if (g_tree_lookup(file_tree, file->name))
+	    {
+		g_free(file->name);
+		g_free(file->digest);
+		g_free(file);
+	    }
+	    else
+		g_tree_insert(file_tree, file->name, file);
+        }
+        else
+	{
+	    g_warning("reference set '%s' is damaged", fn);
+	    status = 1;
+        }
+	g_strfreev(fields);
+    }
+    g_free(line);
+    fclose(fp);
+    return status;
+}
+
+/* Function used by phase one to scan each of the roots, those given
+ * with --reference or --missing-from first, then the reference sets
+ * saved to the files in ref_files, then the roots given as arguments
+ * and finally the names read from name_fp if not NULL. */
+
+static int walk_roots(GTree *file_tree, GList *ref_roots, GList *ref_files,
+		      char **names, FILE *name_fp)
+{
+    int status = 0;
+
+    cur_root = 0;
+    root_flags = FILE_REFERENCE;
+    for (; ref_roots; ref_roots = ref_roots->next, cur_root++)
+	status += do_fsobj(file_tree, ref_roots->data);
+    for (; ref_files; ref_files = ref_files->next)
+	status += load_reference(file_tree, ref_files->data);
+    root_flags = 0;
+    for (; *names; names++, cur_root++)
+	status += do_fsobj(file_tree, *names);
+    if (name_fp)
+	status += do_stdin(file_tree, name_fp);
+    return status;
+}
+
+/* Function called by g_tree_foreach to write each reference file whose
+ * digest is known, other than from the package checksums, to the saved
+ * reference set. */
+
+static gboolean refset_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    file_t *fp = value;
+    char   *esc;
+
+    if ((fp->flags & (FILE_REFERENCE|FILE_PKG)) == FILE_REFERENCE &&
+	fp->digest)
+    {
+	esc = g_strescape(fp->name, NULL);
+	fprintf(udata, "%ld\t%s\t%s\n", (long)fp->st_size, fp->digest, esc);
+	g_free(esc);
+    }
+    return FALSE;
+}
+
+/* Saves the sizes and digests of the reference files so a later run can
+ * load them with --load-reference instead of reading the files again.
+ * Returns 0 on success. */
+
+static int save_reference(GTree *file_tree)
+{
+    FILE *fp;
+
+    if ((fp = fopen(ref_save_file, "w")) == NULL)
+    {
+	g_warning("unable to create reference set '%s' - %m", ref_save_file);
+	return 1;
+    }
+    fputs(REFSET_MAGIC "\n", fp);
+    g_tree_foreach(file_tree, refset_foreach, fp);
+    if (fclose(fp) != 0)
+    {
+	g_warning("unable to write reference set '%s' - %m", ref_save_file);
+	return 1;
+    }
+    return 0;
+}
+
+/* Adds a file or directory loaded from the scan cache to the child list
+ * of its parent directory, if that is also in the cache. */
+
+static void cache_link_parent(cache_t *cache, char *name)
+{
+    char	*ptr, *parent;
+    cache_dir_t *dir;
+
+    if ((ptr = strrchr(name, '/')) && ptr > name)
+    {
+	parent = g_strndup(name, ptr - name);
+	if ((dir = g_hash_table_lookup(cache->dirs, parent)))
+	    dir->children = g_list_prepend(dir->children, name);
+	g_free(parent);
+    }
+}
+
+/* Loads the scan cache written by a previous run.  Returns NULL, so a
+ * full scan is done, if there is no cache, it is unreadable or damaged,
+ * or it was built with different options affecting which files are
+ * seen. */
+
+static cache_t *load_cache(const char *fn)
+{
+    FILE	  *fp;
+    char	  *line = NULL;
+    size_t	  size = 0;
+    ssize_t	  len;
+    unsigned long cache_opts;
+    cache_t	  *cache;
+    cache_dir_t	  *dir;
+    file_t	  *file;
+    char	  **fields;
+    int		  ok;
+    GHashTableIter iter;
+    gpointer	  key, value;
+
+    if ((fp = fopen(fn, "r")) == NULL)
+    {
+	if (errno != ENOENT)
+	    g_warning("unable to open scan cache '%s' - %m", fn);
+	return NULL;
+    }
+    cache = g_malloc(sizeof(cache_t));
+    if (getline(&line, &size, fp) <= 0 ||
+	strncmp(line, CACHE_MAGIC " ", sizeof(CACHE_MAGIC)) != 0 ||
+	sscanf(line + sizeof(CACHE_MAGIC), "%lx %ld.%ld", &cache_opts,
+	       &cache->built.tv_sec, &cache->built.tv_nsec) != 3)
+    {
+	g_warning("'%s' is not a dupfind scan cache - ignored", fn);
+	g_free(cache);
+	g_free(line);
+	fclose(fp);
+	return NULL;
+    }
+    if (cache_opts != (options & CACHE_OPTIONS))
+    {
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO,
+		  "scan cache built with different options - full scan");
+	g_free(cache);
+	g_free(line);
+	fclose(fp);
+	return NULL;
+    }
+    cache->dirs = g_hash_table_new(g_str_hash, g_str_equal);
+    cache->files = g_hash_table_new(g_str_hash, g_str_equal);
+    ok = 1;
+    while (ok && (len = getline(&line, &size, fp)) > 0)
+    {
+	if (line[len-1] == '\n')
+	    line[len-1] = '\0';
+	fields = g_strsplit(line, "\t", 10);
+	if (fields[0][0] == 'D' && g_strv_length(fields) == 4)
+	{
+	    dir = g_malloc(sizeof(cache_dir_t));
+	    dir->name = g_strcompress(fields[3]);
+	    dir->children = NULL;
+	    ok = parse_time(fields[1], &dir->st_mtim) &&
+		parse_time(fields[2], &dir->st_ctim);
+	    g_hash_table_insert(cache->dirs, dir->name, dir);
+	}
+	else if (fields[0][0] == 'F' && g_strv_length(fields) == 10)
+	{
+	    file = g_malloc(sizeof(file_t));
+	    file->name = g_strcompress(fields[9]);
+	    file->st_size = g_ascii_strtoll(fields[1], NULL, 10);
+	    file->st_nlink = g_ascii_strtoull(fields[2], NULL, 10);
+	    file->st_mode = g_ascii_strtoull(fields[3], NULL, 8);
+	    file->st_dev = g_ascii_strtoull(fields[4], NULL, 10);
+	    file->st_ino = g_ascii_strtoull(fields[5], NULL, 10);
+	    file->digest = strcmp(fields[8], "-") ? g_strdup(fields[8]) : NULL;
+	    file->flags = 0;
+	    ok = parse_time(fields[6], &file->st_mtim) &&
+		parse_time(fields[7], &file->st_ctim);
+	    g_hash_table_insert(cache->files, file->name, file);
+	}
+	else
+	    ok = 0;
+	g_strfreev(fields);
+    }
+    g_free(line);
+    fclose(fp);
+    if (!ok)
+    {
+	g_warning("scan cache '%s' is damaged - ignored", fn);
+	return NULL;
+    }
+    g_hash_table_iter_init(&iter, cache->dirs);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+	cache_link_parent(cache, key);
+    g_hash_table_iter_init(&iter, cache->files);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+	cache_link_parent(cache, key);
+    return cache;
+}
+
+/* Function called by g_tree_foreach to write each file to the new scan
+ * cache. */
+
+static gboolean cache_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    file_t *fp = value;
+    char   *esc = g_strescape(fp->name, NULL);
+
+    fprintf(udata, "F\t%ld\t%lu\t%o\t%lu\t%lu\t%ld.%09ld\t%ld.%09ld\t%s\t%s\n",
+	    (long)fp->st_size, (unsigned long)fp->st_nlink, fp->st_mode,
+	    (unsigned long)fp->st_dev, (unsigned long)fp->st_ino,
+	    fp->st_mtim.tv_sec, fp->st_mtim.tv_nsec,
+	    fp->st_ctim.tv_sec, fp->st_ctim.tv_nsec,
+	    fp->digest && !(fp->flags & FILE_PKG) ? fp->digest : "-", esc);
+    g_free(esc);
+    return FALSE;
+}
+
+/* Writes the new scan cache, via a temporary file so an interrupted
+ * run leaves the old cache in place.  Returns 0 on success. */
+
+static int save_cache(GTree *file_tree, const struct timespec *built)
+{
+    char	*tmp;
+    FILE	*fp;
+    GList	*ptr;
+    cache_dir_t *dir;
+    char	*esc;
+    int		status = 1;
+
+    tmp = g_strconcat(cache_file, ".tmp", NULL);
+    if ((fp = fopen(tmp, "w")))
+    {
+	fprintf(fp, CACHE_MAGIC " %lx %ld.%09ld\n", options & CACHE_OPTIONS,
+		built->tv_sec, built->tv_nsec);
+	for (ptr = cache_dirs; ptr; ptr = ptr->next)
+	{
+	    dir = ptr->data;
+	    esc = g_strescape(dir->name, NULL);
+	    fprintf(fp, "D\t%ld.%09ld\t%ld.%09ld\t%s\n",
+		    dir->st_mtim.tv_sec, dir->st_mtim.tv_nsec,
+		    dir->st_ctim.tv_sec, dir->st_ctim.tv_nsec, esc);
+	    g_free(esc);
+	}
+	g_tree_foreach(file_tree, cache_foreach, fp);
+	if (fclose(fp) == 0 && rename(tmp, cache_file) == 0)
+	    status = 0;
+	else
+	{
+	    g_warning("unable to write scan cache '%s' - %m", cache_file);
+	    unlink(tmp);
+	}
+    }
+    else
+	g_warning("unable to create scan cache '%s' - %m", tmp);
+    g_free(tmp);
+    return status;
+}
+
+/* Signature export and merge.  With --export each file in the list is
+ * hashed, giving a digest of its first PARTIAL_SIZE bytes as well as of
+ * the whole file, and a record of the size, both digests and the name
+ * is written to a gzip compressed file, sorted by size and digests.
+ * With --merge any number of these files, eg. from different machines,
+ * are merged and the sets of files with the same size and digests which
+ * come from more than one file are listed.  As the files themselves are
+ * not available the digests are trusted. */
+
+/* One record of a signature file. */
+
+typedef struct
+{
+    off_t size;
+    char  *partial;
+    char  *digest;
+    char  *name;
+} signature_t;
+
+/* user data passed to tree foreach when exporting signatures. */
+
+typedef struct
+{
+    GPtrArray *sigs;
+    GChecksum *partial;
+    GChecksum *digest;
+    int	      status;
+} export_t;
+
+/* A signature file being merged, with its current record. */
+
+typedef struct
+{
+    const char *fn;
+    gzFile     gz;
+    char       *node;
+    GString    *line;
+    signature_t      head;
+    int	       live;
+} merge_t;
+
+/* Comparison function for sorting signature records, the order in which
+ * they are written and merged. */
+
+static gint sig_compare(gconstpointer a, gconstpointer b)
+{
+    const signature_t *sa = a;
+    const signature_t *sb = b;
+    gint	res;
+
+    if (sa->size != sb->size)
+	return sa->size < sb->size ? -1 : 1;
+    if ((res = strcmp(sa->partial, sb->partial)) == 0)
+	res = strcmp(sa->digest, sb->digest);
+    return res;
+}
+
+/* Comparison function used by g_ptr_array_sort to sort the records for
+ * export, by name within the same size and digests. */
+
+static gint sig_ptr_compare(gconstpointer a, gconstpointer b)
+{
+    gint res;
+
+    if ((res = sig_compare(*(signature_t **)a, *(signature_t **)b)) == 0)
+	res = strcmp((*(signature_t **)a)->name, (*(signature_t **)b)->name);
+    return res;
+}
+
+/* Calculates the partial and full digests of a file for export.
+ * Returns a new record or NULL if the file could not be read. */
+
+static signature_t *sign_file(file_t *fp, GChecksum *partial, GChecksum *digest)
+{
+    int		  fd;
+    ssize_t	  nbytes;
+    off_t	  pos = 0;
+    unsigned char buf[CHUNK_SIZE];
+    signature_t	  *sig = NULL;
+
+    if ((fd = open(fp->name, O_RDONLY)) >= 0)
+    {
+	while ((nbytes = read(fd, buf, sizeof(buf))) > 0)
+	{
+	    if (pos < PARTIAL_SIZE)
+		g_checksum_update(partial, buf, MIN(nbytes, PARTIAL_SIZE - pos));
+	    g_checksum_update(digest, buf, nbytes);
+	    pos += nbytes;
+	}
+	if (nbytes == 0)
+	{
+	    sig = g_malloc(sizeof(signature_t));
+	    sig->size = pos;
+	    sig->partial = g_strdup(g_checksum_get_string(partial));
+	    sig->digest = g_strdup(g_checksum_get_string(digest));
+	    sig->name = fp->name;
+	}
+	else
+	    g_warning("read error on file '%s' - %m", fp->name);
+	close(fd);
+	g_checksum_reset(partial);
+	g_checksum_reset(digest);
+    }
+    else
+	g_warning("unable to open file '%s' for reading - %m", fp->name);
+    return sig;
+}
+
+/* Frees a signature and returns true if it is of a known file, which is
+ * left out of exports, indexes and replies to the aggregator as it would
+ * be left out of the digest groups. */
+
+static int drop_known(signature_t *sig)
+{
+    if (!known.n || !is_known(sig->digest))
+	return FALSE;
+    known.excluded++;
+    g_free(sig->partial);
+    g_free(sig->digest);
+    g_free(sig);
+    return TRUE;
+}
+
+/* Function called by g_tree_foreach to add the signature of each file,
+ * unless it is a known one, to the array being exported. */
+
+static gboolean export_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    export_t *exp = udata;
+    signature_t    *sig;
+
+    if ((sig = sign_file(value, exp->partial, exp->digest)))
+    {
+	if (!drop_known(sig))
+	    g_ptr_array_add(exp->sigs, sig);
+    }
+    else
+	exp->status++;
+    return FALSE;
+}
+
+/* Writes the signatures of all the files in the list to a gzip
+ * compressed file.  Returns the number of errors. */
+
+static int export_signatures(GTree *file_tree, const char *fn)
+{
+    export_t exp;
+    gzFile   gz;
+    signature_t    *sig;
+    char     *esc;
+    guint    i;
+
+    exp.sigs = g_ptr_array_new();
+    exp.partial = g_checksum_new(G_CHECKSUM_MD5);
+    exp.digest = g_checksum_new(G_CHECKSUM_MD5);
+    exp.status = 0;
+    g_tree_foreach(file_tree, export_foreach, &exp);
+    report_known();
+    g_ptr_array_sort(exp.sigs, sig_ptr_compare);
+    if ((gz = gzopen(fn, "wb")) == NULL)
+    {
+	g_critical("unable to create signature file '%s' - %m", fn);
+	return exp.status + 1;
+    }
+    gzprintf(gz, SIGFILE_MAGIC "\t%s\n", node_name);
+    for (i = 0; i < exp.sigs->len; i++)
+    {
+	sig = g_ptr_array_index(exp.sigs, i);
+	esc = g_strescape(sig->name, NULL);
+	gzprintf(gz, "%ld\t%s\t%s\t%s\n", (long)sig->size, sig->partial,
+		 sig->digest, esc);
+	g_free(esc);
+	g_free(sig->partial);
+	g_free(sig->digest);
+	g_free(sig);
+    }
+    if (gzclose(gz) != Z_OK)
+    {
+	g_critical("unable to write signature file '%s'", fn);
+	exp.status++;
+    }
+    g_ptr_array_free(exp.sigs, TRUE);
+    g_checksum_free(exp.partial);
+    g_checksum_free(exp.digest);
+    return exp.status;
+}
+
+/* Reads the next record from a signature file being merged into the
+ * head record for that file.  Returns 1 if one was read, 0 at the end
+ * of the file or -1 if it could not be read or is damaged, which
+ * includes a last line cut short. */
+
+static int merge_next(merge_t *mp)
+{
+    char       buf[CHUNK_SIZE];
+    char       **fields;
+    char       *name;
+    const char *msg;
+    gsize      len;
+    int	       err, eol = 0;
+
+    g_string_truncate(mp->line, 0);
+    while (gzgets(mp->gz, buf, sizeof(buf)))
+    {
+	g_string_append(mp->line, buf);
+	if ((len = mp->line->len) > 0 && mp->line->str[len-1] == '\n')
+	{
+	    mp->line->str[--len] = '\0';
+	    mp->line->len = len;
+	    eol = 1;
+	    break;
+	}
+    }
+    if (!eol)
+    {
+	msg = gzerror(mp->gz, &err);
+	if (err != Z_OK && err != Z_STREAM_END)
+	{
+	    len = strlen(mp->fn);
+	    if (strncmp(msg, mp->fn, len) == 0 && msg[len] == ':')
+		msg += len + 2;
+	    g_warning("unable to read signature file '%s' - %s", mp->fn, msg);
+	    return -1;
+	}
+	if (mp->line->len == 0)
+	    return 0;
+    }
+    fields = g_strsplit(mp->line->str, "\t", 4);
+    if (!eol || g_strv_length(fields) != 4)
+    {
+	g_warning("signature file '%s' is damaged", mp->fn);
+	g_strfreev(fields);
+	return -1;
+    }
+    g_free(mp->head.partial);
+    g_free(mp->head.digest);
+    g_free(mp->head.name);
+    mp->head.size = g_ascii_strtoll(fields[0], NULL, 10);
+    mp->head.partial = g_strdup(fields[1]);
+    mp->head.digest = g_strdup(fields[2]);
+    name = g_strcompress(fields[3]);
+    mp->head.name = g_strconcat(mp->node, ":", name, NULL);
+    g_free(name);
+    g_strfreev(fields);
+    return 1;
+}
+
+/* Lists a set of records with the same size and digests from the merged
+ * signature files if they came from more than one file, then frees it. */
+
+static void merge_flush(GList *group)
+{
+    GList  *ptr;
+    file_t *fp;
+
+    if (group && !single_root(group))
+	list_files(group->data, group->next);
+    for (ptr = group; ptr; ptr = ptr->next)
+    {
+	fp = ptr->data;
+	g_free(fp->name);
+	g_free(fp);
+    }
+    g_list_free(group);
+}
+
+/* Implements --merge, k-way merging the signature files named and
+ * listing sets of files found in more than one of them.  A file which
+ * cannot be read to the end counts as an error, the sets found from
+ * what was read of it still being listed.  Returns the number of
+ * errors. */
+
+static int merge_signatures(char **names, int nfile)
+{
+    merge_t *files;
+    merge_t *mp, *min;
+    GList   *group = NULL;
+    signature_t   last = { 0, NULL, NULL, NULL };
+    file_t  *fp;
+    char    buf[1024];
+    char    *ptr;
+    int	    i, status = 0;
+
+    files = g_malloc0(nfile * sizeof(merge_t));
+    for (i = 0; i < nfile; i++)
+    {
+	mp = files + i;
+	mp->fn = names[i];
+	mp->line = g_string_new(NULL);
+	if ((mp->gz = gzopen(mp->fn, "rb")) == NULL)
+	{
+	    g_warning("unable to open signature file '%s' - %m", mp->fn);
+	    status++;
+	    continue;
+	}
+	if (gzgets(mp->gz, buf, sizeof(buf)) == NULL ||
+	    strncmp(buf, SIGFILE_MAGIC "\t", sizeof(SIGFILE_MAGIC)) != 0)
+	{
+	    g_warning("'%s' is not a dupfind signature file", mp->fn);
+	    status++;
+	    continue;
+	}
+	if ((ptr = strchr(buf, '\n')))
+	    *ptr = '\0';
+	mp->node = g_strdup(buf + sizeof(SIGFILE_MAGIC));
+	if ((mp->live = merge_next(mp)) < 0)
+	{
+	    mp->live = 0;
+	    status++;
+	}
+    }
+
+    for (;;)
+    {
+	for (min = NULL, i = 0; i < nfile; i++)
+	{
+	    mp = files + i;
+	    if (mp->live && (min == NULL || sig_compare(&mp->head, &min->head) < 0))
+		min = mp;
+	}
+	if (min == NULL)
+	    break;
+	if (group && sig_compare(&last, &min->head) != 0)
+	{
+	    merge_flush(group);
+	    group = NULL;
+	}
+	fp = g_malloc0(sizeof(file_t));
+	fp->name = g_strdup(min->head.name);
+	fp->st_size = min->head.size;
+	fp->root = min - files;
+	group = g_list_append(group, fp);
+	g_free(last.partial);
+	g_free(last.digest);
+	last.size = min->head.size;
+	last.partial = g_strdup(min->head.partial);
+	last.digest = g_strdup(min->head.digest);
+	if ((min->live = merge_next(min)) < 0)
+	{
+	    min->live = 0;
+	    status++;
+	}
+    }
+    merge_flush(group);
+    g_free(last.partial);
+    g_free(last.digest);
+
+    for (i = 0; i < nfile; i++)
+    {
+	mp = files + i;
+	if (mp->gz)
+	    gzclose(mp->gz);
+	g_string_free(mp->line, TRUE);
+	g_free(mp->node);
+	g_free(mp->head.partial);
+	g_free(mp->head.digest);
+	g_free(mp->head.name);
+    }
+    g_free(files);
+    return status;
+}
+
+/* Agent and aggregator modes.  An agent scans its roots as usual then
+ * connects to the aggregator over TCP and takes part in a conversation
+ * which narrows down the candidates in stages so that only files which
+ * may have a copy on another machine are read:
+ *
+ *   agent sends its sizes, with the number of files of each;
+ *   aggregator asks each agent for partial digests of the sizes which
+ *	occur on more than one machine;
+ *   aggregator asks each agent for full digests of the files whose size
+ *	and partial digest occur on more than one machine;
+ *   aggregator lists the sets of files with the same size and digest
+ *	which span machines.
+ *
+ * Messages are framed as a one byte type and four byte length, in
+ * network byte order, followed by that many bytes of text lines.  Lines
+ * are batched into frames of up to FRAME_MAX bytes and each stage ends
+ * with an empty FRAME_END frame. */
+
+/* A batch of lines being built to send to a peer as frames. */
+
+typedef struct
+{
+    int	    fd;
+    GString *buf;
+} batch_t;
+
+/* State of agent mode. */
+
+typedef struct
+{
+    batch_t    batch;
+    GHashTable *sizes;
+    GHashTable *partials;
+    GChecksum  *partial;
+    GChecksum  *digest;
+} agent_t;
+
+/* The number of agents which have a given size or size and partial
+ * digest, and the last agent which was counted. */
+
+typedef struct
+{
+    int nagent;
+    int last;
+} spread_t;
+
+/* An agent connected to the aggregator and the keys it has sent in the
+ * current stage. */
+
+typedef struct
+{
+    int	      fd;
+    char      *node;
+    GPtrArray *keys;
+} remote_t;
+
+/* State of aggregator mode. */
+
+typedef struct
+{
+    remote_t   *agents;
+    int	       nagent;
+    int	       cur;
+    GHashTable *sizes;
+    GHashTable *partials;
+    GHashTable *groups;
+} aggregator_t;
+
+/* Writes all of a buffer to a socket.  Returns 0 on success. */
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t nbytes;
+
+    while (len > 0)
+    {
+	if ((nbytes = write(fd, buf, len)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return 1;
+	}
+	buf = (const char *)buf + nbytes;
+	len -= nbytes;
+    }
+    return 0;
+}
+
+/* Reads exactly len bytes from a socket.  Returns 0 on success. */
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    ssize_t nbytes;
+
+    while (len > 0)
+    {
+	if ((nbytes = read(fd, buf, len)) <= 0)
+	{
+	    if (nbytes < 0 && errno == EINTR)
+		continue;
+	    if (nbytes < 0)
+		g_critical("unable to receive from peer - %m");
+	    else
+		g_critical("connection closed by peer");
+	    return 1;
+	}
+	buf = (char *)buf + nbytes;
+	len -= nbytes;
+    }
+    return 0;
+}
+
+/* Sends a frame.  Returns 0 on success. */
+
+static int send_frame(int fd, char type, const char *data, guint32 len)
+{
+    unsigned char hdr[5];
+
+    hdr[0] = type;
+    hdr[1] = len >> 24;
+    hdr[2] = len >> 16;
+    hdr[3] = len >> 8;
+    hdr[4] = len;
+    if (write_all(fd, hdr, sizeof(hdr)) || (len && write_all(fd, data, len)))
+    {
+	g_critical("unable to send to peer - %m");
+	return 1;
+    }
+    return 0;
+}
+
+/* Appends a frame to a buffer of frames waiting to be sent. */
+
+static void append_frame(GString *out, char type, const char *data,
+			 guint32 len)
+{
+    unsigned char hdr[5];
+
+    hdr[0] = type;
+    hdr[1] = len >> 24;
+    hdr[2] = len >> 16;
+    hdr[3] = len >> 8;
+    hdr[4] = len;
+    g_string_append_len(out, (char *)hdr, sizeof(hdr));
+    g_string_append_len(out, data, len);
+}
+
+/* Returns the length of the data in a frame from its header. */
+
+static guint32 frame_len(const unsigned char *hdr)
+{
+    return ((guint32)hdr[1] << 24) | (hdr[2] << 16) | (hdr[3] << 8) | hdr[4];
+}
+
+/* Receives a frame into str, returning its type or 0 on error. */
+
+static char recv_frame(int fd, GString *str)
+{
+    unsigned char hdr[5];
+    guint32	  len;
+
+    if (read_all(fd, hdr, sizeof(hdr)))
+	return 0;
+    len = frame_len(hdr);
+    if (len > FRAME_MAX)
+    {
+	g_critical("frame from peer too large");
+	return 0;
+    }
+    g_string_set_size(str, len);
+    if (read_all(fd, str->str, len))
+	return 0;
+    return hdr[0];
+}
+
+/* Adds a line to the batch of lines of the given type being built for a
+ * peer, sending the batch first if the line would not fit. */
+
+static int batch_line(batch_t *batch, char type, const char *line)
+{
+    gsize len = strlen(line);
+    int	  status = 0;
+
+    if (batch->buf->len + len + 1 > FRAME_MAX && batch->buf->len > 0)
+    {
+	status = send_frame(batch->fd, type, batch->buf->str, batch->buf->len);
+	g_string_truncate(batch->buf, 0);
+    }
+    g_string_append(batch->buf, line);
+    g_string_append_c(batch->buf, '\n');
+    return status;
+}
+
+/* Sends any lines left in a batch followed by the end of stage frame. */
+
+static int batch_end(batch_t *batch, char type)
+{
+    int status = 0;
+
+    if (batch->buf->len > 0)
+	status = send_frame(batch->fd, type, batch->buf->str, batch->buf->len);
+    g_string_truncate(batch->buf, 0);
+    return status || send_frame(batch->fd, FRAME_END, NULL, 0);
+}
+
+/* Calls func for each line in the data of a frame. */
+
+static void frame_lines(char type, char *data, gsize len,
+			void (*func)(char type, char *line, gpointer udata),
+			gpointer udata)
+{
+    char *line, *end;
+
+    for (line = data; line < data + len; line = end + 1)
+    {
+	if ((end = memchr(line, '\n', data + len - line)) == NULL)
+	    break;
+	*end = '\0';
+	func(type, line, udata);
+    }
+}
+
+/* Receives the frames of one stage from a peer, calling func for each
+ * line until the end of stage frame.  Returns the type of the frames
+ * received, FRAME_END if there were none, or 0 on error. */
+
+static char recv_stage(int fd, void (*func)(char type, char *line,
+					   gpointer udata), gpointer udata)
+{
+    GString *str = g_string_new(NULL);
+    char    type, last = FRAME_END;
+
+    while ((type = recv_frame(fd, str)) && type != FRAME_END)
+    {
+	if (type == FRAME_QUIT)
+	    break;
+	last = type;
+	frame_lines(type, str->str, str->len, func, udata);
+    }
+    g_string_free(str, TRUE);
+    return type == FRAME_END ? last : type;
+}
+
+/* Looks through the frames received so far into a buffer, from *scan
+ * on, for the end of a stage.  Returns 1 once the end of stage frame
+ * has arrived, 0 if more is to come or -1 if a frame is too large. */
+
+static int stage_complete(GString *in, gsize *scan)
+{
+    const unsigned char *hdr;
+    guint32		len;
+
+    while (in->len - *scan >= 5)
+    {
+	hdr = (const unsigned char *)in->str + *scan;
+	if ((len = frame_len(hdr)) > FRAME_MAX)
+	    return -1;
+	if (in->len - *scan < 5 + len)
+	    return 0;
+	*scan += 5 + len;
+	if (hdr[0] == FRAME_END || hdr[0] == FRAME_QUIT)
+	    return 1;
+    }
+    return 0;
+}
+
+/* Calls func for each line of the frames of one stage held in a buffer
+ * which stage_complete has found to be complete. */
+
+static void parse_stage(GString *in, void (*func)(char type, char *line,
+						  gpointer udata),
+			gpointer udata)
+{
+    unsigned char *hdr;
+    gsize	  pos;
+    guint32	  len;
+
+    for (pos = 0; pos + 5 <= in->len; pos += 5 + len)
+    {
+	hdr = (unsigned char *)in->str + pos;
+	len = frame_len(hdr);
+	if (hdr[0] == FRAME_END || hdr[0] == FRAME_QUIT)
+	    break;
+	frame_lines(hdr[0], in->str + pos + 5, len, func, udata);
+    }
+}
+
+/* Opens a TCP connection to, or listening socket on, a [HOST:]PORT
+ * address.  Returns the socket or -1 on error. */
+
+static int open_socket(const char *addr, int listening)
+{
+    struct addrinfo hints, *res, *ai;
+    char	    *str, *host, *port, *ptr;
+    int		    fd = -1, on = 1, err;
+
+    str = g_strdup(addr);
+    if ((port = strrchr(str, ':')))
+    {
+	*port++ = '\0';
+	host = str;
+	if (*host == '[' && (ptr = strchr(host, ']')))
+	{
+	    *ptr = '\0';
+	    host++;
+	}
+	if (*host == '\0')
+	    host = NULL;
+    }
+    else
+    {
+	port = str;
+	host = NULL;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if ((err = getaddrinfo(host, port, &hints, &res)))
+    {
+	g_critical("unable to resolve '%s' - %s", addr, gai_strerror(err));
+	g_free(str);
+	return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+	    continue;
+	if (listening)
+	{
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		listen(fd, 16) == 0)
+		break;
+	}
+	else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    if (fd < 0)
+	g_critical("unable to %s '%s' - %m",
+		   listening ? "listen on" : "connect to", addr);
+    freeaddrinfo(res);
+    g_free(str);
+    return fd;
+}
+
+/* Calculates the digest of the first PARTIAL_SIZE bytes of a file.
+ * Returns a new string or NULL if the file could not be read. */
+
+static char *partial_digest(file_t *fp, GChecksum *partial)
+{
+    int		  fd;
+    ssize_t	  nbytes;
+    unsigned char buf[PARTIAL_SIZE];
+    char	  *digest = NULL;
+
+    if ((fd = open(fp->name, O_RDONLY)) >= 0)
+    {
+	if ((nbytes = read(fd, buf, sizeof(buf))) >= 0)
+	{
+	    g_checksum_update(partial, buf, nbytes);
+	    digest = g_strdup(g_checksum_get_string(partial));
+	}
+	else
+	    g_warning("read error on file '%s' - %m", fp->name);
+	g_checksum_reset(partial);
+	close(fd);
+    }
+    else
+	g_warning("unable to open file '%s' for reading - %m", fp->name);
+    return digest;
+}
+
+/* Function called by recv_stage in agent mode for each line of a request
+ * from the aggregator.  A request for partial digests lists sizes and
+ * each distinct size and partial digest among the files of that size is
+ * sent back.  A request for full digests lists sizes and partial digests
+ * and the size, both digests and name of each of those files is sent
+ * back. */
+
+static void agent_line(char type, char *line, gpointer udata)
+{
+    agent_t	*ag = udata;
+    off_t	size;
+    file_list_t *file_list;
+    GList	*ptr, *files;
+    file_t	*fp;
+    char	*partial, *key, *esc, *reply;
+    signature_t *sig;
+
+    if (type == FRAME_PARTIAL_REQ)
+    {
+	size = g_ascii_strtoll(line, NULL, 10);
+	if ((file_list = g_hash_table_lookup(ag->sizes, &size)) == NULL)
+	    return;
+	for (ptr = file_list->files; ptr; ptr = ptr->next)
+	{
+	    fp = ptr->data;
+	    if ((partial = partial_digest(fp, ag->partial)) == NULL)
+		continue;
+	    key = g_strdup_printf("%ld\t%s", (long)size, partial);
+	    g_free(partial);
+	    if ((files = g_hash_table_lookup(ag->partials, key)))
+	    {
+		files = g_list_append(files, fp);
+		g_free(key);
+	    }
+	    else
+	    {
+		files = g_list_append(NULL, fp);
+		g_hash_table_insert(ag->partials, key, files);
+		batch_line(&ag->batch, FRAME_PARTIALS, key);
+	    }
+	}
+    }
+    else if (type == FRAME_FULL_REQ)
+    {
+	files = g_hash_table_lookup(ag->partials, line);
+	for (ptr = files; ptr; ptr = ptr->next)
+	{
+	    if ((sig = sign_file(ptr->data, ag->partial, ag->digest)) == NULL ||
+		drop_known(sig))
+		continue;
+	    esc = g_strescape(sig->name, NULL);
+	    reply = g_strdup_printf("%ld\t%s\t%s\t%s", (long)sig->size,
+				    sig->partial, sig->digest, esc);
+	    batch_line(&ag->batch, FRAME_DIGESTS, reply);
+	    g_free(reply);
+	    g_free(esc);
+	    g_free(sig->partial);
+	    g_free(sig->digest);
+	    g_free(sig);
+	}
+    }
+}
+
+/* Implements agent mode once the file list has been built.  Returns the
+ * number of errors. */
+
+static int run_agent(GTree *file_tree, const char *addr)
+{
+    agent_t	   ag;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    char	   *line;
+    char	   type;
+    int		   status = 0;
+
+    if ((ag.batch.fd = open_socket(addr, 0)) < 0)
+	return 1;
+    ag.batch.buf = g_string_new(NULL);
+    ag.sizes = build_size_hash(file_tree);
+    ag.partials = g_hash_table_new(g_str_hash, g_str_equal);
+    ag.partial = g_checksum_new(G_CHECKSUM_MD5);
+    ag.digest = g_checksum_new(G_CHECKSUM_MD5);
+
+    status = send_frame(ag.batch.fd, FRAME_HELLO, node_name, strlen(node_name));
+    g_hash_table_iter_init(&iter, ag.sizes);
+    while (status == 0 && g_hash_table_iter_next(&iter, &key, &value))
+    {
+	line = g_strdup_printf("%ld %d", (long)*(off_t *)key,
+			       ((file_list_t *)value)->nfile);
+	status = batch_line(&ag.batch, FRAME_SIZES, line);
+	g_free(line);
+    }
+    if (status == 0)
+	status = batch_end(&ag.batch, FRAME_SIZES);
+    while (status == 0)
+    {
+	type = recv_stage(ag.batch.fd, agent_line, &ag);
+	if (type == FRAME_PARTIAL_REQ || type == FRAME_END)
+	    status = batch_end(&ag.batch, FRAME_PARTIALS);
+	else if (type == FRAME_FULL_REQ)
+	    status = batch_end(&ag.batch, FRAME_DIGESTS);
+	else if (type == FRAME_QUIT)
+	    break;
+	else
+	    status = 1;
+    }
+    close(ag.batch.fd);
+    g_string_free(ag.batch.buf, TRUE);
+    g_checksum_free(ag.partial);
+    g_checksum_free(ag.digest);
+    report_known();
+    return status;
+}
+
+/* Records that the current agent has a key, in the aggregator's table of
+ * how many agents have each key, and adds it to the agent's own list of
+ * keys the first time. */
+
+static void spread_add(aggregator_t *agg, GHashTable *hash, gpointer key,
+		       GPtrArray *keys)
+{
+    spread_t *sp;
+
+    if ((sp = g_hash_table_lookup(hash, key)) == NULL)
+    {
+	sp = g_malloc(sizeof(spread_t));
+	sp->nagent = 0;
+	sp->last = -1;
+	g_hash_table_insert(hash, key, sp);
+    }
+    if (sp->last != agg->cur)
+    {
+	sp->nagent++;
+	sp->last = agg->cur;
+	g_ptr_array_add(keys, key);
+    }
+}
+
+/* Function called by recv_stage in aggregator mode for each line of the
+ * replies from an agent. */
+
+static void aggregator_line(char type, char *line, gpointer udata)
+{
+    aggregator_t *agg = udata;
+    remote_t	 *ag = agg->agents + agg->cur;
+    gint64	 *size;
+    gpointer	 orig;
+    char	 **fields;
+    char	 *key, *name;
+    file_t	 *fp;
+    GList	 *files;
+
+    if (type == FRAME_SIZES)
+    {
+	size = g_malloc(sizeof(gint64));
+	*size = g_ascii_strtoll(line, NULL, 10);
+	if (g_hash_table_lookup_extended(agg->sizes, size, &orig, NULL))
+	{
+	    g_free(size);
+	    size = orig;
+	}
+	spread_add(agg, agg->sizes, size, ag->keys);
+    }
+    else if (type == FRAME_PARTIALS)
+    {
+	key = g_strdup(line);
+	if (g_hash_table_lookup_extended(agg->partials, key, &orig, NULL))
+	{
+	    g_free(key);
+	    key = orig;
+	}
+	spread_add(agg, agg->partials, key, ag->keys);
+    }
+    else if (type == FRAME_DIGESTS)
+    {
+	fields = g_strsplit(line, "\t", 4);
+	if (g_strv_length(fields) == 4)
+	{
+	    name = g_strcompress(fields[3]);
+	    fp = g_malloc0(sizeof(file_t));
+	    fp->name = g_strconcat(ag->node, ":", name, NULL);
+	    fp->st_size = g_ascii_strtoll(fields[0], NULL, 10);
+	    fp->root = agg->cur;
+	    g_free(name);
+	    key = g_strconcat(fields[0], "\t", fields[2], NULL);
+	    if ((files = g_hash_table_lookup(agg->groups, key)))
+	    {
+		g_list_append(files, fp);
+		g_free(key);
+	    }
+	    else
+		g_hash_table_insert(agg->groups, key, g_list_append(NULL, fp));
+	}
+	else
+	    g_warning("bad digest line from agent %s", ag->node);
+	g_strfreev(fields);
+    }
+}
+
+/* Sends each agent a request listing those of its keys which more than
+ * one agent has and receives the replies.  An agent starts replying
+ * while it is still reading its request so the requests are written
+ * and the replies read at the same time, through non-blocking sockets
+ * and poll, as otherwise with large requests and replies both sides
+ * could block writing with neither reading.  The replies are kept until
+ * all have arrived and then dealt with agent by agent.  Returns the
+ * number of errors. */
+
+static int aggregator_stage(aggregator_t *agg, GHashTable *hash, char type)
+{
+    remote_t	  *ag;
+    GString	  **out, **in, *lines;
+    gsize	  *sent, *scan;
+    int		  *done;
+    struct pollfd *pfd;
+    spread_t	  *sp;
+    gpointer	  key;
+    char	  buf[FRAME_MAX];
+    char	  *line;
+    ssize_t	  nbytes;
+    guint	  i;
+    int		  n, left, status = 0;
+
+    out = g_new0(GString *, agg->nagent);
+    in = g_new0(GString *, agg->nagent);
+    sent = g_new0(gsize, agg->nagent);
+    scan = g_new0(gsize, agg->nagent);
+    done = g_new0(int, agg->nagent);
+    pfd = g_new0(struct pollfd, agg->nagent);
+    lines = g_string_new(NULL);
+    for (n = 0; n < agg->nagent; n++)
+    {
+	ag = agg->agents + n;
+	out[n] = g_string_new(NULL);
+	in[n] = g_string_new(NULL);
+	for (i = 0; i < ag->keys->len; i++)
+	{
+	    key = g_ptr_array_index(ag->keys, i);
+	    sp = g_hash_table_lookup(hash, key);
+	    if (sp->nagent < 2)
+		continue;
+	    if (hash == agg->sizes)
+		line = g_strdup_printf("%ld", (long)*(gint64 *)key);
+	    else
+		line = g_strdup(key);
+	    if (lines->len + strlen(line) + 1 > FRAME_MAX && lines->len > 0)
+	    {
+		append_frame(out[n], type, lines->str, lines->len);
+		g_string_truncate(lines, 0);
+	    }
+	    g_string_append(lines, line);
+	    g_string_append_c(lines, '\n');
+	    g_free(line);
+	}
+	if (lines->len > 0)
+	    append_frame(out[n], type, lines->str, lines->len);
+	g_string_truncate(lines, 0);
+	append_frame(out[n], FRAME_END, NULL, 0);
+	g_ptr_array_set_size(ag->keys, 0);
+	fcntl(ag->fd, F_SETFL, fcntl(ag->fd, F_GETFL) | O_NONBLOCK);
+    }
+    g_string_free(lines, TRUE);
+
+    for (left = agg->nagent; status == 0 && left > 0; )
+    {
+	for (n = 0; n < agg->nagent; n++)
+	{
+	    pfd[n].fd = agg->agents[n].fd;
+	    pfd[n].events = (sent[n] < out[n]->len ? POLLOUT : 0) |
+		(done[n] ? 0 : POLLIN);
+	    if (pfd[n].events == 0)
+		pfd[n].fd = -1;
+	}
+	if (poll(pfd, agg->nagent, -1) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    g_critical("unable to poll agents - %m");
+	    status++;
+	    break;
+	}
+	for (n = 0; status == 0 && n < agg->nagent; n++)
+	{
+	    ag = agg->agents + n;
+	    if (pfd[n].revents & POLLOUT)
+	    {
+		if ((nbytes = write(ag->fd, out[n]->str + sent[n],
+				    out[n]->len - sent[n])) > 0)
+		    sent[n] += nbytes;
+		else if (errno != EAGAIN && errno != EINTR)
+		{
+		    g_critical("unable to send to agent %s - %m", ag->node);
+		    status++;
+		}
+	    }
+	    if (status == 0 && (pfd[n].revents & (POLLIN|POLLHUP|POLLERR)))
+	    {
+		if ((nbytes = read(ag->fd, buf, sizeof(buf))) > 0)
+		{
+		    g_string_append_len(in[n], buf, nbytes);
+		    switch (stage_complete(in[n], scan + n))
+		    {
+		    case 1:
+			done[n] = 1;
+			left--;
+			break;
+		    case -1:
+			g_critical("frame from agent %s too large", ag->node);
+			status++;
+		    }
+		}
+		else if (nbytes == 0)
+		{
+		    g_critical("connection closed by agent %s", ag->node);
+		    status++;
+		}
+		else if (errno != EAGAIN && errno != EINTR)
+		{
+		    g_critical("unable to receive from agent %s - %m",
+			       ag->node);
+		    status++;
+		}
+	    }
+	}
+    }
+
+    for (n = 0; n < agg->nagent; n++)
+    {
+	ag = agg->agents + n;
+	fcntl(ag->fd, F_SETFL, fcntl(ag->fd, F_GETFL) & ~O_NONBLOCK);
+	if (status == 0)
+	{
+	    agg->cur = n;
+	    parse_stage(in[n], aggregator_line, agg);
+	}
+	g_string_free(out[n], TRUE);
+	g_string_free(in[n], TRUE);
+    }
+    g_free(out);
+    g_free(in);
+    g_free(sent);
+    g_free(scan);
+    g_free(done);
+    g_free(pfd);
+    return status;
+}
+
+/* Implements aggregator mode, waiting for nagent agents to connect then
+ * listing the sets of duplicates which span more than one of them.
+ * Returns the number of errors. */
+
+static int run_aggregator(const char *addr, int nagent)
+{
+    aggregator_t   agg;
+    remote_t	   *ag;
+    GString	   *str;
+    GHashTableIter iter;
+    gpointer	   key, value;
+    GList	   *files;
+    int		   lfd, i, status = 0;
+
+    if ((lfd = open_socket(addr, 1)) < 0)
+	return 1;
+    agg.nagent = nagent;
+    agg.agents = g_malloc0(nagent * sizeof(remote_t));
+    agg.sizes = g_hash_table_new(g_int64_hash, g_int64_equal);
+    agg.partials = g_hash_table_new(g_str_hash, g_str_equal);
+    agg.groups = g_hash_table_new(g_str_hash, g_str_equal);
+    str = g_string_new(NULL);
+    for (i = 0; i < nagent && status == 0; i++)
+    {
+	ag = agg.agents + i;
+	if ((ag->fd = accept(lfd, NULL, NULL)) < 0)
+	{
+	    g_critical("unable to accept agent connection - %m");
+	    status++;
+	}
+	else if (recv_frame(ag->fd, str) != FRAME_HELLO)
+	{
+	    g_critical("bad greeting from agent");
+	    status++;
+	}
+	else
+	{
+	    ag->node = g_strndup(str->str, str->len);
+	    ag->keys = g_ptr_array_new();
+	    if (options & OPT_VERBOSE)
+		g_log(NULL, G_LOG_LEVEL_INFO, "agent %s connected", ag->node);
+	}
+    }
+    close(lfd);
+    g_string_free(str, TRUE);
+
+    for (agg.cur = 0; status == 0 && agg.cur < nagent; agg.cur++)
+	if (recv_stage(agg.agents[agg.cur].fd, aggregator_line, &agg) == 0)
+	    status++;
+    if (status == 0)
+	status = aggregator_stage(&agg, agg.sizes, FRAME_PARTIAL_REQ);
+    if (status == 0)
+	status = aggregator_stage(&agg, agg.partials, FRAME_FULL_REQ);
+
+    g_hash_table_iter_init(&iter, agg.groups);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+	files = g_list_sort(value, sort_compare);
+	if (!single_root(files))
+	    list_files(files->data, files->next);
+    }
+    for (i = 0; i < nagent; i++)
+    {
+	ag = agg.agents + i;
+	if (ag->fd > 0)
+	{
+	    send_frame(ag->fd, FRAME_QUIT, NULL, 0);
+	    close(ag->fd);
+	}
+    }
+    return status;
+}
+
+/* Phases two and three, once the file list has been built, in whichever
+ * mode was selected on the command line.  Returns the exit status given
+ * the status from phase one. */
+
+static int check_files(GTree *file_tree, int have_refs, int status)
+{
+    tree_foreach_t foreach_data;
+    int		   found;
+
+    /* In --any mode phases two and three are done size group by size
+     * group, stopping at the first duplicate. */
+
+    if (options & OPT_ANY)
+    {
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO, "searching for any duplicate");
+	found = find_any(file_tree);
+	if (cache_file)
+	    status += save_cache(file_tree, &scan_start);
+	if (found)
+	    return ANY_FOUND_STATUS;
+	return status ? 1 : 0;
+    }
+
+    /* With reference roots phases two and three only look at files
+     * whose size occurs on both sides. */
+
+    if (have_refs)
+    {
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO, "checking against reference files");
+	if (options & OPT_MISSING)
+	    status += find_missing(file_tree);
+	else
+	    find_in_reference(file_tree);
+	if (ref_save_file)
+	    status += save_reference(file_tree);
+	if (cache_file)
+	    status += save_cache(file_tree, &scan_start);
+	return status;
+    }
+
+    /* Phase two - group files by message digest */
+
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "calculating digests");
+    foreach_data.hash = g_hash_table_new(g_str_hash, g_str_equal);
+    foreach_data.digest =g_checksum_new(G_CHECKSUM_MD5);
+    if (options & OPT_CROSS)
+	hash_cross_roots(file_tree, &foreach_data);
+    else if (digest_mode == DIGEST_AUTO || hash_func == hash_multi)
+	hash_by_size(file_tree, &foreach_data);
+    else if (hot_first)
+	hash_hot_first(file_tree, &foreach_data);
+    else if (prefetch_files || throttle_rate)
+	hash_in_order(file_tree, &foreach_data);
+    else
+	g_tree_foreach(file_tree, file_foreach, &foreach_data);
+
+    /* Phase three - check for exact match and carry out actions */
+
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "performing required actions");
+    report_known();
+    report_pkg();
+    check_groups(foreach_data.hash);
+    report_cache();
+    if (cache_file)
+	status += save_cache(file_tree, &scan_start);
+    return status;
+}
+
+/* Corpus index.  With --build-index the size, partial and full digests
+ * and name of each file found are written to an index file, and with
+ * --save-results the plain search writes the sizes and digests it has
+ * calculated anyway to one, without partial digests.  With --lookup the
+ * files named are looked up in an index, which is mapped into memory and
+ * searched where it lies, so each lookup costs a few page reads whatever
+ * the size of the index.  A file whose size is not in the index is not
+ * read at all, the partial digest is only calculated if the size is
+ * found and the full digest only if the partial digest is found too.
+ * With --verify any indexed file still present is compared byte by byte
+ * as well.
+ *
+ * An index is a header, the fixed size records sorted by size and
+ * digest, a fence table holding the size of every INDEX_FENCE'th record,
+ * a table of the offsets of the names by file id and the names, each
+ * terminated by a NUL.  File ids are given in name order so the name
+ * table is sorted too.  Numbers are in the byte order of the machine
+ * which wrote the index. */
+
+/* Number of records between fence pointers. */
+
+#define INDEX_FENCE 256
+
+/* Header flag set if the records include partial digests. */
+
+#define INDEX_PARTIALS 0x01
+
+/* Header of an index file. */
+
+typedef struct
+{
+    char    magic[16];
+    guint32 flags;
+    guint32 fence_stride;
+    guint64 nrec;
+    guint64 nfence;
+    guint64 fences_off;
+    guint64 paths_off;
+    guint64 names_off;
+} index_hdr_t;
+
+/* One record of an index file. */
+
+typedef struct
+{
+    guint64 size;
+    guint8  digest[MD5_DIGEST];
+    guint8  partial[MD5_DIGEST];
+    guint32 file_id;
+    guint32 spare;
+} index_rec_t;
+
+/* An index file mapped for lookups. */
+
+typedef struct
+{
+    void	      *map;
+    gsize	      len;
+    guint32	      flags;
+    guint32	      stride;
+    const index_rec_t *recs;
+    guint64	      nrec;
+    const guint64     *fences;
+    guint64	      nfence;
+    const guint64     *paths;
+    const char	      *names;
+    gsize	      names_len;
+} index_t;
+
+/* Comparison function used by g_ptr_array_sort to put signatures in
+ * name order to give out the file ids. */
+
+static gint sig_name_compare(gconstpointer a, gconstpointer b)
+{
+    return strcmp((*(signature_t **)a)->name, (*(signature_t **)b)->name);
+}
+
+/* Comparison function used by qsort to sort the records of an index by
+ * size, partial digest and digest.  Files with the same size and digest
+ * have the same partial digest, so each set of copies stays together. */
+
+static int index_compare(const void *a, const void *b)
+{
+    const index_rec_t *ra = a;
+    const index_rec_t *rb = b;
+    int		      res;
+
+    if (ra->size != rb->size)
+	return ra->size < rb->size ? -1 : 1;
+    if ((res = memcmp(ra->partial, rb->partial, MD5_DIGEST)) == 0 &&
+	(res = memcmp(ra->digest, rb->digest, MD5_DIGEST)) == 0)
+	res = ra->file_id < rb->file_id ? -1 : ra->file_id > rb->file_id;
+    return res;
+}
+
+/* Writes an index of the signatures, whose partial digests may be NULL,
+ * via a temporary file.  The array is left in name order.  Returns the
+ * number of errors. */
+
+static int write_index(GPtrArray *sigs, const char *fn)
+{
+    index_hdr_t hdr;
+    index_rec_t *recs;
+    signature_t *sig;
+    guint64	off;
+    char	*tmp;
+    FILE	*fp;
+    guint	i;
+    int		status = 0;
+
+    g_ptr_array_sort(sigs, sig_name_compare);
+    recs = g_malloc0_n(MAX(sigs->len, 1), sizeof(index_rec_t));
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.flags = INDEX_PARTIALS;
+    for (i = 0; i < sigs->len; i++)
+    {
+	sig = g_ptr_array_index(sigs, i);
+	recs[i].size = sig->size;
+	recs[i].file_id = i;
+	hex_to_bin(sig->digest, recs[i].digest);
+	if (sig->partial)
+	    hex_to_bin(sig->partial, recs[i].partial);
+	else
+	    hdr.flags &= ~INDEX_PARTIALS;
+    }
+    if (!(hdr.flags & INDEX_PARTIALS))
+	for (i = 0; i < sigs->len; i++)
+	    memset(recs[i].partial, 0, MD5_DIGEST);
+    qsort(recs, sigs->len, sizeof(index_rec_t), index_compare);
+
+    hdr.fence_stride = INDEX_FENCE;
+    hdr.nrec = sigs->len;
+    hdr.nfence = (hdr.nrec + INDEX_FENCE - 1) / INDEX_FENCE;
+    hdr.fences_off = sizeof(hdr) + hdr.nrec * sizeof(index_rec_t);
+    hdr.paths_off = hdr.fences_off + hdr.nfence * sizeof(guint64);
+    hdr.names_off = hdr.paths_off + hdr.nrec * sizeof(guint64);
+    tmp = g_strconcat(fn, ".tmp", NULL);
+    if ((fp = fopen(tmp, "w")))
+    {
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(recs, sizeof(index_rec_t), hdr.nrec, fp);
+	for (i = 0; i < hdr.nrec; i += INDEX_FENCE)
+	    fwrite(&recs[i].size, sizeof(guint64), 1, fp);
+	for (i = 0, off = 0; i < sigs->len; i++)
+	{
+	    fwrite(&off, sizeof(off), 1, fp);
+	    off += strlen(((signature_t *)g_ptr_array_index(sigs, i))->name) + 1;
+	}
+	for (i = 0; i < sigs->len; i++)
+	{
+	    sig = g_ptr_array_index(sigs, i);
+	    fwrite(sig->name, strlen(sig->name) + 1, 1, fp);
+	}
+	if (ferror(fp) | fclose(fp) || rename(tmp, fn) != 0)
+	{
+	    g_critical("unable to write index '%s' - %m", fn);
+	    unlink(tmp);
+	    status++;
+	}
+    }
+    else
+    {
+	g_critical("unable to create index '%s' - %m", tmp);
+	status++;
+    }
+    g_free(tmp);
+    g_free(recs);
+    return status;
+}
+
+/* Writes the index of all the files in the list for --build-index,
+ * hashing every file.  Returns the number of errors. */
+
+static int build_index(GTree *file_tree, const char *fn)
+{
+    export_t	exp;
+    signature_t *sig;
+    guint	i;
+
+    exp.sigs = g_ptr_array_new();
+    exp.partial = g_checksum_new(G_CHECKSUM_MD5);
+    exp.digest = g_checksum_new(G_CHECKSUM_MD5);
+    exp.status = 0;
+    g_tree_foreach(file_tree, export_foreach, &exp);
+    report_known();
+    exp.status += write_index(exp.sigs, fn);
+    for (i = 0; i < exp.sigs->len; i++)
+    {
+	sig = g_ptr_array_index(exp.sigs, i);
+	g_free(sig->partial);
+	g_free(sig->digest);
+	g_free(sig);
+    }
+    g_ptr_array_free(exp.sigs, TRUE);
+    g_checksum_free(exp.partial);
+    g_checksum_free(exp.digest);
+    return exp.status;
+}
+
+/* Function called by g_tree_foreach to add a signature for each file
+ * with an MD5 digest read from it to the array for --save-results. */
+
+static gboolean results_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    file_t	*fp = value;
+    signature_t *sig;
+
+    if (fp->digest && !is_verity(fp->digest) && !(fp->flags & FILE_PKG))
+    {
+	sig = g_malloc(sizeof(signature_t));
+	sig->size = fp->st_size;
+	sig->partial = NULL;
+	sig->digest = fp->digest;
+	sig->name = fp->name;
+	g_ptr_array_add(udata, sig);
+    }
+    return FALSE;
+}
+
+/* Writes the sizes and digests found by the plain search to an index
+ * for --save-results.  Returns the number of errors. */
+
+static int save_results(GTree *file_tree, const char *fn)
+{
+    GPtrArray *sigs;
+    int	      status;
+
+    sigs = g_ptr_array_new();
+    g_tree_foreach(file_tree, results_foreach, sigs);
+    status = write_index(sigs, fn);
+    g_ptr_array_foreach(sigs, (GFunc)g_free, NULL);
+    g_ptr_array_free(sigs, TRUE);
+    return status;
+}
+
+/* Maps an index file and checks its header, and that every path
+ * offset lies within the names and the names end with a NUL, so a name
+ * read from the index cannot run off the end of the map.  Returns 0 on
+ * success. */
+
+static int open_index(index_t *idx, const char *fn)
+{
+    int		   fd;
+    struct stat	   stbuf;
+    index_hdr_t	   *hdr;
+    const guint64  *paths;
+    guint64	   i;
+
+    if ((fd = open(fn, O_RDONLY)) < 0)
+    {
+	g_critical("unable to open index '%s' - %m", fn);
+	return 1;
+    }
+    fstat(fd, &stbuf);
+    idx->len = stbuf.st_size;
+    if (idx->len < sizeof(index_hdr_t))
+	idx->map = MAP_FAILED;
+    else if ((idx->map = mmap(NULL, idx->len, PROT_READ, MAP_SHARED,
+			      fd, 0)) == MAP_FAILED)
+    {
+	g_critical("unable to map index '%s' - %m", fn);
+	close(fd);
+	return 1;
+    }
+    close(fd);
+    hdr = idx->map;
+    if (idx->map == MAP_FAILED ||
+	memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+	hdr->fence_stride == 0 ||
+	hdr->nrec > idx->len / sizeof(index_rec_t) ||
+	hdr->nfence != (hdr->nrec + hdr->fence_stride - 1) / hdr->fence_stride ||
+	hdr->fences_off != sizeof(*hdr) + hdr->nrec * sizeof(index_rec_t) ||
+	hdr->paths_off != hdr->fences_off + hdr->nfence * sizeof(guint64) ||
+	hdr->names_off != hdr->paths_off + hdr->nrec * sizeof(guint64) ||
+	hdr->names_off > idx->len ||
+	(hdr->nrec && (hdr->names_off == idx->len ||
+		       ((const char *)idx->map)[idx->len - 1] != '\0')))
+    {
+	g_critical("'%s' is not a dupfind index", fn);
+	if (idx->map != MAP_FAILED)
+	    munmap(idx->map, idx->len);
+	return 1;
+    }
+    paths = (const guint64 *)((const char *)idx->map + hdr->paths_off);
+    for (i = 0; i < hdr->nrec; i++)
+	if (paths[i] >= idx->len - hdr->names_off)
+	{
+	    g_critical("index '%s' is damaged", fn);
+	    munmap(idx->map, idx->len);
+	    return 1;
+	}
+    madvise(idx->map, idx->len, MADV_RANDOM);
+    idx->flags = hdr->flags;
+    idx->stride = hdr->fence_stride;
+    idx->nrec = hdr->nrec;
+    idx->recs = (const index_rec_t *)(hdr + 1);
+    idx->nfence = hdr->nfence;
+    idx->fences = (const guint64 *)((const char *)idx->map + hdr->fences_off);
+    idx->paths = paths;
+    idx->names = (const char *)idx->map + hdr->names_off;
+    idx->names_len = idx->len - hdr->names_off;
+    return 0;
+}
+
+/* Returns the name of the file with the given id in an index, or NULL
+ * if the index is damaged.  open_index has checked the path offsets. */
+
+static const char *index_name(const index_t *idx, guint32 file_id)
+{
+    if (file_id >= idx->nrec)
+	return NULL;
+    return idx->names + idx->paths[file_id];
+}
+
+/* Returns the number of fences whose size is less than, or if equal is
+ * set no greater than, the given size. */
+
+static guint64 fence_find(const index_t *idx, off_t size, int equal)
+{
+    guint64 lo = 0, hi = idx->nfence, mid;
+
+    while (lo < hi)
+    {
+	mid = lo + (hi - lo) / 2;
+	if (idx->fences[mid] < size || (equal && idx->fences[mid] == size))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Returns whether an index record sorts before the given size and,
+ * unless they are NULL, partial digest and digest. */
+
+static int index_before(const index_rec_t *rec, off_t size,
+			const guint8 *partial, const guint8 *digest)
+{
+    int res;
+
+    if (rec->size != (guint64)size)
+	return rec->size < (guint64)size;
+    if (partial == NULL ||
+	(res = memcmp(rec->partial, partial, MD5_DIGEST)) > 0)
+	return FALSE;
+    return res < 0 || (digest && memcmp(rec->digest, digest, MD5_DIGEST) < 0);
+}
+
+/* Finds the first record in the index with the given size and, unless
+ * partial is NULL, partial digest and, unless digest is also NULL,
+ * digest, or where it would be.  The fence table, which is small enough
+ * to stay in the cache, narrows the search to the records from the
+ * fence before the first of that size up to the first fence of a
+ * greater size.  These are then searched by interpolating on size,
+ * alternating with halving to bound the number of probes when the sizes
+ * are badly skewed, so that within one size it is a binary search. */
+
+static guint64 index_find(const index_t *idx, off_t size,
+			  const guint8 *partial, const guint8 *digest)
+{
+    guint64	      lo, hi, mid;
+    guint64	      lo_size, hi_size;
+    int		      interp = 1;
+
+    lo = fence_find(idx, size, FALSE);
+    hi = partial ? fence_find(idx, size, TRUE) : lo;
+    hi = MIN(hi * idx->stride, idx->nrec);
+    lo = lo > 0 ? (lo - 1) * idx->stride : 0;
+    while (lo < hi)
+    {
+	lo_size = idx->recs[lo].size;
+	hi_size = idx->recs[hi-1].size;
+	if (interp && hi_size > lo_size && size > lo_size && size <= hi_size)
+	    mid = lo + (guint64)((double)(size - lo_size) /
+				 (hi_size - lo_size) * (hi - 1 - lo));
+	else
+	    mid = lo + (hi - lo) / 2;
+	interp = !interp;
+	if (index_before(idx->recs + mid, size, partial, digest))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Looks up one file in the index and lists it with the indexed files
+ * which have the same contents, if any.  Returns 1 if there were any,
+ * 0 if there were none or -1 on error. */
+
+static int lookup_file(index_t *idx, const char *name, GChecksum *partial,
+		       GChecksum *digest, int verify)
+{
+    struct stat	      stbuf;
+    file_t	      query, *fp;
+    char	      *hex;
+    guint8	      pbin[MD5_DIGEST], dbin[MD5_DIGEST];
+    guint64	      i;
+    const index_rec_t *rec;
+    const char	      *match;
+    signature_t	      *sig;
+    GList	      *matches = NULL, *ptr;
+    int		      found;
+
+    if (stat(name, &stbuf) != 0)
+    {
+	g_warning("unable to stat '%s' - %m", name);
+	return -1;
+    }
+    if (!S_ISREG(stbuf.st_mode))
+    {
+	g_warning("%s is not a regular file - ignored", name);
+	return -1;
+    }
+    i = index_find(idx, stbuf.st_size, NULL, NULL);
+    if (i == idx->nrec || idx->recs[i].size != stbuf.st_size)
+	return 0;
+
+    memset(&query, 0, sizeof(query));
+    query.name = (char *)name;
+    query.st_size = stbuf.st_size;
+    if (idx->flags & INDEX_PARTIALS)
+    {
+	if ((hex = partial_digest(&query, partial)) == NULL)
+	    return -1;
+	hex_to_bin(hex, pbin);
+	g_free(hex);
+	i = index_find(idx, stbuf.st_size, pbin, NULL);
+	if (i == idx->nrec || idx->recs[i].size != stbuf.st_size ||
+	    memcmp(idx->recs[i].partial, pbin, MD5_DIGEST) != 0)
+	    return 0;
+    }
+    else
+	memset(pbin, 0, MD5_DIGEST);
+
+    if ((sig = sign_file(&query, partial, digest)) == NULL)
+	return -1;
+    hex_to_bin(sig->digest, dbin);
+    g_free(sig->partial);
+    g_free(sig->digest);
+    g_free(sig);
+    i = index_find(idx, stbuf.st_size, pbin, dbin);
+    for (rec = idx->recs + i; rec < idx->recs + idx->nrec &&
+	     rec->size == stbuf.st_size &&
+	     memcmp(rec->digest, dbin, MD5_DIGEST) == 0; rec++)
+    {
+	if ((match = index_name(idx, rec->file_id)) == NULL)
+	    continue;
+	fp = g_malloc0(sizeof(file_t));
+	fp->name = (char *)match;
+	fp->st_size = rec->size;
+	if (verify && !compare_files(&query, fp))
+	    g_free(fp);
+	else
+	    matches = g_list_append(matches, fp);
+    }
+    if ((found = matches != NULL))
+	list_files(&query, matches);
+    for (ptr = matches; ptr; ptr = ptr->next)
+	g_free(ptr->data);
+    g_list_free(matches);
+    return found;
+}
+
+/* Implements --lookup, looking up each of the files named in the index.
+ * Returns ANY_FOUND_STATUS if any of them has a copy in the index. */
+
+static int run_lookup(const char *fn, char **names, int verify)
+{
+    index_t   idx;
+    GChecksum *partial, *digest;
+    int	      res, found = 0, status = 0;
+
+    if (open_index(&idx, fn))
+	return 1;
+    partial = g_checksum_new(G_CHECKSUM_MD5);
+    digest = g_checksum_new(G_CHECKSUM_MD5);
+    for (; *names; names++)
+    {
+	if ((res = lookup_file(&idx, *names, partial, digest, verify)) < 0)
+	    status++;
+	else
+	    found += res;
+    }
+    g_checksum_free(partial);
+    g_checksum_free(digest);
+    munmap(idx.map, idx.len);
+    return found ? ANY_FOUND_STATUS : status ? 1 : 0;
+}
+
+/* Function called by g_tree_foreach when a file list is rebuilt to take
+ * the digest of each file unchanged since the previous scan from the
+ * file list of that scan, passed as udata. */
+
+static gboolean reuse_digest(gpointer key, gpointer value, gpointer udata)
+{
+    file_t *fp = value, *old;
+
+    if (fp->digest == NULL && (old = g_tree_lookup(udata, key)) &&
+	old->digest && old->st_size == fp->st_size &&
+	old->st_dev == fp->st_dev && old->st_ino == fp->st_ino &&
+	same_time(&old->st_mtim, &fp->st_mtim) &&
+	same_time(&old->st_ctim, &fp->st_ctim))
+	fp->digest = g_strdup(old->digest);
+    return FALSE;
+}
+
+/* Function called by g_tree_foreach to free each file in a list which
+ * is about to be destroyed. */
+
+static gboolean free_file(gpointer key, gpointer value, gpointer udata)
+{
+    file_t *fp = value;
+
+    g_free(fp->name);
+    g_free(fp->digest);
+    g_free(fp);
+    return FALSE;
+}
+
+/* Frees the list of directories seen by the last scan, before another
+ * scan in the same process. */
+
+static void free_cache_dirs(void)
+{
+    GList *ptr;
+
+    for (ptr = cache_dirs; ptr; ptr = ptr->next)
+    {
+	g_free(((cache_dir_t *)ptr->data)->name);
+	g_free(ptr->data);
+    }
+    g_list_free(cache_dirs);
+    cache_dirs = NULL;
+}
+
+/* Daemon mode.  The file list is built with phase one and every file is
+ * hashed with phase two, as usual, but instead of looking for duplicates
+ * the index by size and digest is kept in memory and queries are
+ * answered on a Unix socket until the daemon is killed.  Each query is
+ * a line and is answered with a line "OK n" followed by n lines, or a
+ * line "ERR message".  The queries are:
+ *
+ *   PATH name		  files with the same contents as the file name
+ *   DIGEST size digest	  files with the given size and MD5 digest
+ *   STATS		  counters, one "name value" per line
+ *   RESCAN		  rebuild the index, reusing unchanged digests
+ *   QUIT		  close the connection
+ *
+ * Names in replies are escaped as in the scan cache.  A batch of queries
+ * may be sent at once; they are answered in order, the replies being
+ * buffered and written as the client takes them.  A PATH query for a
+ * file whose size is not in the index is answered without reading the
+ * file.  SIGHUP also causes a rescan.  Rescans, and PATH queries which
+ * do read a file, run on threads of their own so the other clients are
+ * answered meanwhile, from the old index during a rescan, which is
+ * swapped for the new one once it is built; RESCAN is answered then. */
+
+/* An index of the daemon: the file list, the sizes in it, the files
+ * grouped by digest, the number of errors found building it and how
+ * long that took. */
+
+typedef struct
+{
+    GTree	   *file_tree;
+    GHashTable	   *sizes;
+    tree_foreach_t index;
+    int		   status;
+    double	   scan_secs;
+} daemon_index_t;
+
+/* State of daemon mode.  Queries are answered from the current index
+ * while the next one is built by the builder thread, if there is one.
+ * The threads write a pointer to the wake pipe when they are done, NULL
+ * for the builder, so the poll loop can pick up their results. */
+
+typedef struct
+{
+    char	   **names;
+    daemon_index_t cur;
+    daemon_index_t next;
+    GThread	   *builder;
+    int		   building;
+    int		   again;
+    int		   wake[2];
+    int		   nscan;
+    time_t	   started;
+    guint64	   queries;
+    guint64	   hits;
+} daemon_t;
+
+/* A PATH query for a file which has to be read, which is hashed on a
+ * thread of its own. */
+
+typedef struct
+{
+    GThread	*thread;
+    char	*name;
+    struct stat stbuf;
+    char	*digest;
+    int		err;
+    int		wake;
+} daemon_job_t;
+
+/* A connection to the daemon, with any queries read from it but not yet
+ * answered and any replies not yet written.  The queries are answered
+ * in order, so none is answered while the client waits for a PATH query
+ * being hashed or for the rescan it asked for to be done. */
+
+typedef struct
+{
+    int		 fd;
+    GString	 *in;
+    GString	 *out;
+    int		 eof;
+    int		 quit;
+    int		 wait_scan;
+    daemon_job_t *job;
+} client_t;
+
+/* The last signal received by the daemon. */
+
+static volatile sig_atomic_t daemon_signal;
+
+/* Signal handler for daemon mode. */
+
+static void daemon_sig(int sig)
+{
+    daemon_signal = sig;
+}
+
+/* Starts a thread for the daemon with the signals it handles blocked,
+ * so they interrupt the poll loop.  Returns NULL if it cannot. */
+
+static GThread *daemon_thread(const char *name, GThreadFunc func,
+			      gpointer data)
+{
+    sigset_t set, old;
+    GThread  *thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    thread = g_thread_try_new(name, func, data, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return thread;
+}
+
+/* Tells the poll loop that a thread is done by writing ptr to the wake
+ * pipe, unless there is none yet. */
+
+static void daemon_wake(int fd, gpointer ptr)
+{
+    if (fd >= 0 && write(fd, &ptr, sizeof(ptr)) != sizeof(ptr))
+	g_critical("unable to wake the daemon - %m");
+}
+
+/* Builds the daemon's next index with phases one and two, reusing the
+ * unchanged digests of the current one, which is only read.  Run by the
+ * builder thread other than for the first index. */
+
+static gpointer daemon_build(gpointer udata)
+{
+    daemon_t	    *dm = udata;
+    daemon_index_t  *ix = &dm->next;
+    struct timespec end;
+
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "building index");
+    clock_gettime(CLOCK_REALTIME, &scan_start);
+    free_cache_dirs();
+    ix->file_tree = g_tree_new((GCompareFunc)strcmp);
+    ix->status = walk_roots(ix->file_tree, NULL, NULL, dm->names, NULL);
+    if (dm->cur.file_tree)
+	g_tree_foreach(ix->file_tree, reuse_digest, dm->cur.file_tree);
+    ix->sizes = build_size_hash(ix->file_tree);
+    ix->index.hash = g_hash_table_new(g_str_hash, g_str_equal);
+    g_tree_foreach(ix->file_tree, file_foreach, &ix->index);
+    if (cache_file)
+	ix->status += save_cache(ix->file_tree, &scan_start);
+    clock_gettime(CLOCK_REALTIME, &end);
+    ix->scan_secs = (end.tv_sec - scan_start.tv_sec) +
+	(end.tv_nsec - scan_start.tv_nsec) / 1e9;
+    daemon_wake(dm->wake[1], NULL);
+    return NULL;
+}
+
+/* Replaces the current index with the one just built. */
+
+static void daemon_swap(daemon_t *dm)
+{
+    if (dm->cur.file_tree)
+    {
+	free_lists(dm->cur.sizes, 0);
+	free_lists(dm->cur.index.hash, 1);
+	g_tree_foreach(dm->cur.file_tree, free_file, NULL);
+	g_tree_destroy(dm->cur.file_tree);
+    }
+    dm->cur = dm->next;
+    memset(&dm->next, 0, sizeof(dm->next));
+    dm->nscan++;
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "index of %d files built in %.1fs",
+	      g_tree_nnodes(dm->cur.file_tree), dm->cur.scan_secs);
+}
 
-    status = 0;
-    name1 = file1->name;
-    if ((fd1 = open(name1, O_RDONLY)) != -1)
+/* Starts building a new index or, if one is being built already, makes
+ * sure another is built after it, as the one in progress may have missed
+ * the changes which prompted this one.  The index is built in the poll
+ * loop if a thread cannot be started, finishing as usual through the
+ * wake pipe. */
+
+static void daemon_rescan(daemon_t *dm)
+{
+    if (dm->building)
     {
-	name2 = file2->name;
-	if ((fd2 = open(name2, O_RDONLY)) != -1)
+	dm->again = 1;
+	return;
+    }
+    dm->building = 1;
+    if ((dm->builder = daemon_thread("builder", daemon_build, dm)) == NULL)
+	daemon_build(dm);
+}
+
+/* Adds the files with the given size and digest to a reply, less any
+ * which is the same inode as the file queried, if there was one. */
+
+static void daemon_matches(daemon_t *dm, GString *reply, off_t size,
+			   const char *digest, const struct stat *stbuf)
+{
+    file_list_t *file_list;
+    GList	*ptr, *names = NULL;
+    file_t	*fp;
+    char	*esc;
+    int		n = 0;
+
+    if ((file_list = g_hash_table_lookup(dm->cur.index.hash, digest)))
+    {
+	for (ptr = file_list->files; ptr; ptr = ptr->next)
+	{
+	    fp = ptr->data;
+	    if (fp->st_size != size || (stbuf && fp->st_dev == stbuf->st_dev &&
+					fp->st_ino == stbuf->st_ino))
+		continue;
+	    names = g_list_prepend(names, fp->name);
+	    n++;
+	}
+    }
+    g_string_append_printf(reply, "OK %d\n", n);
+    names = g_list_reverse(names);
+    for (ptr = names; ptr; ptr = ptr->next)
+    {
+	esc = g_strescape(ptr->data, NULL);
+	g_string_append(reply, esc);
+	g_string_append_c(reply, '\n');
+	g_free(esc);
+    }
+    g_list_free(names);
+    if (n)
+	dm->hits++;
+}
+
+/* Hashes the file of a PATH query, on the job's own thread unless one
+ * could not be started. */
+
+static gpointer daemon_hash(gpointer udata)
+{
+    daemon_job_t  *job = udata;
+    GChecksum	  *sum = g_checksum_new(G_CHECKSUM_MD5);
+    int		  fd;
+    ssize_t	  nbytes;
+    unsigned char buf[CHUNK_SIZE];
+
+    if ((fd = open(job->name, O_RDONLY)) < 0)
+	job->err = errno;
+    else
+    {
+	while ((nbytes = read(fd, buf, sizeof(buf))) > 0)
+	    g_checksum_update(sum, buf, nbytes);
+	if (nbytes < 0)
+	    job->err = errno;
+	else
+	    job->digest = g_strdup(g_checksum_get_string(sum));
+	close(fd);
+    }
+    g_checksum_free(sum);
+    daemon_wake(job->wake, job);
+    return NULL;
+}
+
+/* Answers a PATH query.  The file is only read if its size is in the
+ * index and it is not a file in the index unchanged since it was
+ * hashed, in which case it is handed to a job and the reply waits until
+ * the job is done. */
+
+static void daemon_by_path(daemon_t *dm, client_t *cl, const char *name)
+{
+    struct stat	 stbuf;
+    file_t	 *fp;
+    daemon_job_t *job;
+
+    if (stat_func(name, &stbuf) != 0)
+    {
+	g_string_append_printf(cl->out, "ERR %s\n", g_strerror(errno));
+	return;
+    }
+    if (!S_ISREG(stbuf.st_mode))
+    {
+	g_string_append(cl->out, "ERR not a regular file\n");
+	return;
+    }
+    if (!g_hash_table_lookup(dm->cur.sizes, &stbuf.st_size))
+    {
+	g_string_append(cl->out, "OK 0\n");
+	return;
+    }
+    if ((fp = g_tree_lookup(dm->cur.file_tree, name)) && fp->digest &&
+	same_file(fp, &stbuf))
+    {
+	daemon_matches(dm, cl->out, stbuf.st_size, fp->digest, &stbuf);
+	return;
+    }
+    job = g_malloc0(sizeof(daemon_job_t));
+    job->name = g_strdup(name);
+    job->stbuf = stbuf;
+    job->wake = dm->wake[1];
+    cl->job = job;
+    if ((job->thread = daemon_thread("path", daemon_hash, job)) == NULL)
+	daemon_hash(job);
+}
+
+/* Answers one query, adding the answer to the client's replies, unless
+ * it has to wait for a job or a rescan. */
+
+static void daemon_query(daemon_t *dm, client_t *cl, char *line)
+{
+    char   *arg, *end, *digest;
+    off_t  size;
+    time_t now;
+
+    dm->queries++;
+    if ((arg = strchr(line, ' ')))
+	*arg++ = '\0';
+    if (!strcmp(line, "PATH") && arg)
+	daemon_by_path(dm, cl, arg);
+    else if (!strcmp(line, "DIGEST") && arg)
+    {
+	size = g_ascii_strtoll(arg, &end, 10);
+	if (end == arg || *end != ' ' || strlen(end + 1) != 32)
+	    g_string_append(cl->out, "ERR bad DIGEST query\n");
+	else
+	{
+	    digest = g_ascii_strdown(end + 1, -1);
+	    daemon_matches(dm, cl->out, size, digest, NULL);
+	    g_free(digest);
+	}
+    }
+    else if (!strcmp(line, "STATS"))
+    {
+	now = time(NULL);
+	g_string_append_printf(cl->out, "OK 9\nfiles %d\nsizes %u\n"
+			       "digests %u\nscans %d\nscan-seconds %.3f\n"
+			       "errors %d\nqueries %" G_GUINT64_FORMAT "\n"
+			       "hits %" G_GUINT64_FORMAT "\nuptime %ld\n",
+			       g_tree_nnodes(dm->cur.file_tree),
+			       g_hash_table_size(dm->cur.sizes),
+			       g_hash_table_size(dm->cur.index.hash),
+			       dm->nscan, dm->cur.scan_secs, dm->cur.status,
+			       dm->queries, dm->hits,
+			       (long)(now - dm->started));
+    }
+    else if (!strcmp(line, "RESCAN"))
+    {
+	daemon_rescan(dm);
+	cl->wait_scan = dm->nscan + (dm->again ? 2 : 1);
+    }
+    else if (!strcmp(line, "QUIT"))
+	cl->quit = 1;
+    else
+	g_string_append(cl->out, "ERR unknown query\n");
+}
+
+/* Answers each complete query read from a client, stopping at one which
+ * has to wait. */
+
+static void daemon_serve(daemon_t *dm, client_t *cl)
+{
+    char *line, *end;
+
+    for (line = cl->in->str; !cl->quit && !cl->job && !cl->wait_scan;
+	 line = end + 1)
+    {
+	if ((end = memchr(line, '\n', cl->in->str + cl->in->len - line)) == NULL)
+	    break;
+	*end = '\0';
+	if (end > line && end[-1] == '\r')
+	    end[-1] = '\0';
+	daemon_query(dm, cl, line);
+    }
+    g_string_erase(cl->in, 0, line - cl->in->str);
+}
+
+/* Handles a pointer read from the wake pipe: the builder is done if it
+ * is NULL, otherwise the job it points to is.  The job's client, if it
+ * is still connected, gets its reply. */
+
+static void daemon_done(daemon_t *dm, GPtrArray *clients, daemon_job_t *job)
+{
+    client_t *cl;
+    guint    i;
+
+    if (job == NULL)
+    {
+	if (dm->builder)
+	    g_thread_join(dm->builder);
+	dm->builder = NULL;
+	dm->building = 0;
+	daemon_swap(dm);
+	if (dm->again)
 	{
-	    do
+	    dm->again = 0;
+	    daemon_rescan(dm);
+	}
+	for (i = 0; i < clients->len; i++)
+	{
+	    cl = clients->pdata[i];
+	    if (cl->wait_scan && cl->wait_scan <= dm->nscan)
 	    {
-		if ((nb1 = read(fd1, buf1, sizeof(buf1))) == -1)
-		{
-		    g_critical("read error on file '%s' - %m", name1);
-		    break;
-		}
-		if ((nb2 = read(fd2, buf2, sizeof(buf2))) == -1)
-		{
-		    g_critical("read error on file '%s' - %m", name2);
-		    break;
-		}
-		if (nb1 == 0 && nb2 == 0)
-		{
-		    status = 1;
-		    break;
-		}
+		g_string_append(cl->out, "OK 0\n");
+		cl->wait_scan = 0;
 	    }
-	    while (nb1 == nb2 && memcmp(buf1, buf2, nb1) == 0);
-	    close(fd2);
 	}
+	return;
+    }
+    if (job->thread)
+	g_thread_join(job->thread);
+    for (i = 0; i < clients->len; i++)
+    {
+	cl = clients->pdata[i];
+	if (cl->job != job)
+	    continue;
+	if (job->err)
+	    g_string_append_printf(cl->out, "ERR %s\n", g_strerror(job->err));
 	else
-	    g_critical("unable to open file '%s' for reading - %m", name2);
-	close(fd1);
+	    daemon_matches(dm, cl->out, job->stbuf.st_size, job->digest,
+			   &job->stbuf);
+	cl->job = NULL;
     }
-    else
-	g_critical("unable to open file '%s' for reading - %m", name1);
-    return status;
+    g_free(job->name);
+    g_free(job->digest);
+    g_free(job);
 }
 
-/* Function used during phase three.  This function makes the second file,
- * called the slave, a hard link to the first, called the master. */
+/* Reads whatever is waiting from a client, answers what it can and
+ * writes as much of the replies as the socket will take.  Returns 1 if
+ * the connection should be closed, which once the client has finished
+ * sending is only when every query has been answered, or if it sends a
+ * line longer than FRAME_MAX. */
 
-static void link_pair(file_t *master, file_t *slave)
+static int daemon_client(daemon_t *dm, client_t *cl, int readable)
 {
-    if (unlink(slave->name) == 0)
+    char    buf[CHUNK_SIZE];
+    char    *end;
+    ssize_t nbytes;
+
+    if (readable)
     {
-	if (link(master->name, slave->name) == -1)
-	    g_warning("unable to link '%s' to '%s' - %m",
-		      master->name, slave->name);
+	if ((nbytes = read(cl->fd, buf, sizeof(buf))) > 0)
+	    g_string_append_len(cl->in, buf, nbytes);
+	else if (nbytes == 0)
+	    cl->eof = 1;
+	else if (errno != EAGAIN && errno != EINTR)
+	    return 1;
     }
-    else
-	g_warning("unable to unlink '%s' - %m", slave->name);
+    daemon_serve(dm, cl);
+    if (cl->out->len)
+    {
+	if ((nbytes = write(cl->fd, cl->out->str, cl->out->len)) > 0)
+	    g_string_erase(cl->out, 0, nbytes);
+	else if (nbytes < 0 && errno != EAGAIN && errno != EINTR)
+	    return 1;
+    }
+    end = memrchr(cl->in->str, '\n', cl->in->len);
+    if (cl->in->len - (end ? end + 1 - cl->in->str : 0) > FRAME_MAX)
+	return 1;
+    return (cl->quit || cl->eof) && !cl->job && !cl->wait_scan &&
+	cl->out->len == 0;
 }
 
-/* Function used during phase three to implement the interactive deletion
- * of some files from a group known to have the same contents. */
+/* Implements daemon mode.  Returns the number of errors. */
 
-static void delete_files(const char *digest, file_t *master, GList *list)
+static int run_daemon(const char *path, char **names)
 {
-    GList      *delete_list;
-    GList      *ptr;
-    delete_t   *elem;
-    int	       print_list;
-    int	       i;
-    char       buf[20];
-    const char *name;
+    daemon_t	       dm;
+    struct sockaddr_un addr;
+    GPtrArray	       *clients;
+    client_t	       *cl;
+    struct pollfd      *pfds = NULL;
+    gpointer	       job;
+    int		       lfd, fd, status = 0;
+    guint	       i;
 
-    elem = g_malloc(sizeof(delete_t));
-    elem->file = master;
-    elem->keep = 1;
-    delete_list = g_list_append(NULL, elem);
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+	g_critical("socket name '%s' is too long", path);
+	return 1;
+    }
+    memset(&dm, 0, sizeof(dm));
+    dm.names = names;
+    dm.started = time(NULL);
+    dm.wake[0] = dm.wake[1] = -1;
+    keep_digests = 1;
+    if (cache_file && !(options & OPT_FULLSCAN))
+	scan_cache = load_cache(cache_file);
+    daemon_build(&dm);
+    daemon_swap(&dm);
+    scan_cache = NULL;
 
-    for (ptr = list; ptr; ptr = ptr->next)
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (pipe(dm.wake) != 0 || (lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
     {
-	elem = g_malloc(sizeof(delete_t));
-	elem->file = ptr->data;
-	elem->keep = 0;
-	delete_list = g_list_append(delete_list, elem);
+	g_critical("unable to create socket - %m");
+	return 1;
+    }
+    fcntl(dm.wake[0], F_SETFL, O_NONBLOCK);
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	listen(lfd, 16) != 0)
+    {
+	g_critical("unable to listen on '%s' - %m", path);
+	close(lfd);
+	return 1;
     }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, daemon_sig);
+    signal(SIGINT, daemon_sig);
+    signal(SIGHUP, daemon_sig);
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "listening on '%s'", path);
 
-    for (print_list = 1; ;)
+    clients = g_ptr_array_new();
+    while (daemon_signal != SIGTERM && daemon_signal != SIGINT)
     {
-	if (print_list)
+	if (daemon_signal == SIGHUP)
 	{
-	    printf("\nDisposition of files with digest %s\n\n", digest);
-	    i = 1;
-	    for (ptr = delete_list; ptr; ptr = ptr->next)
+	    daemon_signal = 0;
+	    daemon_rescan(&dm);
+	}
+
+	/* A client is only read from while it is not waiting on a job or
+	 * rescan and its replies are not backed up, so what it sends in
+	 * the meantime stays in the socket, and it is left out of the poll
+	 * altogether while there is nothing to do for it but wait. */
+
+	pfds = g_renew(struct pollfd, pfds, clients->len + 2);
+	pfds[0].fd = lfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = dm.wake[0];
+	pfds[1].events = POLLIN;
+	for (i = 0; i < clients->len; i++)
+	{
+	    cl = clients->pdata[i];
+	    pfds[i+2].events = 0;
+	    if (!cl->eof && !cl->quit && !cl->job && !cl->wait_scan &&
+		cl->out->len < FRAME_MAX)
+		pfds[i+2].events |= POLLIN;
+	    if (cl->out->len)
+		pfds[i+2].events |= POLLOUT;
+	    pfds[i+2].fd = pfds[i+2].events ? cl->fd : -1;
+	}
+	if (poll(pfds, clients->len + 2, -1) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    g_critical("poll failed - %m");
+	    status = 1;
+	    break;
+	}
+	if (pfds[1].revents & POLLIN)
+	    while (read(dm.wake[0], &job, sizeof(job)) == sizeof(job))
+		daemon_done(&dm, clients, job);
+
+	/* Every client is visited, as one may be able to carry on after a
+	 * job or rescan is done, last first so a closed one can be
+	 * replaced by the last in the array. */
+
+	for (i = clients->len; i-- > 0;)
+	{
+	    cl = clients->pdata[i];
+	    if (daemon_client(&dm, cl, pfds[i+2].revents != 0 &&
+			      (pfds[i+2].events & POLLIN)))
 	    {
-		elem = ptr->data;
-		printf("%5d %c %s (%ld links)\n",
-		       i++, elem->keep ? '*' : ' ',
-                       elem->file->name, elem->file->st_nlink);
+		close(cl->fd);
+		g_string_free(cl->in, TRUE);
+		g_string_free(cl->out, TRUE);
+		g_free(cl);
+		g_ptr_array_remove_index_fast(clients, i);
 	    }
-	    fputs("\nFiles marked (*) will be kept - these reset deleted\n"
-		  "To toggle a file's status type its number\n"
-		  "Type 'go' to go ahead with the delete\n", stdout);
-	    print_list = 0;
 	}
-	fputs("\n> ", stdout);
-	if (fgets(buf, sizeof(buf), stdin) == NULL)
+	if ((pfds[0].revents & POLLIN) && (fd = accept(lfd, NULL, NULL)) >= 0)
 	{
-	    fputs("*** EOF *** no action taken\n", stdout);
+	    fcntl(fd, F_SETFL, O_NONBLOCK);
+	    cl = g_malloc0(sizeof(client_t));
+	    cl->fd = fd;
+	    cl->in = g_string_new(NULL);
+	    cl->out = g_string_new(NULL);
+	    g_ptr_array_add(clients, cl);
+	}
+    }
+    for (i = 0; i < clients->len; i++)
+	close(((client_t *)clients->pdata[i])->fd);
+    close(lfd);
+    unlink(path);
+    g_free(pfds);
+    return status;
+}
+
+/* Sharded mode.  The coordinator forks the workers before phase one and
+ * sends each file found to the worker owning its size over a pipe.
+ * When phase one is complete each worker runs phases two and three on
+ * its own files with its standard output on a second pipe, and the
+ * coordinator copies complete sets of duplicates from those pipes to
+ * its own standard output as they arrive. */
+
+/* Works out which shard a file size belongs to. */
+
+static int shard_of(off_t size)
+{
+    guint64 h = (guint64)size * 0x9e3779b97f4a7c15ULL;
+
+    return (h >> 32) % shards.n;
+}
+
+/* Sends a file to the worker owning its size. */
+
+static void shard_send(const char *name, const file_t *fp)
+{
+    shard_rec_t rec;
+    FILE	*out = shards.in[shard_of(fp->st_size)];
+
+    rec.size = fp->st_size;
+    rec.dev = fp->st_dev;
+    rec.ino = fp->st_ino;
+    rec.nlink = fp->st_nlink;
+    rec.mode = fp->st_mode;
+    rec.root = fp->root;
+    rec.flags = fp->flags;
+    rec.name_len = strlen(name);
+    rec.digest_len = fp->digest ? strlen(fp->digest) : 0;
+    if (fwrite(&rec, sizeof(rec), 1, out) != 1 ||
+	fwrite(name, 1, rec.name_len, out) != rec.name_len ||
+	fwrite(fp->digest, 1, rec.digest_len, out) != rec.digest_len)
+    {
+	g_critical("unable to send file to worker - %m");
+	exit(1);
+    }
+}
+
+/* Function called during phase one in sharded mode in place of
+ * add_file. */
+
+static void shard_file(GTree *file_tree, const char *name, struct stat *stbuf)
+{
+    file_t file;
+
+    file.st_size = stbuf->st_size;
+    file.st_dev = stbuf->st_dev;
+    file.st_ino = stbuf->st_ino;
+    file.st_nlink = stbuf->st_nlink;
+    file.st_mode = stbuf->st_mode;
+    file.root = cur_root;
+    file.flags = root_flags;
+    file.digest = NULL;
+    shard_send(name, &file);
+}
+
+/* Function called by g_tree_foreach in sharded mode to send the files
+ * the coordinator has in its own list, from saved reference sets, to
+ * the workers. */
+
+static gboolean shard_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    shard_send(key, value);
+    return FALSE;
+}
+
+/* The body of a worker process.  Reads the files for its shard from
+ * in_fd then checks them with its standard output going to out_fd. */
+
+static int shard_worker(int in_fd, int out_fd, int have_refs)
+{
+    FILE	*in;
+    GTree	*file_tree;
+    shard_rec_t rec;
+    file_t	*fp;
+
+    in = fdopen(in_fd, "r");
+    file_tree = g_tree_new((GCompareFunc)strcmp);
+    while (fread(&rec, sizeof(rec), 1, in) == 1)
+    {
+	fp = g_malloc0(sizeof(file_t));
+	fp->name = g_malloc(rec.name_len + 1);
+	fp->st_size = rec.size;
+	fp->st_dev = rec.dev;
+	fp->st_ino = rec.ino;
+	fp->st_nlink = rec.nlink;
+	fp->st_mode = rec.mode;
+	fp->root = rec.root;
+	fp->flags = rec.flags;
+	if (fread(fp->name, 1, rec.name_len, in) != rec.name_len)
 	    break;
+	fp->name[rec.name_len] = '\0';
+	if (rec.digest_len)
+	{
+	    fp->digest = g_malloc(rec.digest_len + 1);
+	    if (fread(fp->digest, 1, rec.digest_len, in) != rec.digest_len)
+		break;
+	    fp->digest[rec.digest_len] = '\0';
 	}
-	if (strncmp(buf, "go", 2) == 0)
+	if (g_tree_lookup(file_tree, fp->name))
 	{
-	    for (ptr = delete_list; ptr; ptr = ptr->next)
+	    if (!(options & OPT_QUIET))
+		g_warning("filename '%s' alreday seen", fp->name);
+	}
+	else
+	    g_tree_insert(file_tree, fp->name, fp);
+    }
+    fclose(in);
+    dup2(out_fd, STDOUT_FILENO);
+    close(out_fd);
+    return check_files(file_tree, have_refs, 0);
+}
+
+/* Forks the workers for sharded mode.  Returns 0 on success. */
+
+static int shards_start(int have_refs)
+{
+    int	  i, j;
+    int	  in[2], out[2];
+    pid_t pid;
+
+    shards.in = g_malloc(shards.n * sizeof(FILE *));
+    shards.out = g_malloc(shards.n * sizeof(int));
+    shards.pid = g_malloc(shards.n * sizeof(pid_t));
+    fflush(stdout);
+    for (i = 0; i < shards.n; i++)
+    {
+	if (pipe(in) == -1 || pipe(out) == -1)
+	{
+	    g_critical("unable to create pipe - %m");
+	    return 1;
+	}
+	if ((pid = fork()) == -1)
+	{
+	    g_critical("unable to fork worker - %m");
+	    return 1;
+	}
+	if (pid == 0)
+	{
+	    for (j = 0; j < i; j++)
 	    {
-		elem = ptr->data;
-		if (elem->keep == 0)
-		{
-		    name = elem->file->name;
-		    if (unlink(name) == 0)
-			printf("%s deleted\n", name);
-		    else
-			g_warning("unable to delete '%s' - %m", name);
-		}
+		fclose(shards.in[j]);
+		close(shards.out[j]);
 	    }
+	    close(in[1]);
+	    close(out[0]);
+	    exit(shard_worker(in[0], out[1], have_refs));
+	}
+	close(in[0]);
+	close(out[1]);
+	shards.in[i] = fdopen(in[1], "w");
+	shards.out[i] = out[0];
+	shards.pid[i] = pid;
+    }
+    add_func = shard_file;
+    return 0;
+}
+
+/* Returns the length of the part of a worker's output which consists of
+ * complete sets of duplicates, each ending in an empty line or, when
+ * listed on one line each, a newline. */
+
+static gsize shard_complete(GString *str)
+{
+    gsize len = str->len;
+    int	  one_line = options & (OPT_SAMELINE|OPT_MISSING);
+
+    while (len > 0)
+    {
+	if (str->str[len-1] == '\n' &&
+	    (one_line || (len > 1 && str->str[len-2] == '\n')))
+	    return len;
+	len--;
+    }
+    return 0;
+}
+
+/* Waits for the workers to finish, copying their output to standard
+ * output, and returns the combined exit status.  In --any mode the
+ * other workers are stopped as soon as one reports a duplicate. */
+
+static int shards_finish(int status)
+{
+    struct pollfd *pfds;
+    GString	  **bufs;
+    char	  buf[CHUNK_SIZE];
+    ssize_t	  nbytes;
+    gsize	  len;
+    int		  i, j, nopen, wstatus, found = 0;
+
+    for (i = 0; i < shards.n; i++)
+	if (fclose(shards.in[i]) != 0)
+	{
+	    g_critical("unable to send files to worker - %m");
+	    status++;
+	}
+    pfds = g_malloc(shards.n * sizeof(struct pollfd));
+    bufs = g_malloc(shards.n * sizeof(GString *));
+    for (i = 0; i < shards.n; i++)
+    {
+	pfds[i].fd = shards.out[i];
+	pfds[i].events = POLLIN;
+	bufs[i] = g_string_new(NULL);
+    }
+    for (nopen = shards.n; nopen > 0; )
+    {
+	if (poll(pfds, shards.n, -1) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+	    g_critical("poll failed - %m");
 	    break;
 	}
-	if ((i = atoi(buf)) > 0)
+	for (i = 0; i < shards.n; i++)
 	{
-	    if ((elem = g_list_nth_data(delete_list, i - 1)))
+	    if (pfds[i].fd < 0 || pfds[i].revents == 0)
+		continue;
+	    if ((nbytes = read(pfds[i].fd, buf, sizeof(buf))) > 0)
 	    {
-		elem->keep = 1 - elem->keep;
-		print_list = 1;
+		g_string_append_len(bufs[i], buf, nbytes);
+		len = shard_complete(bufs[i]);
+	    }
+	    else
+	    {
+		close(pfds[i].fd);
+		pfds[i].fd = -1;
+		nopen--;
+		len = bufs[i]->len;
+	    }
+	    if (len > 0)
+	    {
+		fwrite(bufs[i]->str, 1, len, stdout);
+		fflush(stdout);
+		g_string_erase(bufs[i], 0, len);
+		if ((options & OPT_ANY) && !found)
+		{
+		    found = 1;
+		    for (j = 0; j < shards.n; j++)
+			if (j != i)
+			    kill(shards.pid[j], SIGTERM);
+		}
 	    }
+	}
+    }
+    for (i = 0; i < shards.n; i++)
+    {
+	if (waitpid(shards.pid[i], &wstatus, 0) == -1)
+	    status++;
+	else if (WIFEXITED(wstatus))
+	{
+	    if (WEXITSTATUS(wstatus) == ANY_FOUND_STATUS && (options & OPT_ANY))
+		found = 1;
 	    else
-		printf("no file number %d\n", i);
+		status += WEXITSTATUS(wstatus);
 	}
-	else
-	    fputs("invalid input - please type a number or 'go'\n", stdout);
+	else if (!found)
+	    status++;
+	g_string_free(bufs[i], TRUE);
     }
-    for (ptr = delete_list; ptr; ptr = ptr->next)
-	g_free(ptr->data);
-    g_list_free(delete_list);
+    g_free(pfds);
+    g_free(bufs);
+    if (options & OPT_ANY)
+	return found ? ANY_FOUND_STATUS : status ? 1 : 0;
+    return status;
 }
 
-/* Function used during phase three to list a single group of files
- * known to have the same contents. */
+/* The library interface, see dupfind.h.  A run is the plain search of
+ * the command, phases one to three, with the sets of duplicates passed
+ * to the group callback instead of being listed. */
 
-static void list_files(file_t *master, GList *list)
+/* The command line options corresponding to the library flags. */
+
+static const struct
 {
-    int fs = (options & OPT_SAMELINE) ? ' ' : '\n';
-    file_t *fp;
+    unsigned int  flag;
+    unsigned long option;
+} lib_flags[] =
+{
+    { DUPFIND_RECURSE,	   OPT_RECURSE	 },
+    { DUPFIND_SYMLINKS,	   OPT_SYMLINKS	 },
+    { DUPFIND_HARDLINKS,   OPT_HARDLINKS },
+    { DUPFIND_NOEMPTY,	   OPT_NOEMPTY	 },
+    { DUPFIND_CROSS_ROOTS, OPT_CROSS	 },
+    { DUPFIND_LINK,	   OPT_LINK	 },
+    { DUPFIND_FULL_SCAN,   OPT_FULLSCAN	 },
+    { DUPFIND_QUIET,	   OPT_QUIET	 }
+};
 
-    if (!(options & OPT_OMITFIRST))
+/* Creates a scan with the given options. */
+
+dupfind_t *dupfind_new(const dupfind_options_t *opts)
+{
+    dupfind_t *df;
+    int	      i;
+
+    if (progname == NULL)
+	progname = "libdupfind";
+    df = g_malloc0(sizeof(dupfind_t));
+    for (i = 0; i < G_N_ELEMENTS(lib_flags); i++)
+	if (opts->flags & lib_flags[i].flag)
+	    df->options |= lib_flags[i].option;
+    df->cache_file = opts->cache_file;
+    df->results_file = opts->results_file;
+    df->group = opts->group;
+    df->progress = opts->progress;
+    df->udata = opts->udata;
+    df->names = g_ptr_array_new();
+    return df;
+}
+
+/* Adds a file or directory to be searched by each run of a scan.  Each
+ * one added is a root for the purposes of DUPFIND_CROSS_ROOTS. */
+
+void dupfind_add(dupfind_t *df, const char *name)
+{
+    g_ptr_array_add(df->names, g_strdup(name));
+}
+
+/* Runs a scan.  The file list is rebuilt and the digests of files
+ * unchanged since the previous run of the same scan are reused.
+ * Returns the number of errors or DUPFIND_CANCELLED. */
+
+int dupfind_run(dupfind_t *df)
+{
+    GTree	   *old = df->file_tree;
+    tree_foreach_t fdata;
+    guint	   i;
+    int		   status = 0;
+
+    options = df->options;
+    stat_func = (options & OPT_SYMLINKS) ? stat : lstat;
+    cache_file = df->cache_file;
+    keep_digests = cache_file || df->results_file || !df->single_run;
+    add_func = add_file;
+    lib_scan = df;
+    df->cancel = 0;
+
+    /* Phase one - build the file list */
+
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "building file list");
+    clock_gettime(CLOCK_REALTIME, &scan_start);
+    free_cache_dirs();
+    if (cache_file && df->nrun == 0 && !(options & OPT_FULLSCAN))
+	scan_cache = load_cache(cache_file);
+    df->file_tree = g_tree_new((GCompareFunc)strcmp);
+    df->done = df->total = 0;
+    root_flags = 0;
+    for (i = 0; i < df->names->len && !df->cancel; i++)
     {
-	if (options & OPT_SHOWSIZE)
-	    printf("%s (%ld)%c", master->name, master->st_size, fs);
-	else
-	    printf("%s%c", master->name, fs);
+	cur_root = i;
+	status += do_fsobj(df->file_tree, df->names->pdata[i]);
     }
-    while (list)
+    scan_cache = NULL;
+    if (old)
     {
-	fp = list->data;
-	if (options & OPT_SHOWSIZE)
-	    printf("%s (%ld)%c", fp->name, fp->st_size, fs);
+	g_tree_foreach(df->file_tree, reuse_digest, old);
+	g_tree_foreach(old, free_file, NULL);
+	g_tree_destroy(old);
+    }
+    df->nrun++;
+
+    /* Phase two - group files by message digest */
+
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "calculating digests");
+    df->done = 0;
+    df->total = g_tree_nnodes(df->file_tree);
+    fdata.hash = g_hash_table_new(g_str_hash, g_str_equal);
+    fdata.digest = g_checksum_new(G_CHECKSUM_MD5);
+    if (!df->cancel)
+    {
+	if (options & OPT_CROSS)
+	    hash_cross_roots(df->file_tree, &fdata);
+	else if (digest_mode == DIGEST_AUTO || hash_func == hash_multi)
+	    hash_by_size(df->file_tree, &fdata);
+	else if (hot_first)
+	    hash_hot_first(df->file_tree, &fdata);
+	else if (prefetch_files || throttle_rate)
+	    hash_in_order(df->file_tree, &fdata);
 	else
-	    printf("%s%c", fp->name, fs);
-	list = list->next;
+	    g_tree_foreach(df->file_tree, file_foreach, &fdata);
     }
-    fputc('\n', stdout);
+
+    /* Phase three - check for exact match and carry out actions */
+
+    if (options & OPT_VERBOSE)
+	g_log(NULL, G_LOG_LEVEL_INFO, "performing required actions");
+    report_known();
+    report_pkg();
+    df->done = 0;
+    df->total = g_hash_table_size(fdata.hash);
+    if (!df->cancel)
+	check_groups(fdata.hash);
+    report_cache();
+    free_lists(fdata.hash, 1);
+    g_checksum_free(fdata.digest);
+    if (cache_file && !df->cancel)
+	status += save_cache(df->file_tree, &scan_start);
+    if (df->results_file && !df->cancel)
+	status += save_results(df->file_tree, df->results_file);
+    lib_scan = NULL;
+    return df->cancel ? DUPFIND_CANCELLED : status;
 }
 
-/* Function called during phase two by g_hash_table_foreach for each
- * group of files having the same message digest.  This function checks
- * if the files are really the same and calls the appropriate action
- * function depending on what was specified on the command line. */
+/* Asks a run in progress to stop as soon as possible. */
 
-static void digest_foreach(gpointer key, gpointer value, gpointer udata)
+void dupfind_cancel(dupfind_t *df)
 {
-    file_list_t *file_list = value;
-    GList	*search_list, *good_list, *bad_list;
-    int		good_count;
-    file_t	*master;
+    df->cancel = 1;
+}
 
-    if (file_list->nfile > 1)
+/* Frees a scan and everything it holds. */
+
+void dupfind_free(dupfind_t *df)
+{
+    guint i;
+
+    if (df->file_tree)
     {
-	search_list = g_list_sort(file_list->files, sort_compare);
-	if (!(options & OPT_HARDLINKS))
-	    search_list = filter_links(search_list);
-	while (search_list)
-	{
-	    good_list = bad_list = NULL;
-	    good_count = 0;
-	    master = search_list->data;
-	    while ((search_list = search_list->next))
-	    {
-		if (compare_files(master, search_list->data))
-		{
-		    if (options & OPT_LINK)
-			link_pair(master, search_list->data);
-		    else
-		    {
-			good_list = g_list_append(good_list,search_list->data);
-			good_count++;
-		    }
-		}
-		else
-		    bad_list = g_list_append(bad_list, search_list->data);
-	    }
-	    if (good_count > 0)
-	    {
-		if (options & OPT_DELETE)
-		    delete_files(key, master, good_list);
-		else
-		    list_files(master, good_list);
-		g_list_free(good_list);
-	    }
-	    g_list_free(search_list);
-	    search_list = bad_list;
-	}
+	g_tree_foreach(df->file_tree, free_file, NULL);
+	g_tree_destroy(df->file_tree);
     }
+    for (i = 0; i < df->names->len; i++)
+	g_free(df->names->pdata[i]);
+    g_ptr_array_free(df->names, TRUE);
+    if (lib_scan == df)
+	lib_scan = NULL;
+    g_free(df);
 }
 
 static const char help_text[] =
@@ -570,17 +7331,156 @@ static const char help_text[] =
     "			filenames hard links to the same disk storage\n"
     "  -i -- stdin	read file names from stdin as well as processing\n"
     "			any specified on the command line\n"
+    "  -a --any	stop at the first set of duplicates found, list it\n"
+    "			and exit with status 2 (errors give status 1)\n"
+    "  -c --cache FILE	keep a scan cache in FILE; on later runs the files\n"
+    "			in directories unchanged since then are taken from\n"
+    "			the cache and files whose size, times and inode\n"
+    "			are unchanged are not re-hashed\n"
+    "  -F --full-scan	stat every file even if a scan cache is in use, eg.\n"
+    "			after files have been modified in place\n"
+    "  -R --reference DIR	scan DIR as a reference root - only files outside\n"
+    "			the reference roots which duplicate a file inside\n"
+    "			them are listed or acted upon, after the reference\n"
+    "			file they duplicate\n"
+    "     --save-reference FILE\n"
+    "			save the sizes and digests of the reference files\n"
+    "     --load-reference FILE\n"
+    "			use a saved reference set as well as, or instead\n"
+    "			of, reference roots - not with --delete as its\n"
+    "			files cannot be compared\n"
+    "  -M --missing-from DIR	list the files which have no identical copy under\n"
+    "			DIR instead of listing duplicates; may be repeated\n"
+    "			and combined with --load-reference\n"
+    "  -x --cross-roots	only list or act upon sets of duplicates which span\n"
+    "			more than one of the files/directories given; files\n"
+    "			read from stdin count as one more\n"
+    "     --memory-limit SIZE\n"
+    "			keep the file list on disk rather than in memory,\n"
+    "			using about SIZE bytes (suffix K, M or G allowed)\n"
+    "			for buffers; for more files than fit in memory\n"
+    "     --scratch DIR	directory for the on-disk file list (default $TMPDIR)\n"
+    "  -2 --two-pass	scan twice, first counting file sizes and then only\n"
+    "			keeping files whose size was seen more than once,\n"
+    "			to save memory when most sizes are unique\n"
+    "     --shards N	split the work by file size between N worker\n"
+    "			processes, each checking its own share\n"
+    "     --export FILE	instead of looking for duplicates write the size,\n"
+    "			digests and name of every file to FILE, which is\n"
+    "			compressed with gzip, to be used with --merge\n"
+    "     --node NAME	name of this machine in exported signatures\n"
+    "			(default the host name)\n"
+    "     --merge	merge the signature files named instead of files to\n"
+    "			search and list the sets of duplicates which come\n"
+    "			from more than one of them\n"
+    "     --agent [HOST:]PORT\n"
+    "			after scanning take part in a multi-machine search\n"
+    "			run by the aggregator at HOST:PORT\n"
+    "     --aggregate [HOST:]PORT\n"
+    "			instead of scanning wait for agents to connect on\n"
+    "			PORT and list the duplicates which span machines\n"
+    "     --agents N	number of agents the aggregator waits for\n"
+    "     --checkpoint FILE\n"
+    "			save the progress of hashing large files in FILE\n"
+    "			so an interrupted run can carry on where it left\n"
+    "			off with files which have not changed\n"
+    "     --checkpoint-every SIZE\n"
+    "			amount of data hashed between checkpoints, also the\n"
+    "			smallest file checkpointed (default 1G)\n"
+    "     --daemon SOCKET	build the index of sizes and digests then answer\n"
+    "			queries on the Unix socket SOCKET until killed\n"
+    "     --build-index FILE\n"
+    "			instead of looking for duplicates write an index\n"
+    "			of the sizes and digests of every file to FILE\n"
+    "     --lookup	look up each file named in the index given with\n"
+    "			--index and list any copies of it, exiting with\n"
+    "			status 2 if any were found\n"
+    "     --save-results FILE\n"
+    "			as well as looking for duplicates write the sizes\n"
+    "			and digests found to FILE, an index for --lookup\n"
+    "     --index FILE	index for --lookup\n"
+    "     --verify	with --lookup compare the contents of any copies\n"
+    "			found with the file, if they are accessible\n"
+    "     --exclude-known LIST\n"
+    "			ignore files whose MD5 digest is in LIST, one per\n"
+    "			line as written by md5sum; may be repeated\n"
+    "     --trust-dpkg[=DIR]\n"
+    "			use the MD5 digests recorded by dpkg in DIR (default\n"
+    "			" DPKG_INFO_DIR ") for files not changed since\n"
+    "			their package was installed instead of reading them\n"
+    "     --digest=md5|verity|auto\n"
+    "			group files by MD5 (the default), by fs-verity\n"
+    "			measurement for files which have one or, with auto,\n"
+    "			by fs-verity measurement for sizes at which every\n"
+    "			file has one - only when looking for duplicates\n"
+    "			without --memory-limit or reference roots\n"
+    "     --hash-backend=glib|md5|afalg|multi\n"
+    "			how files are hashed - with glib's MD5 (the\n"
+    "			default), the built-in one or by the kernel through\n"
+    "			an AF_ALG socket, without copying the data, or\n"
+    "			the built-in one hashing small files of the same\n"
+    "			size several at a time\n"
+    "     --hash-benchmark\n"
+    "			instead of looking for duplicates time each hash\n"
+    "			backend on the files found\n"
+    "     --no-overlap	read large files and hash them in turn rather\n"
+    "			than reading ahead on another thread\n"
+    "     --cache-neutral[=dontneed|direct]\n"
+    "			leave the page cache as it was, dropping pages\n"
+    "			which were not cached as they are read or\n"
+    "			reading with O_DIRECT, and report how much of the\n"
+    "			files read was cached before and after\n"
+    "     --hot-first	hash and compare files already in the page cache\n"
+    "			before the others, which are read in disk order\n"
+    "     --throttle RATE\n"
+    "			read files to hash at no more than RATE bytes a\n"
+    "			second, with --hot-first only those not in the\n"
+    "			page cache\n"
+    "     --prefetch[=N]\n"
+    "			read up to N files (default 16) ahead of the one\n"
+    "			being hashed into the page cache, less as memory\n"
+    "			runs short, and report how often it worked -\n"
+    "			not with --cache-neutral\n"
+    "     --mmap		hash and compare larger files on local solid state\n"
+    "			storage through memory mappings rather than\n"
+    "			reading them\n"
     "  -v --verbose	show progress messages\n"
     "  -V --version	display dupfind version\n"
     "  -h --help	display this help message\n\n";
 
+#ifdef DUPFIND_LIBRARY
+int dupfind_main(int argc, char **argv)
+#else
 int main(int argc, char **argv)
+#endif
 {
     char           *ptr;
     int	           opt;
     GTree          *file_tree;
-    tree_foreach_t foreach_data;
     int	           status;
+    int		   found;
+    GList	   *ref_roots = NULL;
+    GList	   *ref_load_files = NULL;
+    GList	   *lptr;
+    const char	   *scratch_dir = g_get_tmp_dir();
+    FILE	   *name_fp;
+    const char	   *export_file = NULL;
+    int		   merge = 0;
+    const char	   *agent_addr = NULL;
+    const char	   *aggregate_addr = NULL;
+    int		   nagent = 0;
+    const char	   *daemon_path = NULL;
+    const char	   *build_index_file = NULL;
+    const char	   *index_file = NULL;
+    int		   lookup = 0;
+    int		   verify = 0;
+    dupfind_options_t lib_opts;
+    dupfind_t	   *df;
+    int		   plain;
+    GList	   *known_files = NULL;
+    const char	   *dpkg_dir = NULL;
+    int		   hash_bench = 0;
+    int		   i;
 
     static struct option long_options[] =
     {
@@ -595,17 +7495,55 @@ int main(int argc, char **argv)
 	{ "delete",    0, 0, 'd' },
 	{ "link",      0, 0, 'l' },
 	{ "stdin",     0, 0, 'i' },
+	{ "any",       0, 0, 'a' },
+	{ "cache",     1, 0, 'c' },
+	{ "full-scan", 0, 0, 'F' },
+	{ "reference", 1, 0, 'R' },
+	{ "save-reference", 1, 0, LOPT_SAVE_REF },
+	{ "load-reference", 1, 0, LOPT_LOAD_REF },
+	{ "missing-from", 1, 0, 'M' },
+	{ "cross-roots", 0, 0, 'x' },
+	{ "memory-limit", 1, 0, LOPT_MEMLIMIT },
+	{ "scratch",   1, 0, LOPT_SCRATCH },
+	{ "two-pass",  0, 0, '2' },
+	{ "shards",    1, 0, LOPT_SHARDS },
+	{ "export",    1, 0, LOPT_EXPORT },
+	{ "node",      1, 0, LOPT_NODE },
+	{ "merge",     0, 0, LOPT_MERGE },
+	{ "agent",     1, 0, LOPT_AGENT },
+	{ "aggregate", 1, 0, LOPT_AGGREGATE },
+	{ "agents",    1, 0, LOPT_NAGENTS },
+	{ "checkpoint", 1, 0, LOPT_CHECKPOINT },
+	{ "checkpoint-every", 1, 0, LOPT_CKPT_EVERY },
+	{ "daemon",    1, 0, LOPT_DAEMON },
+	{ "build-index", 1, 0, LOPT_BUILD_INDEX },
+	{ "lookup",    0, 0, LOPT_LOOKUP },
+	{ "index",     1, 0, LOPT_INDEX },
+	{ "verify",    0, 0, LOPT_VERIFY },
+	{ "save-results", 1, 0, LOPT_SAVE_RESULTS },
+	{ "exclude-known", 1, 0, LOPT_EXCLUDE_KNOWN },
+	{ "trust-dpkg", 2, 0, LOPT_TRUST_DPKG },
+	{ "digest",    1, 0, LOPT_DIGEST },
+	{ "hash-backend", 1, 0, LOPT_HASH_BACKEND },
+	{ "hash-benchmark", 0, 0, LOPT_HASH_BENCH },
+	{ "no-overlap", 0, 0, LOPT_NO_OVERLAP },
+	{ "cache-neutral", 2, 0, LOPT_CACHE_NEUTRAL },
+	{ "hot-first", 0, 0, LOPT_HOT_FIRST },
+	{ "throttle", 1, 0, LOPT_THROTTLE },
+	{ "prefetch", 2, 0, LOPT_PREFETCH },
+	{ "mmap", 0, 0, LOPT_MMAP },
 	{ "verbose",   0, 0, 'v' },
 	{ "version",   0, 0, 'V' },
 	{ "help",      0, 0, 'h' },
 	{ 0,	       0, 0, 0	 }
     };
 
+    memset(&lib_opts, 0, sizeof(lib_opts));
     if ((ptr = strrchr(argv[0], '/')))
 	argv[0] = ptr+1;
     progname = argv[0];
 
-    while ((opt = getopt_long(argc, argv, "rqsHn1fSdlivh", long_options, NULL)) != EOF)
+    while ((opt = getopt_long(argc, argv, "rqsHn1fSdliac:FR:M:x2vh", long_options, NULL)) != EOF)
     {
 	switch (opt)
 	{
@@ -642,6 +7580,165 @@ int main(int argc, char **argv)
 	case 'i':
 	    options |= OPT_STDIN;
 	    break;
+	case 'a':
+	    options |= OPT_ANY;
+	    break;
+	case 'c':
+	    cache_file = optarg;
+	    break;
+	case 'F':
+	    options |= OPT_FULLSCAN;
+	    break;
+	case 'R':
+	    ref_roots = g_list_append(ref_roots, optarg);
+	    break;
+	case 'M':
+	    options |= OPT_MISSING;
+	    ref_roots = g_list_append(ref_roots, optarg);
+	    break;
+	case 'x':
+	    options |= OPT_CROSS;
+	    break;
+	case '2':
+	    options |= OPT_TWOPASS;
+	    break;
+	case LOPT_MEMLIMIT:
+	    if ((memory_limit = parse_size(optarg)) < 1024 * 1024)
+	    {
+		g_critical("memory limit must be at least 1M");
+		return 1;
+	    }
+	    break;
+	case LOPT_SCRATCH:
+	    scratch_dir = optarg;
+	    break;
+	case LOPT_SHARDS:
+	    if ((shards.n = atoi(optarg)) < 1)
+	    {
+		g_critical("number of shards must be at least 1");
+		return 1;
+	    }
+	    break;
+	case LOPT_EXPORT:
+	    export_file = optarg;
+	    break;
+	case LOPT_NODE:
+	    node_name = optarg;
+	    break;
+	case LOPT_MERGE:
+	    merge = 1;
+	    break;
+	case LOPT_AGENT:
+	    agent_addr = optarg;
+	    break;
+	case LOPT_AGGREGATE:
+	    aggregate_addr = optarg;
+	    break;
+	case LOPT_NAGENTS:
+	    nagent = atoi(optarg);
+	    break;
+	case LOPT_CHECKPOINT:
+	    ckpt_file = optarg;
+	    break;
+	case LOPT_CKPT_EVERY:
+	    if ((ckpt_every = parse_size(optarg)) < CHUNK_SIZE)
+	    {
+		g_critical("checkpoint interval must be at least %dK",
+			   CHUNK_SIZE / 1024);
+		return 1;
+	    }
+	    break;
+	case LOPT_DAEMON:
+	    daemon_path = optarg;
+	    break;
+	case LOPT_BUILD_INDEX:
+	    build_index_file = optarg;
+	    break;
+	case LOPT_LOOKUP:
+	    lookup = 1;
+	    break;
+	case LOPT_INDEX:
+	    index_file = optarg;
+	    break;
+	case LOPT_VERIFY:
+	    verify = 1;
+	    break;
+	case LOPT_SAVE_RESULTS:
+	    lib_opts.results_file = optarg;
+	    break;
+	case LOPT_DIGEST:
+	    if (!strcmp(optarg, "md5"))
+		digest_mode = DIGEST_MD5;
+	    else if (!strcmp(optarg, "verity"))
+		digest_mode = DIGEST_VERITY;
+	    else if (!strcmp(optarg, "auto"))
+		digest_mode = DIGEST_AUTO;
+	    else
+	    {
+		g_critical("digest must be md5, verity or auto");
+		return 1;
+	    }
+	    break;
+	case LOPT_HASH_BACKEND:
+	    for (i = 0; i < G_N_ELEMENTS(hash_backends); i++)
+		if (!strcmp(optarg, hash_backends[i].name))
+		    break;
+	    if (i == G_N_ELEMENTS(hash_backends))
+	    {
+		g_critical("hash backend must be glib, md5, afalg or multi");
+		return 1;
+	    }
+	    hash_func = hash_backends[i].func;
+	    break;
+	case LOPT_HASH_BENCH:
+	    hash_bench = 1;
+	    break;
+	case LOPT_NO_OVERLAP:
+	    overlap = 0;
+	    break;
+	case LOPT_MMAP:
+	    use_mmap = 1;
+	    break;
+	case LOPT_PREFETCH:
+	    if ((prefetch_files = optarg ? atoi(optarg) : PREFETCH_FILES) < 1)
+	    {
+		g_critical("prefetch must be at least one file ahead");
+		return 1;
+	    }
+	    break;
+	case LOPT_HOT_FIRST:
+	    hot_first = 1;
+	    break;
+	case LOPT_THROTTLE:
+	    if ((throttle_rate = parse_size(optarg)) == 0)
+	    {
+		g_critical("invalid throttle rate '%s'", optarg);
+		return 1;
+	    }
+	    break;
+	case LOPT_CACHE_NEUTRAL:
+	    if (optarg == NULL || !strcmp(optarg, "dontneed"))
+		cache_mode = CACHE_DONTNEED;
+	    else if (!strcmp(optarg, "direct"))
+		cache_mode = CACHE_DIRECT;
+	    else
+	    {
+		g_critical("cache-neutral mode must be dontneed or direct");
+		return 1;
+	    }
+	    break;
+	case LOPT_TRUST_DPKG:
+	    dpkg_dir = optarg ? optarg : DPKG_INFO_DIR;
+	    break;
+	case LOPT_EXCLUDE_KNOWN:
+	    known_files = g_list_append(known_files, optarg);
+	    break;
+	case LOPT_SAVE_REF:
+	    ref_save_file = optarg;
+	    break;
+	case LOPT_LOAD_REF:
+	    ref_load_files = g_list_append(ref_load_files, optarg);
+	    break;
 	case 'v':
 	    options |= OPT_VERBOSE;
 	    break;
@@ -661,6 +7758,142 @@ int main(int argc, char **argv)
 	g_critical("link and delete are mutually exclusive");
 	return 1;
     }
+    if ((options & OPT_ANY) && (options & (OPT_DELETE|OPT_LINK)))
+    {
+	g_critical("any is incompatible with link and delete");
+	return 1;
+    }
+    if ((options & OPT_MISSING) && (options & (OPT_DELETE|OPT_LINK|OPT_ANY)))
+    {
+	g_critical("missing-from cannot be used with link, delete or any");
+	return 1;
+    }
+    if (memory_limit && (cache_file || ref_roots || ref_load_files ||
+			 (options & OPT_DELETE)))
+    {
+	g_critical("memory-limit cannot be used with cache, reference roots"
+		   " or delete");
+	return 1;
+    }
+    if ((options & (OPT_TWOPASS|OPT_MISSING)) == (OPT_TWOPASS|OPT_MISSING) ||
+	((options & OPT_TWOPASS) && (cache_file || memory_limit ||
+				     ref_save_file)))
+    {
+	g_critical("two-pass cannot be used with cache, memory-limit,"
+		   " missing-from or save-reference");
+	return 1;
+    }
+    if (shards.n && (cache_file || memory_limit || ref_save_file ||
+		     ckpt_file || (options & (OPT_TWOPASS|OPT_DELETE))))
+    {
+	g_critical("shards cannot be used with cache, memory-limit, two-pass,"
+		   " save-reference, checkpoint or delete");
+	return 1;
+    }
+    if ((options & OPT_ANY) && (ref_roots || ref_load_files))
+    {
+	g_critical("any cannot be used with reference roots");
+	return 1;
+    }
+    if (ref_load_files && (options & OPT_DELETE))
+    {
+	g_critical("load-reference cannot be used with delete");
+	return 1;
+    }
+    if (ref_save_file && !ref_roots && !ref_load_files)
+    {
+	g_critical("no reference roots to save");
+	return 1;
+    }
+    if ((hot_first || throttle_rate) &&
+	(memory_limit || ref_roots || ref_load_files || export_file ||
+	 agent_addr || build_index_file || hash_bench || daemon_path ||
+	 digest_mode == DIGEST_AUTO || hash_func == hash_multi ||
+	 (options & (OPT_CROSS|OPT_ANY))))
+    {
+	g_critical("hot-first and throttle cannot be used with cross-roots,"
+		   " any, digest=auto, the multi backend, memory-limit,"
+		   " reference roots, export, agent, build-index,"
+		   " hash-benchmark or daemon");
+	return 1;
+    }
+    if (known_files && digest_mode != DIGEST_MD5)
+    {
+	g_critical("exclude-known cannot be used with digest");
+	return 1;
+    }
+    if (digest_mode != DIGEST_MD5 &&
+	(memory_limit || ref_roots || ref_load_files || export_file ||
+	 agent_addr || build_index_file || hash_bench || daemon_path))
+    {
+	g_critical("digest cannot be used with memory-limit, reference roots,"
+		   " export, agent, build-index, hash-benchmark or daemon");
+	return 1;
+    }
+    if (prefetch_files &&
+	(memory_limit || ref_roots || ref_load_files || export_file ||
+	 agent_addr || build_index_file || hash_bench || daemon_path ||
+	 digest_mode == DIGEST_AUTO || hash_func == hash_multi ||
+	 (options & (OPT_CROSS|OPT_ANY))))
+    {
+	g_critical("prefetch cannot be used with cross-roots, any,"
+		   " digest=auto, the multi backend, memory-limit, reference"
+		   " roots, export, agent, build-index, hash-benchmark or"
+		   " daemon");
+	return 1;
+    }
+    if (merge)
+    {
+	if (optind == argc)
+	{
+	    g_critical("no signature files to merge");
+	    return 1;
+	}
+	return merge_signatures(argv + optind, argc - optind);
+    }
+    if (lookup)
+    {
+	if (index_file == NULL || optind == argc)
+	{
+	    g_critical("lookup needs an index and files to look up");
+	    return 1;
+	}
+	return run_lookup(index_file, argv + optind, verify);
+    }
+    if (node_name == NULL)
+	node_name = g_get_host_name();
+    if (ckpt_file && load_checkpoints())
+	return 1;
+    if (known_files)
+    {
+	for (lptr = known_files; lptr; lptr = lptr->next)
+	    if (load_known(lptr->data))
+		return 1;
+	known_finish();
+    }
+    if (dpkg_dir && load_dpkg(dpkg_dir) && !pkg_sums)
+	return 1;
+    if (hash_func == hash_afalg && afalg_open() != 0)
+    {
+	g_warning("AF_ALG hashing not available - %m - using glib");
+	hash_func = hash_glib;
+    }
+    if (aggregate_addr)
+    {
+	if (nagent < 1)
+	{
+	    g_critical("number of agents must be given with aggregate");
+	    return 1;
+	}
+	return run_aggregator(aggregate_addr, nagent);
+    }
+    if ((export_file || agent_addr || build_index_file || hash_bench) &&
+	(memory_limit || shards.n || (options & OPT_TWOPASS)))
+    {
+	g_critical("export, agent, build-index and hash-benchmark cannot be"
+		   " used with memory-limit, shards or two-pass");
+	return 1;
+    }
     if (optind == argc && !(options & OPT_STDIN))
     {
 	g_critical("nothing to do - try 'dupfind --help'");
@@ -668,30 +7901,139 @@ int main(int argc, char **argv)
     }
     if (options & OPT_SYMLINKS)
 	stat_func = stat;
+    if (daemon_path)
+    {
+	if (memory_limit || shards.n || export_file || agent_addr ||
+	    ref_roots || ref_load_files || dpkg_dir ||
+	    (options & (OPT_TWOPASS|OPT_STDIN|OPT_ANY|OPT_DELETE|OPT_LINK)))
+	{
+	    g_critical("daemon cannot be used with memory-limit, shards,"
+		       " export, agent, reference roots, trust-dpkg, two-pass,"
+		       " stdin, any, delete or link");
+	    return 1;
+	}
+	if (optind == argc)
+	{
+	    g_critical("nothing to index - try 'dupfind --help'");
+	    return 1;
+	}
+	return run_daemon(daemon_path, argv + optind);
+    }
     status = 0;
 
+    /* The plain search is made through the library interface, with the
+     * options which have no library flag set on the scan directly. */
+
+    plain = !(ref_roots || ref_load_files || export_file || agent_addr ||
+	      build_index_file || hash_bench || shards.n || memory_limit ||
+	      (options & (OPT_ANY|OPT_TWOPASS|OPT_STDIN)));
+    if (lib_opts.results_file && (!plain || (options & OPT_CROSS)))
+    {
+	g_critical("save-results can only be used with a plain search");
+	return 1;
+    }
+    if (plain)
+    {
+	lib_opts.cache_file = cache_file;
+	df = dupfind_new(&lib_opts);
+	df->options = options;
+	df->single_run = 1;
+	for (; optind < argc; optind++)
+	    dupfind_add(df, argv[optind]);
+	return dupfind_run(df);
+    }
+
     /* Phase one - build the file list */
 
     if (options & OPT_VERBOSE)
 	g_log(NULL, G_LOG_LEVEL_INFO, "building file list");
+    clock_gettime(CLOCK_REALTIME, &scan_start);
+    if (cache_file && !(options & OPT_FULLSCAN))
+	scan_cache = load_cache(cache_file);
+    keep_digests = cache_file || ref_save_file;
+    if (memory_limit && ooc_start(scratch_dir))
+	return 1;
+    if (shards.n && shards_start(ref_roots || ref_load_files))
+	return 1;
     file_tree = g_tree_new((GCompareFunc)strcmp);
-    while (optind < argc)
-	status += do_fsobj(file_tree, argv[optind++]);
-    if (options & OPT_STDIN)
-	status += do_stdin(file_tree);
+    name_fp = (options & OPT_STDIN) ? stdin : NULL;
 
-    /* Phase two - group files by message digest */
+    /* In --two-pass mode a first walk only counts the file sizes.  Any
+     * saved reference sets are loaded first so their sizes count too.
+     * Errors are counted on the second walk only. */
 
-    if (options & OPT_VERBOSE)
-	g_log(NULL, G_LOG_LEVEL_INFO, "calculating digests");
-    foreach_data.hash = g_hash_table_new(g_str_hash, g_str_equal);
-    foreach_data.digest =g_checksum_new(G_CHECKSUM_MD5);
-    g_tree_foreach(file_tree, file_foreach, &foreach_data);
+    if (options & OPT_TWOPASS)
+    {
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO, "counting file sizes");
+	if (name_fp && (name_fp = copy_stdin()) == NULL)
+	    return 1;
+	for (lptr = ref_load_files; lptr; lptr = lptr->next)
+	    status += load_reference(file_tree, lptr->data);
+	size_filter = g_malloc0((1 << SIZE_FILTER_BITS) / 4);
+	g_tree_foreach(file_tree, count_foreach, NULL);
+	add_func = count_size;
+	walk_roots(file_tree, ref_roots, NULL, argv + optind, name_fp);
+	add_func = add_shared;
+	if (name_fp)
+	    rewind(name_fp);
+    }
+    status += walk_roots(file_tree, ref_roots,
+			 (options & OPT_TWOPASS) ? NULL : ref_load_files,
+			 argv + optind, name_fp);
 
-    /* Phase three - check for exact match and carry out actions */
+    /* With --export phases two and three are replaced by writing the
+     * signatures of all the files. */
 
-    if (options & OPT_VERBOSE)
-	g_log(NULL, G_LOG_LEVEL_INFO, "performing required actions");
-    g_hash_table_foreach(foreach_data.hash, digest_foreach, NULL);
-    return status;
+    if (export_file)
+    {
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO, "exporting signatures");
+	return status + export_signatures(file_tree, export_file);
+    }
+
+    /* With --hash-benchmark phases two and three are replaced by timing
+     * the hash backends. */
+
+    if (hash_bench)
+	return status + hash_benchmark(file_tree);
+
+    /* With --build-index phases two and three are replaced by writing the
+     * index. */
+
+    if (build_index_file)
+    {
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO, "building index");
+	return status + build_index(file_tree, build_index_file);
+    }
+
+    /* In agent mode phases two and three are replaced by answering the
+     * aggregator's requests. */
+
+    if (agent_addr)
+	return status + run_agent(file_tree, agent_addr);
+
+    /* In sharded mode phases two and three are done by the workers. */
+
+    if (shards.n)
+    {
+	g_tree_foreach(file_tree, shard_foreach, NULL);
+	return shards_finish(status);
+    }
+
+    /* In out-of-core mode phases two and three are done by merging the
+     * runs written during phase one. */
+
+    if (memory_limit)
+    {
+	if (options & OPT_VERBOSE)
+	    g_log(NULL, G_LOG_LEVEL_INFO, "merging and checking size groups");
+	found = ooc_finish();
+	if (options & OPT_ANY)
+	    return found ? ANY_FOUND_STATUS : status ? 1 : 0;
+	return status;
+    }
+
+    return check_files(file_tree, ref_roots || ref_load_files, status);
 }
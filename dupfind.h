@@ -0,0 +1,108 @@
+/*
+ * dupfind - find duplicate files and list or operate upon them.
+ *
+ * Copyright (C) 2003 Steve Fosdick.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307	 USA
+ *
+ *
+ * The interface to libdupfind, the dupfind engine built as a library.
+ *
+ * A scan is created with dupfind_new, given the files and directories to
+ * search with dupfind_add and run with dupfind_run, which calls the group
+ * callback for each set of identical files found, the files having been
+ * compared byte by byte.  The handle keeps the file list and digests
+ * from one run to the next so a later run on the same handle only reads
+ * files which have changed.  With DUPFIND_CROSS_ROOTS files whose size
+ * is only found under one root are not hashed and so are left out of
+ * the results file.
+ *
+ * The engine keeps its state in static variables so only one handle may
+ * be run at a time.  Apart from dupfind_cancel, which may be called from
+ * another thread or a signal handler, a handle must only be used by one
+ * thread.
+ */
+
+#ifndef DUPFIND_H
+#define DUPFIND_H
+
+#include <sys/types.h>
+
+/* Flags for dupfind_options_t */
+
+enum
+{
+    DUPFIND_RECURSE	= 0x01,	/* descend into directories */
+    DUPFIND_SYMLINKS	= 0x02,	/* follow symbolic links */
+    DUPFIND_HARDLINKS	= 0x04,	/* treat hard links as duplicates */
+    DUPFIND_NOEMPTY	= 0x08,	/* ignore zero-length files */
+    DUPFIND_CROSS_ROOTS = 0x10,	/* only groups spanning more than one root */
+    DUPFIND_LINK	= 0x20,	/* hard link each group together */
+    DUPFIND_FULL_SCAN	= 0x40,	/* do not trust directories in the cache */
+    DUPFIND_QUIET	= 0x80	/* fewer warnings */
+};
+
+/* Phases reported to the progress callback */
+
+enum
+{
+    DUPFIND_PHASE_LIST = 1,	/* building the file list */
+    DUPFIND_PHASE_DIGEST,	/* calculating digests */
+    DUPFIND_PHASE_CHECK		/* comparing files with the same digest */
+};
+
+/* Value returned by dupfind_run when the run was cancelled */
+
+#define DUPFIND_CANCELLED (-1)
+
+/* Called for each set of identical files with their names, the first
+ * being the one the others were compared with, and their size.  The
+ * names are only valid during the call.  Returning non-zero cancels the
+ * run. */
+
+typedef int (*dupfind_group_func)(const char *const *names, int nfile,
+				  off_t size, void *udata);
+
+/* Called as each file is found, each file is hashed and each group of
+ * files with the same digest is checked, with the number done so far in
+ * the phase and the total, which is zero while the file list is being
+ * built.  Returning non-zero cancels the run. */
+
+typedef int (*dupfind_progress_func)(int phase, unsigned long done,
+				     unsigned long total, void *udata);
+
+typedef struct
+{
+    unsigned int	  flags;
+    const char		  *cache_file;	/* scan cache, as --cache */
+    const char		  *results_file; /* index, as --save-results */
+    dupfind_group_func	  group;	/* NULL to list groups on stdout */
+    dupfind_progress_func progress;	/* may be NULL */
+    void		  *udata;	/* passed to the callbacks */
+} dupfind_options_t;
+
+typedef struct dupfind dupfind_t;
+
+extern dupfind_t *dupfind_new(const dupfind_options_t *opts);
+extern void dupfind_add(dupfind_t *df, const char *name);
+extern int dupfind_run(dupfind_t *df);
+extern void dupfind_cancel(dupfind_t *df);
+extern void dupfind_free(dupfind_t *df);
+
+/* The dupfind command itself, for running it in-process. */
+
+extern int dupfind_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * md5.c - MD5 message digest with a state that can be saved and restored.
+ *
+ * Copyright (C) 2003 Steve Fosdick.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ */
+
+#include <string.h>
+
+#include "md5.h"
+
+/* The four auxiliary functions and the rotate from RFC 1321 */
+
+#define F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = ROTL((a), (s)) + (b)
+
+/* The 64 steps of the four rounds, used on scalars by md5_block and
+ * on vectors of lanes by md5_block_multi. */
+
+#define ROUNDS(a, b, c, d, x) \
+    STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7); \
+    STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12); \
+    STEP(F, c, d, a, b, x[ 2], 0x242070db, 17); \
+    STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22); \
+    STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7); \
+    STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12); \
+    STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17); \
+    STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22); \
+    STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7); \
+    STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12); \
+    STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17); \
+    STEP(F, b, c, d, a, x[11], 0x895cd7be, 22); \
+    STEP(F, a, b, c, d, x[12], 0x6b901122,  7); \
+    STEP(F, d, a, b, c, x[13], 0xfd987193, 12); \
+    STEP(F, c, d, a, b, x[14], 0xa679438e, 17); \
+    STEP(F, b, c, d, a, x[15], 0x49b40821, 22); \
+    STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5); \
+    STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9); \
+    STEP(G, c, d, a, b, x[11], 0x265e5a51, 14); \
+    STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20); \
+    STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5); \
+    STEP(G, d, a, b, c, x[10], 0x02441453,  9); \
+    STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14); \
+    STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20); \
+    STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5); \
+    STEP(G, d, a, b, c, x[14], 0xc33707d6,  9); \
+    STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14); \
+    STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20); \
+    STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5); \
+    STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9); \
+    STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14); \
+    STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20); \
+    STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4); \
+    STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11); \
+    STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16); \
+    STEP(H, b, c, d, a, x[14], 0xfde5380c, 23); \
+    STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4); \
+    STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11); \
+    STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16); \
+    STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23); \
+    STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4); \
+    STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11); \
+    STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16); \
+    STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23); \
+    STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4); \
+    STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11); \
+    STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16); \
+    STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23); \
+    STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6); \
+    STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10); \
+    STEP(I, c, d, a, b, x[14], 0xab9423a7, 15); \
+    STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21); \
+    STEP(I, a, b, c, d, x[12], 0x655b59c3,  6); \
+    STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10); \
+    STEP(I, c, d, a, b, x[10], 0xffeff47d, 15); \
+    STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21); \
+    STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6); \
+    STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10); \
+    STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15); \
+    STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21); \
+    STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6); \
+    STEP(I, d, a, b, c, x[11], 0xbd3af235, 10); \
+    STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15); \
+    STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21)
+
+/* Processes one 64 byte block. */
+
+static void md5_block(uint32_t state[4], const unsigned char *p)
+{
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t x[16];
+    int	     i;
+
+    for (i = 0; i < 16; i++, p += 4)
+	x[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+    ROUNDS(a, b, c, d, x);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void md5_init(md5_ctx_t *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void md5_update(md5_ctx_t *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t		used = ctx->count % MD5_BLOCK;
+    size_t		n;
+
+    ctx->count += len;
+    if (used)
+    {
+	n = MD5_BLOCK - used;
+	if (len < n)
+	{
+	    memcpy(ctx->buf + used, p, len);
+	    return;
+	}
+	memcpy(ctx->buf + used, p, n);
+	md5_block(ctx->state, ctx->buf);
+	p += n;
+	len -= n;
+    }
+    for (; len >= MD5_BLOCK; p += MD5_BLOCK, len -= MD5_BLOCK)
+	md5_block(ctx->state, p);
+    memcpy(ctx->buf, p, len);
+}
+
+void md5_final(md5_ctx_t *ctx, unsigned char digest[MD5_DIGEST])
+{
+    static const unsigned char pad[MD5_BLOCK] = { 0x80 };
+    unsigned char bits[8];
+    uint64_t	  nbits = ctx->count << 3;
+    size_t	  used = ctx->count % MD5_BLOCK;
+    int		  i;
+
+    for (i = 0; i < 8; i++)
+	bits[i] = nbits >> (i * 8);
+    md5_update(ctx, pad, used < 56 ? 56 - used : 120 - used);
+    md5_update(ctx, bits, 8);
+    for (i = 0; i < MD5_DIGEST; i++)
+	digest[i] = ctx->state[i / 4] >> ((i % 4) * 8);
+}
+
+/* Multi-buffer MD5.  Each lane of a vector holds the state of a
+ * separate message so one pass through the rounds hashes a block from
+ * each of MD5_LANES messages.  GCC turns the vector operations into
+ * SSE2 code, or AVX2 in the clone chosen at run time on CPUs which have
+ * it, with plain scalar code on other architectures. */
+
+typedef uint32_t md5_vec_t __attribute__((vector_size(MD5_LANES * 4)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void md5_block_multi(md5_vec_t state[4], const unsigned char *p[],
+			    int n)
+{
+    md5_vec_t		a = state[0], b = state[1], c = state[2], d = state[3];
+    md5_vec_t		x[16];
+    const unsigned char *q;
+    int			i, l;
+
+    memset(x, 0, sizeof(x));
+    for (l = 0; l < n; l++)
+	for (i = 0, q = p[l]; i < 16; i++, q += 4)
+	    x[i][l] = q[0] | (q[1] << 8) | (q[2] << 16) | ((uint32_t)q[3] << 24);
+
+    ROUNDS(a, b, c, d, x);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void md5_multi(const unsigned char *const data[], int n, size_t len,
+	       unsigned char digest[][MD5_DIGEST])
+{
+    static const uint32_t init[4] =
+	{ 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned char	tail[MD5_LANES][MD5_BLOCK * 2];
+    const unsigned char *p[MD5_LANES];
+    md5_vec_t		state[4];
+    uint64_t		nbits = (uint64_t)len << 3;
+    size_t		full = len - len % MD5_BLOCK;
+    size_t		ntail = len % MD5_BLOCK < 56 ? MD5_BLOCK : MD5_BLOCK * 2;
+    size_t		off;
+    int			i, l;
+
+    for (i = 0; i < 4; i++)
+	for (l = 0; l < MD5_LANES; l++)
+	    state[i][l] = init[i];
+
+    /* The messages are all the same length so the padding is the same
+     * for each and they finish together. */
+
+    for (l = 0; l < n; l++)
+    {
+	memset(tail[l], 0, ntail);
+	memcpy(tail[l], data[l] + full, len - full);
+	tail[l][len - full] = 0x80;
+	for (i = 0; i < 8; i++)
+	    tail[l][ntail - 8 + i] = nbits >> (i * 8);
+    }
+    for (off = 0; off < full; off += MD5_BLOCK)
+    {
+	for (l = 0; l < n; l++)
+	    p[l] = data[l] + off;
+	md5_block_multi(state, p, n);
+    }
+    for (off = 0; off < ntail; off += MD5_BLOCK)
+    {
+	for (l = 0; l < n; l++)
+	    p[l] = tail[l] + off;
+	md5_block_multi(state, p, n);
+    }
+    for (l = 0; l < n; l++)
+	for (i = 0; i < MD5_DIGEST; i++)
+	    digest[l][i] = state[i / 4][l] >> ((i % 4) * 8);
+}
+
+void md5_hex(const unsigned char digest[MD5_DIGEST],
+	     char hex[MD5_DIGEST * 2 + 1])
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < MD5_DIGEST; i++)
+    {
+	hex[i * 2] = digits[digest[i] >> 4];
+	hex[i * 2 + 1] = digits[digest[i] & 15];
+    }
+    hex[MD5_DIGEST * 2] = '\0';
+}
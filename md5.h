@@ -0,0 +1,47 @@
+/*
+ * md5.h - MD5 message digest with a state that can be saved and restored.
+ *
+ * Copyright (C) 2003 Steve Fosdick.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * This is a plain implementation of RFC 1321.  Unlike the digest
+ * engines in glib and libgcrypt the context is an ordinary structure,
+ * so the state part way through a file can be written out and hashing
+ * carried on from that point later, by a different process.
+ */
+
+#ifndef MD5_H
+#define MD5_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MD5_BLOCK  64
+#define MD5_DIGEST 16
+#define MD5_LANES  8	/* messages hashed at once by md5_multi */
+
+typedef struct
+{
+    uint32_t	  state[4];
+    uint64_t	  count;	/* bytes hashed so far */
+    unsigned char buf[MD5_BLOCK];
+} md5_ctx_t;
+
+extern void md5_init(md5_ctx_t *ctx);
+extern void md5_update(md5_ctx_t *ctx, const void *data, size_t len);
+extern void md5_final(md5_ctx_t *ctx, unsigned char digest[MD5_DIGEST]);
+extern void md5_multi(const unsigned char *const data[], int n, size_t len,
+		      unsigned char digest[][MD5_DIGEST]);
+extern void md5_hex(const unsigned char digest[MD5_DIGEST],
+		    char hex[MD5_DIGEST * 2 + 1]);
+
+#endif
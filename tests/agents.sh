@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Loopback test of agent and aggregator modes: three agents on this
+# machine, each with its own tree, talk to an aggregator over TCP on
+# 127.0.0.1.  Besides a few files whose copies span agents, each agent
+# has enough files shared with the others that the requests and
+# replies of the digest stages run to many frames, which is where the
+# aggregator and an agent could once block writing to each other.
+#
+# Run from the top of the tree with DUPFIND set to the binary to test.
+
+DUPFIND=${DUPFIND:-./dupfind}
+NBULK=${NBULK:-3000}
+PORT=${PORT:-$((40000 + $$ % 20000))}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+    echo "agents: $*" >&2
+    exit 1
+}
+
+# The files: x is on a and b, y on a and c, z only on b and w, which
+# has the same size as y, only on b.
+
+mkdir -p "$tmp/a" "$tmp/b" "$tmp/c"
+echo xxxxxxx >"$tmp/a/x"
+echo xxxxxxx >"$tmp/b/x2"
+echo yyyyyyyyy >"$tmp/a/y"
+echo yyyyyyyyy >"$tmp/c/y2"
+echo wwwwwwwww >"$tmp/b/w"
+echo zzzzzzzzzzzzzzzzzzzzz >"$tmp/b/z"
+
+# The bulk files, the same on every agent, of a few sizes so each size
+# has many different partial digests.
+
+for n in a b c
+do
+    mkdir "$tmp/$n/bulk"
+    i=0
+    while [ $i -lt "$NBULK" ]
+    do
+	printf 'bulk file %06d padded out to a size %*s\n' $i $((i % 5)) "" \
+	    >"$tmp/$n/bulk/file-with-a-fairly-long-name-$i"
+	i=$((i + 1))
+    done
+done
+
+timeout 120 "$DUPFIND" --aggregate "127.0.0.1:$PORT" --agents 3 \
+    >"$tmp/out" 2>"$tmp/err" &
+agg=$!
+sleep 1
+for n in a b c
+do
+    timeout 120 "$DUPFIND" -r --node $n --agent "127.0.0.1:$PORT" \
+	"$tmp/$n" 2>>"$tmp/err" &
+done
+wait $agg || fail "aggregator failed: $(cat "$tmp/err")"
+wait
+
+# Join each group onto one line so the groups can be compared in any
+# order.
+
+awk -v RS= '{ gsub(/ *\n/, " "); print }' "$tmp/out" | sort >"$tmp/groups"
+
+grep -qx "a:$tmp/a/x b:$tmp/b/x2" "$tmp/groups" ||
+    fail "group of x not found"
+grep -qx "a:$tmp/a/y c:$tmp/c/y2" "$tmp/groups" ||
+    fail "group of y not found"
+grep -q "$tmp/b/[wz]" "$tmp/groups" &&
+    fail "file on one agent only listed"
+[ "$(grep -c bulk "$tmp/groups")" -eq "$NBULK" ] ||
+    fail "expected $NBULK bulk groups, got $(grep -c bulk "$tmp/groups")"
+[ "$(wc -l <"$tmp/groups")" -eq $((NBULK + 2)) ] ||
+    fail "unexpected groups listed"
+echo "agents: ok"
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Test of --trust-dpkg against the fixture dpkg info directory in
+# tests/dpkg/info, whose md5sums file records digests, some of them
+# wrong on purpose, for files under a temporary directory.  A recorded
+# digest should be used to group the files but never trusted as the
+# contents: the files are still compared, it does not exclude a file
+# as known and it is not written to the scan cache or a saved
+# reference set.
+#
+# Run from the top of the tree with DUPFIND set to the binary to test.
+
+DUPFIND=${DUPFIND:-./dupfind}
+FIXTURE=$(dirname "$0")/dpkg
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+    echo "dpkg: $*" >&2
+    exit 1
+}
+
+# The files: lie1 and lie2 differ but are recorded with the same
+# digest, known1 and known2 are copies recorded with a known digest,
+# trust1 and trust2 are copies recorded with different digests and so
+# are stale1 and stale2, which have changed since they were installed.
+# gone1 and gone2 are copies not in the package whose digest is known.
+
+dir=$tmp/usr/share/fixture
+mkdir -p "$dir" "$tmp/info"
+echo 'lie 1' >"$dir/lie1"
+echo 'lie 2' >"$dir/lie2"
+echo kept >"$dir/known1"
+echo kept >"$dir/known2"
+echo trusted >"$dir/trust1"
+echo trusted >"$dir/trust2"
+echo changed >"$dir/stale1"
+echo changed >"$dir/stale2"
+echo gone >"$dir/gone1"
+echo gone >"$dir/gone2"
+touch -d '1 hour' "$dir/stale1" "$dir/stale2"
+
+root=${tmp#/}
+for f in "$FIXTURE"/info/*
+do
+    sed "s|@ROOT@|$root|" "$f" >"$tmp/info/${f##*/}"
+done
+
+"$DUPFIND" -r --trust-dpkg="$tmp/info" --exclude-known "$FIXTURE/known" \
+    -c "$tmp/cache" -R "$dir" --save-reference "$tmp/ref" "$tmp/usr" \
+    >"$tmp/out" 2>"$tmp/err" || fail "dupfind failed: $(cat "$tmp/err")"
+"$DUPFIND" -r --trust-dpkg="$tmp/info" --exclude-known "$FIXTURE/known" \
+    "$tmp/usr" >"$tmp/out" 2>"$tmp/err" ||
+    fail "dupfind failed: $(cat "$tmp/err")"
+
+awk -v RS= '{ gsub(/ *\n/, " "); print }' "$tmp/out" | sort >"$tmp/groups"
+
+grep -qx "$dir/known1 $dir/known2" "$tmp/groups" ||
+    fail "files with a known package digest excluded"
+grep -qx "$dir/stale1 $dir/stale2" "$tmp/groups" ||
+    fail "changed files not read"
+grep -q "$dir/lie" "$tmp/groups" &&
+    fail "files with the same package digest not compared"
+grep -q "$dir/trust" "$tmp/groups" &&
+    fail "package digests not used"
+grep -q "$dir/gone" "$tmp/groups" &&
+    fail "known files not excluded"
+[ "$(wc -l <"$tmp/groups")" -eq 2 ] || fail "unexpected groups listed"
+grep -q "6 files, 38 bytes, not read" "$tmp/err" ||
+    fail "package digests not reported"
+
+for digest in $(cut -d' ' -f1 "$FIXTURE/info/fixture.md5sums")
+do
+    grep -q "$digest" "$tmp/cache" && fail "package digest in scan cache"
+    grep -q "$digest" "$tmp/ref" && fail "package digest in reference set"
+done
+grep -q "$(echo changed | md5sum | cut -d' ' -f1)" "$tmp/cache" ||
+    fail "digest read not in scan cache"
+
+"$DUPFIND" -r --trust-dpkg="$tmp/info" --daemon "$tmp/sock" "$tmp/usr" \
+    2>/dev/null && fail "daemon started with trust-dpkg"
+echo "dpkg: ok"